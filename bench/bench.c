@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libivee/libivee.h>
+
+/*
+ * Benchmark suite.
+ *
+ * Every result is printed to stdout as a single "<metric> <value>" line, metric names carry their unit,
+ * so outputs of different library versions can be compared with diff or joined by metric name.
+ * Progress and errors go to stderr.
+ */
+
+#define WARMUP_CALLS        10000
+#define LATENCY_SAMPLES     200000
+#define RATE_RUN_TIME_NS    500000000ull
+#define LOAD_SAMPLES        200
+#define FIRST_CALL_SAMPLES  1000
+#define MAX_THREADS         64
+
+static const size_t g_payload_sizes[] = { 4096, 65536, 1048576, 16777216 };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void check(int res, const char* what)
+{
+    if (res != 0) {
+        fprintf(stderr, "%s failed: %s\n", what, strerror(-res));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void print_metric(const char* name, double value)
+{
+    printf("%s %.0f\n", name, value);
+    fflush(stdout);
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+    uint64_t sa = *(const uint64_t*)a;
+    uint64_t sb = *(const uint64_t*)b;
+    return (sa > sb) - (sa < sb);
+}
+
+/* Sort samples and print their percentiles as <prefix>.p50_ns etc */
+static void print_percentiles(const char* prefix, uint64_t* samples, size_t count)
+{
+    static const struct {
+        const char* name;
+        double quantile;
+    } percentiles[] = {
+        { "p50_ns", 0.5 },
+        { "p99_ns", 0.99 },
+        { "p999_ns", 0.999 },
+    };
+
+    qsort(samples, count, sizeof(*samples), compare_samples);
+
+    char name[128];
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles); ++i) {
+        snprintf(name, sizeof(name), "%s.%s", prefix, percentiles[i].name);
+        print_metric(name, samples[(size_t)(percentiles[i].quantile * (count - 1))]);
+    }
+
+    snprintf(name, sizeof(name), "%s.max_ns", prefix);
+    print_metric(name, samples[count - 1]);
+}
+
+static ivee_t* create_loaded(const char* file, ivee_executable_format_t format)
+{
+    ivee_t* ivee = NULL;
+    check(ivee_create(0, &ivee), "ivee_create");
+    check(ivee_load_executable(ivee, file, format), file);
+    return ivee;
+}
+
+/* Round trip of a call that exits right away */
+static void bench_call_latency(void)
+{
+    ivee_t* ivee = create_loaded("null_payload.elf64", IVEE_EXEC_ELF64);
+
+    for (size_t i = 0; i < WARMUP_CALLS; ++i) {
+        ivee_arch_state_t state = { 0 };
+        check(ivee_call(ivee, &state), "ivee_call");
+    }
+
+    uint64_t* samples = malloc(LATENCY_SAMPLES * sizeof(*samples));
+    if (!samples) {
+        check(-ENOMEM, "malloc");
+    }
+
+    for (size_t i = 0; i < LATENCY_SAMPLES; ++i) {
+        ivee_arch_state_t state = { 0 };
+
+        uint64_t start = now_ns();
+        int res = ivee_call(ivee, &state);
+        samples[i] = now_ns() - start;
+
+        check(res, "ivee_call");
+    }
+
+    print_percentiles("call.latency", samples, LATENCY_SAMPLES);
+
+    free(samples);
+    ivee_destroy(ivee);
+}
+
+/* First call into fresh clones, with and without low latency profile, compare to call.latency */
+static void bench_first_call(const char* profile, ivee_create_flags_t flags)
+{
+    ivee_create_options_t options;
+    ivee_init_create_options(&options);
+    options.flags = flags;
+
+    ivee_t* tmpl = NULL;
+    check(ivee_create_ex(&options, &tmpl), "ivee_create_ex");
+    check(ivee_load_executable(tmpl, "null_payload.elf64", IVEE_EXEC_ELF64), "null_payload.elf64");
+
+    uint64_t samples[FIRST_CALL_SAMPLES];
+    for (size_t i = 0; i < FIRST_CALL_SAMPLES; ++i) {
+        ivee_t* ivee = NULL;
+        check(ivee_clone(tmpl, &ivee), "ivee_clone");
+
+        ivee_arch_state_t state = { 0 };
+
+        uint64_t start = now_ns();
+        int res = ivee_call(ivee, &state);
+        samples[i] = now_ns() - start;
+
+        check(res, "ivee_call");
+        ivee_destroy(ivee);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "call.first.%s", profile);
+    print_percentiles(name, samples, FIRST_CALL_SAMPLES);
+
+    ivee_destroy(tmpl);
+}
+
+/* Environments created and destroyed per second, from scratch and by cloning a loaded template */
+static void bench_create(void)
+{
+    uint64_t count = 0;
+    uint64_t start = now_ns();
+    uint64_t elapsed = 0;
+
+    do {
+        ivee_t* ivee = NULL;
+        check(ivee_create(0, &ivee), "ivee_create");
+        ivee_destroy(ivee);
+
+        ++count;
+        elapsed = now_ns() - start;
+    } while (elapsed < RATE_RUN_TIME_NS);
+
+    print_metric("create_destroy.rate_per_sec", count * 1e9 / elapsed);
+
+    ivee_t* tmpl = create_loaded("null_payload.elf64", IVEE_EXEC_ELF64);
+
+    count = 0;
+    start = now_ns();
+
+    do {
+        ivee_t* ivee = NULL;
+        check(ivee_clone(tmpl, &ivee), "ivee_clone");
+        ivee_destroy(ivee);
+
+        ++count;
+        elapsed = now_ns() - start;
+    } while (elapsed < RATE_RUN_TIME_NS);
+
+    print_metric("clone_destroy.rate_per_sec", count * 1e9 / elapsed);
+
+    ivee_destroy(tmpl);
+}
+
+/*
+ * Time to load an executable into a fresh environment.
+ * First load of a file is reported separately, later ones may be served from caches.
+ */
+static void bench_load(const char* format_name, ivee_executable_format_t format, size_t size)
+{
+    char file[64];
+    snprintf(file, sizeof(file), "sized_payload_%zu.%s", size, format_name);
+
+    uint64_t samples[LOAD_SAMPLES];
+    for (size_t i = 0; i < LOAD_SAMPLES; ++i) {
+        ivee_t* ivee = NULL;
+        check(ivee_create(0, &ivee), "ivee_create");
+
+        uint64_t start = now_ns();
+        int res = ivee_load_executable(ivee, file, format);
+        samples[i] = now_ns() - start;
+
+        check(res, file);
+        ivee_destroy(ivee);
+    }
+
+    char name[128];
+    snprintf(name, sizeof(name), "load.%s.%zu.first_ns", format_name, size);
+    print_metric(name, samples[0]);
+
+    snprintf(name, sizeof(name), "load.%s.%zu", format_name, size);
+    print_percentiles(name, samples + 1, LOAD_SAMPLES - 1);
+}
+
+/* Calls followed by a reset to snapshot, each call dirties guest memory */
+static void bench_reset(void)
+{
+    ivee_t* ivee = create_loaded("dirty_payload.elf64", IVEE_EXEC_ELF64);
+    check(ivee_snapshot(ivee), "ivee_snapshot");
+
+    uint64_t count = 0;
+    uint64_t start = now_ns();
+    uint64_t elapsed = 0;
+
+    do {
+        ivee_arch_state_t state = { 0 };
+        check(ivee_call(ivee, &state), "ivee_call");
+        if (state.rax != 1) {
+            check(-EINVAL, "ivee_reset");
+        }
+
+        check(ivee_reset(ivee), "ivee_reset");
+
+        ++count;
+        elapsed = now_ns() - start;
+    } while (elapsed < RATE_RUN_TIME_NS);
+
+    print_metric("call_reset.rate_per_sec", count * 1e9 / elapsed);
+
+    ivee_destroy(ivee);
+}
+
+struct worker {
+    pthread_t thread;
+    ivee_t* ivee;
+    pthread_barrier_t* barrier;
+    uint64_t calls;
+};
+
+static void* worker_thread(void* arg)
+{
+    struct worker* w = arg;
+
+    pthread_barrier_wait(w->barrier);
+
+    uint64_t deadline = now_ns() + RATE_RUN_TIME_NS;
+    while (now_ns() < deadline) {
+        for (int i = 0; i < 64; ++i, ++w->calls) {
+            ivee_arch_state_t state = { 0 };
+            check(ivee_call(w->ivee, &state), "ivee_call");
+        }
+    }
+
+    return NULL;
+}
+
+/* Aggregate call throughput of threads calling their own clones of one template */
+static void bench_throughput(size_t nthreads)
+{
+    static struct worker workers[MAX_THREADS];
+    pthread_barrier_t barrier;
+
+    ivee_t* tmpl = create_loaded("null_payload.elf64", IVEE_EXEC_ELF64);
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].barrier = &barrier;
+
+        check(ivee_clone(tmpl, &workers[i].ivee), "ivee_clone");
+        check(-pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]), "pthread_create");
+    }
+
+    uint64_t start = now_ns();
+    pthread_barrier_wait(&barrier);
+
+    uint64_t calls = 0;
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        calls += workers[i].calls;
+        ivee_destroy(workers[i].ivee);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+    ivee_destroy(tmpl);
+
+    char name[64];
+    snprintf(name, sizeof(name), "throughput.threads_%zu.calls_per_sec", nthreads);
+    print_metric(name, calls * 1e9 / elapsed);
+}
+
+int main(int argc, char** argv)
+{
+    fprintf(stderr, "call latency\n");
+    bench_call_latency();
+    bench_first_call("default", 0);
+    bench_first_call("low_latency", IVEE_CREATE_LOW_LATENCY);
+
+    fprintf(stderr, "create and clone\n");
+    bench_create();
+
+    fprintf(stderr, "load\n");
+    for (size_t i = 0; i < sizeof(g_payload_sizes) / sizeof(*g_payload_sizes); ++i) {
+        bench_load("bin", IVEE_EXEC_BIN, g_payload_sizes[i]);
+        bench_load("elf64", IVEE_EXEC_ELF64, g_payload_sizes[i]);
+    }
+
+    fprintf(stderr, "reset\n");
+    bench_reset();
+
+    fprintf(stderr, "throughput\n");
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > MAX_THREADS) {
+        ncpus = MAX_THREADS;
+    }
+
+    for (long nthreads = 1; nthreads <= ncpus; nthreads *= 2) {
+        bench_throughput(nthreads);
+    }
+
+    /* Also measure all cores when their count is not a power of two */
+    if (ncpus & (ncpus - 1)) {
+        bench_throughput(ncpus);
+    }
+
+    return 0;
+}
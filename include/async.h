@@ -0,0 +1,27 @@
+/**
+ * libivee internal asynchronous call api
+ */
+
+#pragma once
+
+/**
+ * Library-owned VCPU thread running asynchronous calls for a single environment
+ */
+struct ivee_async_worker;
+
+/**
+ * Create worker thread for an environment
+ */
+struct ivee_async_worker* ivee_create_async_worker(ivee_t* ivee);
+
+/**
+ * Stop worker thread and drop its undrained completion, if any.
+ * In-flight call is cancelled.
+ */
+void ivee_release_async_worker(struct ivee_async_worker* worker);
+
+/**
+ * Hand a call over to worker thread.
+ * Returns -EBUSY if previous call did not complete or its completion was not drained yet.
+ */
+int ivee_async_submit(struct ivee_async_worker* worker, ivee_arch_state_t* state, void* cookie);
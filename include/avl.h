@@ -0,0 +1,63 @@
+/**
+ * Intrusive AVL tree
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Tree node, embedded into tree elements
+ */
+struct ivee_avl_node
+{
+    struct ivee_avl_node* parent;
+    struct ivee_avl_node* left;
+    struct ivee_avl_node* right;
+    int height;
+};
+
+/**
+ * Tree root. Zero-initialized tree is empty.
+ */
+struct ivee_avl_tree
+{
+    struct ivee_avl_node* root;
+};
+
+/**
+ * Get pointer to element containing a tree node
+ */
+#define IVEE_AVL_ENTRY(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+/**
+ * Link a new node into the tree and rebalance it.
+ *
+ * Tree does not know how elements are ordered: caller descends from the root to find a free child link
+ * for the new node and passes it along with its parent (NULL for empty tree).
+ *
+ * \tree        Tree to insert node into
+ * \node        New node
+ * \parent      Parent node for new node
+ * \link        Free child link of parent, or tree root link if parent is NULL
+ */
+void ivee_avl_insert(struct ivee_avl_tree* tree,
+                     struct ivee_avl_node* node,
+                     struct ivee_avl_node* parent,
+                     struct ivee_avl_node** link);
+
+/**
+ * Unlink node from the tree and rebalance it
+ */
+void ivee_avl_remove(struct ivee_avl_tree* tree, struct ivee_avl_node* node);
+
+/**
+ * Get leftmost tree node or NULL if tree is empty
+ */
+struct ivee_avl_node* ivee_avl_first(const struct ivee_avl_tree* tree);
+
+/**
+ * Get in-order successor of a node or NULL if node is the last one
+ */
+struct ivee_avl_node* ivee_avl_next(const struct ivee_avl_node* node);
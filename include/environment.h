@@ -0,0 +1,59 @@
+/**
+ * libivee internal execution environment api for other library modules.
+ *
+ * Unless noted otherwise functions here expect caller to hold exclusive use of the environment.
+ */
+
+#pragma once
+
+#include "memory.h"
+
+/**
+ * Take exclusive use of an environment, see usage guards in libivee.c
+ * Returns -EBUSY if environment is already in use.
+ */
+int ivee_enter_exclusive(ivee_t* ivee);
+
+/**
+ * Drop exclusive use of an environment
+ */
+void ivee_leave_exclusive(ivee_t* ivee);
+
+/**
+ * Allocate host memory shared with the guest and map it at a free GPA below guest page tables.
+ *
+ * Region is never sealed: host and guest keep seeing each other's writes. It is skipped by snapshots and clones.
+ *
+ * \ivee        Execution environment with an executable loaded
+ * \length      Length of the region in bytes, will be rounded up to guest page size
+ * \prot        Guest access permissions
+ * \out_mr      On success initialized pointer to a new region
+ */
+int ivee_map_shared_memory(ivee_t* ivee,
+                           size_t length,
+                           enum ivee_memory_prot prot,
+                           struct ivee_guest_memory_region** out_mr);
+
+/**
+ * Unmap region created with ivee_map_shared_memory
+ */
+int ivee_unmap_shared_memory(ivee_t* ivee, struct ivee_guest_memory_region* mr);
+
+/**
+ * Reset environment to its snapshot for its next user, also dropping what previous one attached to it:
+ * mapped buffers, hypercall and log handlers. Takes exclusive use itself.
+ */
+int ivee_recycle(ivee_t* ivee);
+
+/**
+ * Run a synchronous call, see ivee_call_timeout, ivee_call_vector and ivee_resume
+ *
+ * \vector_state Vector registers to pass in and out, NULL to leave them alone
+ * \deadline_ns  Absolute CLOCK_MONOTONIC deadline, 0 for none
+ * \resume       Continue guest from its last yield instead of entry point
+ */
+int ivee_run_call(ivee_t* ivee,
+                  ivee_arch_state_t* state,
+                  ivee_vector_state_t* vector_state,
+                  uint64_t deadline_ns,
+                  bool resume);
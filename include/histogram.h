@@ -0,0 +1,50 @@
+/**
+ * Lock-free latency histogram
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+/* Number of linear sub-buckets per power of 2 is (1 << IVEE_HISTOGRAM_SUB_BITS) */
+#define IVEE_HISTOGRAM_SUB_BITS 2
+#define IVEE_HISTOGRAM_BUCKETS  (64 << IVEE_HISTOGRAM_SUB_BITS)
+
+/**
+ * Log-linear histogram of 64-bit values (usually nanoseconds).
+ *
+ * Values are bucketed by their most significant bit with 4 linear sub-buckets per power of 2,
+ * which bounds percentile estimation error to 25% while keeping recording O(1) and lock-free.
+ * Zero-initialized histogram is empty and ready to use.
+ */
+struct ivee_histogram
+{
+    _Atomic uint64_t buckets[IVEE_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+/**
+ * Record a value. Safe to call concurrently from multiple threads.
+ */
+void ivee_histogram_record(struct ivee_histogram* h, uint64_t value);
+
+/**
+ * Record a value from the only thread that records into this histogram.
+ * Avoids locked instructions, readers can still run concurrently.
+ */
+void ivee_histogram_record_single(struct ivee_histogram* h, uint64_t value);
+
+/**
+ * Add all values recorded in src to dst.
+ * Safe against concurrent recording into either of them, values recorded meanwhile may or may not be included.
+ */
+void ivee_histogram_merge(struct ivee_histogram* dst, const struct ivee_histogram* src);
+
+/**
+ * Estimate value at percentile p (0.0 - 100.0).
+ * Returns upper bound of the bucket the percentile falls into, or 0 for an empty histogram.
+ */
+uint64_t ivee_histogram_percentile(const struct ivee_histogram* h, double p);
@@ -0,0 +1,128 @@
+/**
+ * libivee internal executable image cache
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "memory.h"
+
+/**
+ * Loadable segment of a parsed executable image
+ */
+struct ivee_image_segment
+{
+    /* Guest address and size of segment memory */
+    uint64_t vaddr;
+    uint64_t memsz;
+
+    /* Segment contents in executable file */
+    uint64_t file_offset;
+    uint64_t filesz;
+
+    /* Guest access permissions */
+    enum ivee_memory_prot prot;
+
+    /*
+     * Offset of segment pages in image memory object, if segment lives there.
+     * Pages start at segment address rounded down to page size and contents past filesz are zero.
+     */
+    off_t memfd_offset;
+};
+
+/**
+ * Code or data symbol of an executable image
+ */
+struct ivee_image_symbol
+{
+    /* Guest address and size, symbols without size in symbol table extend to the next one */
+    uint64_t addr;
+    uint64_t size;
+
+    /* Name, stored in image symbol name pool */
+    const char* name;
+};
+
+/**
+ * Parsed executable image shared by every environment that loads the same file
+ */
+struct ivee_image
+{
+    /* Cache key: file identity and modification time. Size also bounds segment file contents. */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    /* Entry point address */
+    uint64_t entry;
+
+    /* Executable file, writable segments are mapped privately from it. -1 for in-memory images. */
+    int fd;
+
+    /*
+     * Sealed memory object holding read-only segments, mapped shared by every environment.
+     * In-memory images keep all of their segments here.
+     */
+    int memfd;
+
+    struct ivee_image_segment* segments;
+    size_t nr_segments;
+
+    /* Symbols sorted by address and the pool their names point into */
+    struct ivee_image_symbol* symbols;
+    size_t nr_symbols;
+    char* symbol_names;
+
+    /* References from cache and image users, protected by cache lock */
+    unsigned refcount;
+
+    TAILQ_ENTRY(ivee_image) link;
+};
+
+/**
+ * Segment lives in image memory object, otherwise it is mapped from executable file
+ */
+static inline bool ivee_is_memfd_segment(const struct ivee_image* image, const struct ivee_image_segment* seg)
+{
+    return image->fd < 0 || !(seg->prot & IVEE_WRITE);
+}
+
+/**
+ * Get parsed image of an ELF64 executable file, parsing it only if cache does not have it yet.
+ *
+ * \fd          Executable file
+ * \out_image   Referenced image, drop it with ivee_put_image
+ */
+int ivee_get_image(int fd, struct ivee_image** out_image);
+
+/**
+ * Parse an ELF64 executable in memory into a new image that is not cached.
+ * Segments are copied once into image memory object, executable buffer is not used after this returns.
+ *
+ * \data        Executable contents
+ * \size        Executable size in bytes
+ * \out_image   Referenced image, drop it with ivee_put_image
+ */
+int ivee_create_image_from_memory(const void* data, size_t size, struct ivee_image** out_image);
+
+/**
+ * Take another reference to an image
+ */
+void ivee_ref_image(struct ivee_image* image);
+
+/**
+ * Drop image reference
+ */
+void ivee_put_image(struct ivee_image* image);
+
+/**
+ * Find symbol covering an address.
+ * Returns NULL if address is not inside any symbol.
+ */
+const struct ivee_image_symbol* ivee_find_image_symbol(const struct ivee_image* image, uint64_t addr);
@@ -4,12 +4,20 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
 struct ivee_memory_map;
 struct x86_cpu_state;
 
 /* TODO: this will eventually have to move to runtime interface header */
 #define IVEE_PIO_EXIT_PORT 0x78u
 
+/* Signal that kicks a vcpu thread out of KVM_RUN, it is the only signal KVM_RUN leaves unblocked */
+#define IVEE_KICK_SIGNAL SIGUSR1
+
 /**
  * Valid ivee exit reasons we care about
  */
@@ -36,6 +44,10 @@ struct ivee_pio_exit {
  */
 struct ivee_exit {
     enum ivee_exit_reason exit_reason;
+
+    /* Raw KVM exit reason */
+    uint32_t kvm_exit_reason;
+
     union {
         struct ivee_pio_exit io;
     };
@@ -47,7 +59,8 @@ struct ivee_exit {
 struct ivee_kvm_vm;
 
 /**
- * Init static KVM context
+ * Init static KVM context.
+ * Thread-safe, can be called any number of times.
  *
  * \returns     0 on success, negative value on error
  */
@@ -55,8 +68,11 @@ int ivee_init_kvm(void);
 
 /**
  * Create libivee kvm vm container with 1 vcpu
+ *
+ * \low_latency     Warm vcpu up with a throwaway run and disable vcpu exits that only add latency for our guests,
+ *                  where KVM supports that
  */
-struct ivee_kvm_vm* ivee_create_kvm_vm(void);
+struct ivee_kvm_vm* ivee_create_kvm_vm(bool low_latency);
 
 /**
  * Release libivee kvm vm container
@@ -68,21 +84,114 @@ void ivee_release_kvm_vm(struct ivee_kvm_vm* vm);
  *
  * \vm      KVM VM instance
  * \memmap  High level memory map.
- *          Guaranteed to not have overlaps and to have all adjacent regions merged.
+ *          Guaranteed to not have overlaps. Adjacent regions that are also contiguous in host address space
+ *          and have the same access are merged into a single memory slot.
+ *
+ * Can be called again with an updated memory map. Only slots that were added, removed or changed are
+ * pushed to KVM, pages of changed slots are reported dirty once by ivee_kvm_get_dirty_log.
  */
 int ivee_set_kvm_memory_map(struct ivee_kvm_vm* vm, const struct ivee_memory_map* memmap);
 
 /**
- * Load x86 cpu state into KVM vcpu
+ * Start logging guest writes to all writable memory slots, including ones created later.
+ */
+int ivee_kvm_enable_dirty_log(struct ivee_kvm_vm* vm);
+
+/**
+ * Get and clear dirty page bitmap of a writable memory map region.
+ *
+ * \vm      KVM VM instance with dirty logging enabled
+ * \gpa     First GPA of region
+ * \npages  Number of pages in region
+ * \bitmap  Output bitmap with 1 bit per region page, rounded up to 64 bits
+ */
+int ivee_kvm_get_dirty_log(struct ivee_kvm_vm* vm, gpa_t gpa, size_t npages, uint64_t* bitmap);
+
+/**
+ * Build stage 2 page tables for all memory slots, so that guest accesses don't fault to KVM.
+ * Best effort: does nothing if KVM can't do that, slots KVM refuses to fault in are left to guest accesses.
+ */
+void ivee_kvm_pre_fault_memory(struct ivee_kvm_vm* vm);
+
+/**
+ * Load x86 cpu state into KVM vcpu.
+ * Segment and control register state is only loaded if x86_cpu->sregs_dirty is set.
  */
 int ivee_kvm_load_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu);
 
 /**
- * Get KVM vcpu state and store it in output x86 state
+ * Get KVM vcpu general purpose register state and store it in output x86 state
  */
 int ivee_kvm_store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu);
 
 /**
- * Resume/start execution of KVM vcpu until next supported vmexit is initiated by the guest
+ * XCR0 guests start with: x87, SSE and AVX/AVX-512 state KVM supports, 0 if guests can't use XSAVE.
+ * Valid after ivee_init_kvm.
+ */
+uint64_t ivee_kvm_get_guest_xcr0(void);
+
+/**
+ * Load vector registers into KVM vcpu, other XSAVE state is kept.
+ * Only XMM registers and MXCSR are loaded if guests can't use XSAVE.
+ */
+int ivee_kvm_load_vector_state(struct ivee_kvm_vm* vm, const ivee_vector_state_t* vector_state);
+
+/**
+ * Store KVM vcpu vector registers, ones outside of guest XCR0 are zeroed.
+ */
+int ivee_kvm_store_vector_state(struct ivee_kvm_vm* vm, ivee_vector_state_t* vector_state);
+
+/**
+ * Hand guest writes to IVEE_LOG_PORT that KVM coalesced since last drain to fn, oldest first.
+ * Writes made while ring was full exit as usual port IO instead, drain before handling them to keep order.
+ * Does nothing if KVM does not support coalesced port IO.
+ */
+void ivee_kvm_drain_coalesced_log(struct ivee_kvm_vm* vm,
+                                  void (*fn)(void* ctx, const void* data, size_t size),
+                                  void* ctx);
+
+/**
+ * Set or clear kvm_run->immediate_exit, KVM_RUN returns -EINTR without entering the guest while it is set.
+ * Can be called from any thread, combined with IVEE_KICK_SIGNAL it stops a vcpu wherever its thread is.
+ */
+void ivee_kvm_set_immediate_exit(struct ivee_kvm_vm* vm, bool immediate_exit);
+
+/**
+ * Block every signal but IVEE_KICK_SIGNAL on calling library-owned thread.
+ * Process signals should never be delivered to library threads, only kicks sent to them.
+ */
+void ivee_kvm_block_process_signals(void);
+
+/**
+ * Send IVEE_KICK_SIGNAL to a vcpu thread
+ */
+int ivee_kvm_kick_thread(pthread_t thread);
+
+/**
+ * Fill timer event that kicks a vcpu thread when timer fires
+ */
+void ivee_kvm_init_kick_event(struct sigevent* sev, pid_t tid);
+
+/**
+ * Consume a kick pending on calling thread because the thread blocks it.
+ * KVM_RUN unblocks kicks only while it runs, so a pending one would make every later KVM_RUN return -EINTR.
+ * Application's own IVEE_KICK_SIGNAL is left pending.
+ */
+void ivee_kvm_consume_kick(void);
+
+/**
+ * Make vcpu the one kicks of calling thread stop, from before its deadline is armed until call ends.
+ * Kicks that land between KVM_RUNs then set immediate_exit instead of getting lost.
+ */
+void ivee_kvm_begin_call(struct ivee_kvm_vm* vm);
+
+/**
+ * Drop vcpu set with ivee_kvm_begin_call for calling thread
+ */
+void ivee_kvm_end_call(void);
+
+/**
+ * Resume/start execution of KVM vcpu until next supported vmexit is initiated by the guest.
+ * Returns -EINTR if vcpu thread was kicked, see ivee_kvm_set_immediate_exit.
  */
 int ivee_kvm_run(struct ivee_kvm_vm* vm, struct ivee_exit* exit_reason);
@@ -7,6 +7,25 @@ extern "C" {
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "libivee/ring.h"
+
+/*
+ * Thread safety
+ *
+ * Library initialization is thread-safe: different execution environments can be created, used
+ * and destroyed concurrently from any number of threads, one environment per thread scales across cores.
+ *
+ * A single execution environment should be used by one thread at a time. Calls that change environment
+ * state (ivee_load_executable, ivee_snapshot, ivee_reset, ivee_map_buffer, ivee_call and others) fail
+ * with -EBUSY instead of racing when another thread is using the same environment. ivee_clone only reads
+ * its template and can run concurrently with other ivee_clone calls on the same template. ivee_cancel
+ * can be called from any thread while the environment is in use. ivee_destroy must not race with any
+ * other call on the same environment.
+ *
+ * Asynchronous call completions can be drained from any thread. Ring submission and reaping can each be
+ * driven by its own thread.
+ */
+
 /**
  * APIC ID of a VCPU running inside an execution environment
  */
@@ -49,6 +68,31 @@ typedef enum ivee_executable_format {
     IVEE_EXEC_ANY
 } ivee_executable_format_t;
 
+/**
+ * Host pages backing environment memory, from weakest to strongest
+ */
+typedef enum ivee_memory_backing {
+    /**
+     * Regular 4KiB pages
+     */
+    IVEE_MEMORY_NORMAL = 0,
+
+    /**
+     * Transparent huge pages, kernel promotes memory to 2MiB pages on best effort basis
+     */
+    IVEE_MEMORY_THP,
+
+    /**
+     * 2MiB hugetlbfs pages from the reserved pool
+     */
+    IVEE_MEMORY_HUGETLB_2M,
+
+    /**
+     * 1GiB hugetlbfs pages from the reserved pool
+     */
+    IVEE_MEMORY_HUGETLB_1G,
+} ivee_memory_backing_t;
+
 /**
  * Architectural state of a virtual cpu when switching to IVEE context.
  * Actual architecture to use for IVEE VCPU is always the same as host.
@@ -71,6 +115,41 @@ typedef struct ivee_arch_state {
     uint64_t r15;
 } ivee_arch_state_t;
 
+/**
+ * MXCSR with all floating point exceptions masked and rounding to nearest, what host code normally runs with.
+ * Zero MXCSR unmasks all exceptions.
+ */
+#define IVEE_MXCSR_DEFAULT 0x1F80
+
+/**
+ * Vector register state, optionally passed into a call with ivee_call_vector.
+ * Registers guest cpu does not have are ignored on input and zero on output, see ivee_list_vector_features.
+ */
+typedef struct ivee_vector_state {
+    /* ZMM0-31, XMMn and YMMn are the low 16 and 32 bytes of zmm[n] */
+    uint8_t zmm[32][64];
+
+    /* AVX-512 opmask registers */
+    uint64_t k[8];
+
+    /* SSE control and status register, IVEE_MXCSR_DEFAULT unless guest expects otherwise */
+    uint32_t mxcsr;
+} ivee_vector_state_t;
+
+/**
+ * Vector register sets guests can use
+ */
+typedef enum ivee_vector_features {
+    /** XMM0-15 and MXCSR */
+    IVEE_VECTOR_SSE = 0x0001,
+
+    /** YMM0-15 */
+    IVEE_VECTOR_AVX = 0x0002,
+
+    /** ZMM0-31 and opmask registers */
+    IVEE_VECTOR_AVX512 = 0x0004,
+} ivee_vector_features_t;
+
 /**
  * Opaque handle to an execution environment
  */
@@ -81,6 +160,12 @@ typedef struct ivee ivee_t;
  */
 uint64_t ivee_list_platform_capabilities(void);
 
+/**
+ * List vector register sets guests can use and ivee_call_vector passes around.
+ * Guest CPUID reports instruction set extensions that come with them. Returns 0 if hypervisor is not available.
+ */
+uint64_t ivee_list_vector_features(void);
+
 /**
  * Create new execution environment container
  *
@@ -89,11 +174,94 @@ uint64_t ivee_list_platform_capabilities(void);
  */
 int ivee_create(ivee_capabilities_t caps, ivee_t** ivee);
 
+/**
+ * Highest host CPU number environment CPU sets can hold, plus one
+ */
+#define IVEE_MAX_CPUS 1024
+
+/**
+ * No NUMA node preference
+ */
+#define IVEE_NUMA_NODE_ANY (-1)
+
+/**
+ * Execution environment creation flags
+ */
+typedef enum ivee_create_flags {
+    /**
+     * Trade memory and setup time for call latency that does not depend on what guest touched before.
+     *
+     * Guest memory is populated and locked into RAM whenever memory map changes: on load, clone,
+     * snapshot and buffer mapping. Clones get private copies of all writable pages up front.
+     * This counts against RLIMIT_MEMLOCK, operations that can't lock memory fail with -ENOMEM or -EPERM.
+     * Stage 2 page tables are built ahead of guest accesses and PAUSE exits are disabled where KVM supports it.
+     */
+    IVEE_CREATE_LOW_LATENCY = 0x0001,
+} ivee_create_flags_t;
+
+/**
+ * Execution environment creation options, initialize with ivee_init_create_options
+ */
+typedef struct ivee_create_options {
+    /* Enabled environment capabilities */
+    ivee_capabilities_t caps;
+
+    /* Creation flags */
+    ivee_create_flags_t flags;
+
+    /*
+     * NUMA node to allocate environment memory on, including guest page tables.
+     * Memory comes from other nodes once this one is full. IVEE_NUMA_NODE_ANY leaves placement to first touch.
+     */
+    int numa_node;
+
+    /*
+     * Host CPUs threads running calls on the environment are pinned to, CPU n is bit (n % 64) of cpus[n / 64].
+     * Empty set means CPUs of numa_node, or no pinning without a node.
+     * Threads stay pinned after calls return.
+     */
+    uint64_t cpus[IVEE_MAX_CPUS / 64];
+} ivee_create_options_t;
+
+/**
+ * Fill creation options with defaults: no capabilities or flags, no NUMA node and no CPU pinning
+ */
+void ivee_init_create_options(ivee_create_options_t* options);
+
+/**
+ * Create new execution environment container with creation options.
+ * Clones are created with options of their template.
+ *
+ * \options     Creation options
+ * \ivee        On success initialized pointer to an execption environment.
+ */
+int ivee_create_ex(const ivee_create_options_t* options, ivee_t** ivee);
+
 /**
  * Destroy an execution environment
  */
 void ivee_destroy(ivee_t* ivee);
 
+/**
+ * Select host pages to back environment memory allocated from now on, such as loaded executable image.
+ *
+ * Only memory regions at least one huge page long are backed by huge pages. If requested pages are not
+ * available, weaker backing is used instead, down to normal pages. Clones share backing of their template.
+ *
+ * \ivee        Execution environment
+ * \backing     Preferred host pages
+ */
+int ivee_set_memory_backing(ivee_t* ivee, ivee_memory_backing_t backing);
+
+/**
+ * Get host pages actually backing environment memory.
+ * Reports weakest backing among memory regions eligible for huge pages, or IVEE_MEMORY_NORMAL if there are none.
+ *
+ * \ivee        Execution environment
+ * \backing     On success, obtained backing
+ */
+int ivee_get_memory_backing(ivee_t* ivee, ivee_memory_backing_t* backing);
+
 /**
  * Load a binary image into an execution environment.
  *
@@ -108,20 +276,518 @@ void ivee_destroy(ivee_t* ivee);
  *
  * Once the image is loaded the execution environment becomes sealed (optionally memory is encrypted).
  *
+ * ELF64 writable segments are mapped privately from the executable file. Changing the file in place after
+ * loading it changes what this environment and its clones see in pages of those segments that were not
+ * copied on write yet. Replace executables with a new file instead, e.g. by renaming it over the old one.
+ *
  * \ivee        Execution environment to load binary into
  * \file        Path to executable
  * \format      Executable format or IVEE_EXEC_ANY to guess
  */
 int ivee_load_executable(ivee_t* ivee, const char* file, ivee_executable_format_t format);
 
+/**
+ * Load a binary image from an open file, same as ivee_load_executable otherwise.
+ *
+ * File should be opened for reading and is not used after this returns, caller keeps ownership of fd.
+ * Executables are parsed once per process and cached by file identity and modification time.
+ *
+ * \ivee        Execution environment to load binary into
+ * \fd          Executable file descriptor
+ * \format      Executable format or IVEE_EXEC_ANY to guess
+ */
+int ivee_load_executable_fd(ivee_t* ivee, int fd, ivee_executable_format_t format);
+
+/**
+ * Load a binary image from memory, same as ivee_load_executable otherwise.
+ *
+ * Image is parsed in place and its segments are copied once into library memory,
+ * buffer can be released as soon as this returns. Images loaded from memory are not cached.
+ *
+ * \ivee        Execution environment to load binary into
+ * \data        Executable contents
+ * \size        Executable size in bytes
+ * \format      Executable format or IVEE_EXEC_ANY to guess
+ */
+int ivee_load_executable_mem(ivee_t* ivee, const void* data, size_t size, ivee_executable_format_t format);
+
+/**
+ * Create a new execution environment as a copy-on-write clone of a loaded template.
+ *
+ * Clone memory is a private view of template memory as it was right after the executable was loaded,
+ * or at the last template snapshot: pages are shared until either side writes to them and calls into the
+ * template are not visible to clones.
+ * Guest page tables and cpu state are inherited from the template.
+ *
+ * \tmpl        Template execution environment with an executable loaded
+ * \ivee        On success initialized pointer to a cloned execution environment.
+ */
+int ivee_clone(const ivee_t* tmpl, ivee_t** ivee);
+
+/**
+ * Capture current memory and cpu state of an execution environment as a snapshot to return to with ivee_reset.
+ *
+ * From this point on guest writes are tracked with dirty page logging, so that reset only restores
+ * pages the guest actually wrote to. Snapshotting a freshly loaded or cloned environment is cheap,
+ * otherwise guest memory contents are copied once. Host writes to guest memory are not tracked.
+ *
+ * \ivee        Execution environment with an executable loaded
+ */
+int ivee_snapshot(ivee_t* ivee);
+
+/**
+ * Restore memory and cpu state of an execution environment to its last snapshot.
+ * Cost is proportional to the number of pages guest has written to since last snapshot or reset.
+ *
+ * \ivee        Execution environment with a snapshot
+ */
+int ivee_reset(ivee_t* ivee);
+
+/**
+ * Guest access to a host buffer
+ */
+typedef enum ivee_buffer_access {
+    IVEE_BUFFER_READ    = (1u << 0),
+    IVEE_BUFFER_WRITE   = (1u << 1),
+} ivee_buffer_access_t;
+
+/**
+ * Expose host memory to an execution environment in place, without copying.
+ *
+ * Buffer is mapped at a free guest address that can be passed to the guest in a register.
+ * Guest and host see each other's writes. Buffer is not part of snapshots and clones, and
+ * should stay mapped in host process until it is unmapped from the environment or environment is destroyed.
+ *
+ * \ivee        Execution environment with an executable loaded
+ * \buf         Page-aligned host buffer
+ * \length      Page-aligned buffer length
+ * \access      Guest access to buffer, must include IVEE_BUFFER_READ
+ * \gva         On success, guest address of the buffer
+ */
+int ivee_map_buffer(ivee_t* ivee, void* buf, size_t length, ivee_buffer_access_t access, uint64_t* gva);
+
+/**
+ * Remove a buffer mapped with ivee_map_buffer from an execution environment
+ *
+ * \ivee        Execution environment
+ * \gva         Guest address returned by ivee_map_buffer
+ */
+int ivee_unmap_buffer(ivee_t* ivee, uint64_t gva);
+
+/**
+ * Port guests write to with OUT instruction to make a hypercall, with hypercall number in rax
+ */
+#define IVEE_HYPERCALL_PORT 0x79
+
+/**
+ * Port guests write log output to with OUT instruction, 1 to 4 bytes at a time.
+ * Writes are batched by KVM and cost no VM exit until its ring fills up.
+ */
+#define IVEE_LOG_PORT 0x7a
+
+/**
+ * Port guests write to with OUT instruction to end current call without losing their context.
+ * Call returns IVEE_CALL_YIELDED and ivee_resume continues guest after the OUT instruction.
+ */
+#define IVEE_YIELD_PORT 0x7b
+
+/**
+ * Positive call result: guest yielded instead of exiting, see IVEE_YIELD_PORT
+ */
+#define IVEE_CALL_YIELDED 1
+
+/**
+ * Number of hypercall table entries, valid hypercall numbers are below it
+ */
+#define IVEE_MAX_HYPERCALLS 64
+
+/**
+ * Host function guest can call without ending its call.
+ *
+ * Receives guest registers at the hypercall and can change them, guest resumes after the OUT
+ * instruction with updated registers. By convention arguments come in rdi, rsi, rdx, r10, r8, r9 and
+ * result goes to rax. Returning a negative error code aborts the call with that error instead.
+ *
+ * Hypercalls run on the thread running the call and must not call into the same environment, except for ivee_cancel.
+ */
+typedef int (*ivee_hypercall_t)(void* ctx, ivee_arch_state_t* regs);
+
+/**
+ * Register a hypercall handler, replacing previous one with the same number.
+ * Guests get -ENOSYS in rax for numbers without a handler. Clones inherit hypercalls of their template.
+ *
+ * \ivee        Execution environment
+ * \nr          Hypercall number, below IVEE_MAX_HYPERCALLS
+ * \fn          Handler, NULL to unregister
+ * \ctx         Opaque value passed to handler
+ */
+int ivee_register_hypercall(ivee_t* ivee, uint32_t nr, ivee_hypercall_t fn, void* ctx);
+
+/**
+ * Receives guest log output, in the order guest wrote it.
+ * Output comes in chunks that don't have to end at line boundaries.
+ */
+typedef void (*ivee_log_handler_t)(void* ctx, const char* data, size_t size);
+
+/**
+ * Set handler for guest log output written to IVEE_LOG_PORT, replacing previous one.
+ *
+ * Output is delivered on the thread running the call, at the latest before the call returns, and also before
+ * hypercalls run. Without a handler log output is dropped. Clones inherit log handler of their template.
+ *
+ * \ivee        Execution environment
+ * \fn          Handler, NULL to drop log output
+ * \ctx         Opaque value passed to handler
+ */
+int ivee_set_log_handler(ivee_t* ivee, ivee_log_handler_t fn, void* ctx);
+
 /**
  * Execute a synchronous call into an execution environment with the specified architectural cpu state.
+ * Returns 0 once guest exits, or IVEE_CALL_YIELDED if it yielded.
  *
  * \ivee        Exection environment to run
  * \state       Architectural cpu state on input. Updated after execution finished.
  */
 int ivee_call(ivee_t* ivee, ivee_arch_state_t* state);
 
+/**
+ * Execute a synchronous call like ivee_call that is stopped if it is still running at deadline.
+ *
+ * Returns -ETIMEDOUT once deadline passes and -ECANCELED if ivee_cancel stopped the call. Output state is not
+ * updated then, and guest memory keeps changes made so far: use ivee_reset to get back to snapshot.
+ * Next call starts from entry point again.
+ *
+ * \ivee        Exection environment to run
+ * \state       Architectural cpu state on input. Updated after execution finished.
+ * \deadline_ns Absolute CLOCK_MONOTONIC time in nanoseconds, 0 for no deadline
+ */
+int ivee_call_timeout(ivee_t* ivee, ivee_arch_state_t* state, uint64_t deadline_ns);
+
+/**
+ * Execute a synchronous call like ivee_call, passing vector registers in and out along with general purpose ones.
+ * Costs a few more round trips to hypervisor than ivee_call.
+ *
+ * \ivee         Exection environment to run
+ * \state        Architectural cpu state on input. Updated after execution finished.
+ * \vector_state Vector register state on input. Updated after execution finished.
+ */
+int ivee_call_vector(ivee_t* ivee, ivee_arch_state_t* state, ivee_vector_state_t* vector_state);
+
+/**
+ * Continue a guest that yielded from its last call, after the OUT instruction to IVEE_YIELD_PORT.
+ *
+ * General purpose registers are loaded from state like for any other call, rest of the VCPU context, vector
+ * registers and guest memory are kept as guest left them. Returns IVEE_CALL_YIELDED again if guest yields
+ * again, and -ESRCH if last call did not yield. Any call, ivee_reset or ivee_load_executable in between
+ * drops the yielded context.
+ *
+ * \ivee        Exection environment to run
+ * \state       Architectural cpu state on input. Updated after execution finished.
+ */
+int ivee_resume(ivee_t* ivee, ivee_arch_state_t* state);
+
+/**
+ * Stop call running on an environment, it returns -ECANCELED.
+ * Works for synchronous, asynchronous and ring calls. Returns -ESRCH if there was no call to stop.
+ *
+ * Running thread is kicked out of the guest with SIGUSR1. Unless the application installed a handler of its own,
+ * libivee installs one that does nothing when the first environment is created. Kicks that arrive too late stay
+ * pending on threads that block SIGUSR1, next call on such thread consumes them. SIGUSR1 the application sent itself
+ * is left pending, calls return -EINTR if they keep being interrupted by signals that are not meant for them.
+ *
+ * \ivee        Execution environment
+ */
+int ivee_cancel(ivee_t* ivee);
+
+/**
+ * Asynchronous call completion
+ */
+typedef struct ivee_completion {
+    /* Environment the call was made into */
+    ivee_t* ivee;
+
+    /* Cookie passed to ivee_call_async */
+    void* cookie;
+
+    /* Call result, same as ivee_call would return */
+    int result;
+} ivee_completion_t;
+
+/**
+ * Start an asynchronous call into an execution environment.
+ *
+ * Call runs on a library-owned VCPU thread dedicated to the environment, which is created on first
+ * asynchronous call and lives until the environment is destroyed. Completion is reported through
+ * ivee_poll_completions. Environment accepts next asynchronous call once completion of the previous
+ * one was drained, and it should not be used for synchronous calls in the meantime.
+ *
+ * Destroying an environment cancels its in-flight call and drops its undrained completion.
+ *
+ * \ivee        Execution environment to run
+ * \state       Architectural cpu state on input, updated after execution finished.
+ *              Should stay valid until completion is drained.
+ * \cookie      Opaque value reported with call completion
+ */
+int ivee_call_async(ivee_t* ivee, ivee_arch_state_t* state, void* cookie);
+
+/**
+ * Get process-wide completion eventfd.
+ *
+ * Descriptor is readable while there are undrained asynchronous call completions and can be
+ * added to epoll or similar. It is owned by the library and should not be read from or closed.
+ *
+ * Returns eventfd on success or negative error value
+ */
+int ivee_completion_fd(void);
+
+/**
+ * Drain asynchronous call completions from all environments.
+ *
+ * \completions Output array of completions
+ * \max         Maximum number of completions to drain
+ *
+ * Returns number of drained completions, 0 if there are none.
+ */
+int ivee_poll_completions(ivee_completion_t* completions, size_t max);
+
+/**
+ * Opaque handle to a submission/completion ring shared with a resident guest loop
+ */
+typedef struct ivee_ring ivee_ring_t;
+
+/**
+ * Create a submission/completion ring and start a resident guest loop serving it.
+ *
+ * Ring memory is mapped into the guest at a free GPA and guest executable entry point is called on
+ * a library-owned VCPU thread with ring header GPA in RDI (see libivee/ring.h for layout and protocol).
+ * Environment is busy until the ring is destroyed. Ring memory is not snapshotted and not cloned.
+ * Guest loop keeps its VCPU thread spinning, calls only avoid VM exits if that thread has a host CPU to itself.
+ *
+ * \ivee        Execution environment with an executable loaded
+ * \entries     Number of ring entries, power of 2
+ * \ring        On success initialized pointer to a ring
+ */
+int ivee_ring_create(ivee_t* ivee, uint32_t entries, ivee_ring_t** ring);
+
+/**
+ * Stop guest loop, wait for it to exit and unmap ring memory.
+ * Guest loop that has not exited 100ms after stop flag is set is cancelled, see ivee_cancel.
+ * Unreaped completions are dropped.
+ */
+void ivee_ring_destroy(ivee_ring_t* ring);
+
+/**
+ * Post submission entries to the ring.
+ * Number of submitted entries not yet reaped can't exceed ring size.
+ * Should not be called concurrently with itself on the same ring.
+ *
+ * \ring        Ring to submit to
+ * \sqes        Submission entries
+ * \count       Number of submission entries
+ *
+ * Returns number of posted entries, which can be less than count if ring is full,
+ * or -EPIPE if guest loop has exited.
+ */
+int ivee_ring_submit(ivee_ring_t* ring, const ivee_ring_sqe_t* sqes, size_t count);
+
+/**
+ * Consume completion entries from the ring.
+ * Should not be called concurrently with itself on the same ring.
+ *
+ * \ring        Ring to reap
+ * \cqes        Output array of completion entries
+ * \max         Maximum number of completion entries to reap
+ *
+ * Returns number of reaped entries, 0 if there are none, or -EPIPE if there are none and guest loop has exited.
+ */
+int ivee_ring_reap(ivee_ring_t* ring, ivee_ring_cqe_t* cqes, size_t max);
+
+/**
+ * Get result of the guest loop call, valid once ivee_ring_submit or ivee_ring_reap report -EPIPE.
+ */
+int ivee_ring_result(ivee_ring_t* ring);
+
+/* Number of KVM exit reasons tracked, reasons past that are counted in the last entry */
+#define IVEE_STATS_EXIT_REASONS 64
+
+/* Number of distinct PIO ports tracked per environment, exits to other ports are counted together */
+#define IVEE_STATS_PIO_PORTS 8
+
+/**
+ * Latency distribution of a call phase
+ */
+typedef struct ivee_latency_stats {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} ivee_latency_stats_t;
+
+/**
+ * Port IO exit counter
+ */
+typedef struct ivee_pio_port_stats {
+    uint16_t port;
+    uint64_t exits;
+} ivee_pio_port_stats_t;
+
+/**
+ * Execution statistics. All counters are monotonic.
+ */
+typedef struct ivee_stats {
+    /* Calls run, including ones that failed */
+    uint64_t calls;
+    uint64_t failed_calls;
+
+    /* KVM_RUN iterations and ones that returned an error instead of an exit */
+    uint64_t runs;
+    uint64_t run_errors;
+
+    /* VM exits indexed by KVM exit reason (KVM_EXIT_* from linux/kvm.h) */
+    uint64_t exits[IVEE_STATS_EXIT_REASONS];
+
+    /* Port IO exits per port in order of first exit, unused entries have 0 exits */
+    ivee_pio_port_stats_t pio_ports[IVEE_STATS_PIO_PORTS];
+    uint64_t pio_other_exits;
+
+    /* Whole call, vcpu state load, time in guest per KVM_RUN, exit handling per exit and vcpu state store */
+    ivee_latency_stats_t call;
+    ivee_latency_stats_t load;
+    ivee_latency_stats_t guest;
+    ivee_latency_stats_t exit;
+    ivee_latency_stats_t store;
+} ivee_stats_t;
+
+/**
+ * Get execution statistics of an environment.
+ * Can be called from any thread while environment is in use.
+ *
+ * \ivee        Execution environment
+ * \stats       On success, filled statistics
+ */
+int ivee_get_stats(ivee_t* ivee, ivee_stats_t* stats);
+
+/**
+ * Get execution statistics of all environments the process has created, including destroyed ones
+ */
+int ivee_get_process_stats(ivee_stats_t* stats);
+
+/**
+ * Format process-wide execution statistics in Prometheus text exposition format.
+ *
+ * Works like snprintf: output is truncated to fit the buffer and always NUL-terminated if size is not 0.
+ * Returns length of full output without terminating NUL or a negative error code.
+ *
+ * \buf         Output buffer, can be NULL if size is 0
+ * \size        Size of output buffer
+ */
+int ivee_format_process_stats(char* buf, size_t size);
+
+/**
+ * Symbol of a loaded executable
+ */
+typedef struct ivee_symbol {
+    /* Symbol name, valid until environment is destroyed or loads another executable */
+    const char* name;
+
+    /* Guest virtual address and size of symbol */
+    uint64_t addr;
+    uint64_t size;
+} ivee_symbol_t;
+
+/**
+ * Find symbol of loaded executable covering a guest virtual address.
+ *
+ * Symbols come from ELF64 symbol table, or dynamic symbol table of stripped executables.
+ * Returns -ENOENT if address is not covered by any symbol.
+ *
+ * \ivee        Execution environment
+ * \gva         Guest virtual address
+ * \symbol      On success, found symbol
+ */
+int ivee_symbolize(ivee_t* ivee, uint64_t gva, ivee_symbol_t* symbol);
+
+/**
+ * Append symbols of loaded executable to a perf map file, one "<start> <size> <name>" line per symbol
+ * with hex guest virtual addresses. Tools that sample guest instruction pointers can use it to resolve
+ * guest code. Nothing is written for executables without symbols.
+ *
+ * \ivee        Execution environment
+ * \path        Map file path, NULL for /tmp/perf-<pid>.map
+ */
+int ivee_write_perf_map(ivee_t* ivee, const char* path);
+
+/**
+ * Opaque handle to a pool of prewarmed execution environments
+ */
+typedef struct ivee_pool ivee_pool_t;
+
+/**
+ * Execution environment pool statistics
+ */
+typedef struct ivee_pool_stats {
+    /* Total number of acquired environments */
+    uint64_t acquired;
+
+    /* Number of acquires that found the pool empty and had to create an environment on caller's thread */
+    uint64_t empty;
+
+    /* Number of environments currently ready to be acquired */
+    uint64_t ready;
+
+    /* Acquire latency percentiles */
+    uint64_t acquire_p50_ns;
+    uint64_t acquire_p90_ns;
+    uint64_t acquire_p99_ns;
+    uint64_t acquire_p999_ns;
+    uint64_t acquire_max_ns;
+} ivee_pool_stats_t;
+
+/**
+ * Create a pool of execution environments ready to run an executable.
+ *
+ * Executable is loaded once into a template environment, pooled environments are its clones (see ivee_clone).
+ * Pool is filled before this call returns and is refilled by a background thread as environments are acquired.
+ * All pool functions are thread-safe.
+ *
+ * \file        Path to executable
+ * \format      Executable format or IVEE_EXEC_ANY to guess
+ * \size        Number of environments to keep ready
+ * \pool        On success initialized pointer to a pool
+ */
+int ivee_pool_create(const char* file, ivee_executable_format_t format, size_t size, ivee_pool_t** pool);
+
+/**
+ * Destroy a pool and all environments in it.
+ * All acquired environments should be released before this call.
+ */
+void ivee_pool_destroy(ivee_pool_t* pool);
+
+/**
+ * Take a clean execution environment out of the pool.
+ *
+ * If pool is empty a new environment is created on caller's thread.
+ *
+ * \pool        Pool to acquire environment from
+ * \ivee        On success initialized pointer to an execution environment
+ */
+int ivee_pool_acquire(ivee_pool_t* pool, ivee_t** ivee);
+
+/**
+ * Return an environment acquired from the pool.
+ * Environment is reset to its clean state in background before it is handed out again: buffers mapped into it are
+ * unmapped, so they can be freed once it is released, and hypercall and log handlers are dropped.
+ */
+void ivee_pool_release(ivee_pool_t* pool, ivee_t* ivee);
+
+/**
+ * Get pool statistics
+ */
+int ivee_pool_get_stats(ivee_pool_t* pool, ivee_pool_stats_t* stats);
+
 #ifdef __cplusplus
 }
 #endif
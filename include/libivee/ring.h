@@ -0,0 +1,86 @@
+#pragma once
+
+/*
+ * Shared memory submission/completion ring layout.
+ *
+ * This header is shared between host and guest code. Ring lives in a guest memory region that both sides
+ * map and is driven by a resident guest loop: host produces submission entries and consumes completion
+ * entries, guest does the opposite. Steady state does not involve any VM exits.
+ *
+ * Each index is owned by a single writer and is free-running, entry slot is index & (entries - 1).
+ * Writers publish index with release semantics after filling entries, readers load it with acquire semantics
+ * (plain moves are enough on x86 guest side).
+ *
+ * Guest loop is entered with ring header GPA in RDI. It should keep polling submissions until it observes
+ * a non-zero stop flag with the submission ring empty, then exit the call as usual.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define IVEE_RING_MAGIC 0x52455649u /* "IVER" */
+
+/**
+ * Submission entry: call arguments
+ */
+typedef struct ivee_ring_sqe {
+    uint64_t user_data;
+    uint64_t args[7];
+} ivee_ring_sqe_t;
+
+/**
+ * Completion entry: call results
+ */
+typedef struct ivee_ring_cqe {
+    uint64_t user_data;
+    uint64_t result[3];
+} ivee_ring_cqe_t;
+
+#define IVEE_RING_CACHELINE 64
+
+/**
+ * Ring header at the start of ring region.
+ * Indices sit on their own cache lines to avoid false sharing between host and guest.
+ */
+struct ivee_ring_header {
+    uint32_t magic;
+
+    /* Number of entries in each ring, power of 2. Written for the guest, host never reads it back. */
+    uint32_t entries;
+
+    /* Offsets of submission and completion entry arrays from the start of ring header */
+    uint32_t sq_offset;
+    uint32_t cq_offset;
+
+    /* Set by host when guest loop should exit */
+    uint32_t stop;
+
+    /* Submission ring: guest consumes */
+    uint32_t sq_head __attribute__((aligned(IVEE_RING_CACHELINE)));
+
+    /* Submission ring: host produces */
+    uint32_t sq_tail __attribute__((aligned(IVEE_RING_CACHELINE)));
+
+    /* Completion ring: host consumes */
+    uint32_t cq_head __attribute__((aligned(IVEE_RING_CACHELINE)));
+
+    /* Completion ring: guest produces */
+    uint32_t cq_tail __attribute__((aligned(IVEE_RING_CACHELINE)));
+} __attribute__((aligned(IVEE_RING_CACHELINE)));
+
+/* Fixed offsets for guest code that can't include this header */
+#define IVEE_RING_ENTRIES_OFFSET    4
+#define IVEE_RING_SQ_OFFSET_OFFSET  8
+#define IVEE_RING_CQ_OFFSET_OFFSET  12
+#define IVEE_RING_STOP_OFFSET       16
+#define IVEE_RING_SQ_HEAD_OFFSET    64
+#define IVEE_RING_SQ_TAIL_OFFSET    128
+#define IVEE_RING_CQ_HEAD_OFFSET    192
+#define IVEE_RING_CQ_TAIL_OFFSET    256
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,7 +3,10 @@
 #include <inttypes.h>
 #include <stdatomic.h>
 #include <stdbool.h>
-#include <sys/queue.h>
+#include <sys/types.h>
+
+#include "libivee/libivee.h"
+#include "avl.h"
 
 /* We assume 64-bit VMs */
 typedef uint64_t gpa_t;
@@ -25,8 +28,8 @@ enum ivee_memory_prot
  */
 struct ivee_guest_memory_region
 {
-    /* Link to list of guest regions for containing VM */
-    LIST_ENTRY(ivee_guest_memory_region) link;
+    /* Node in memory map region index, ordered by GFN */
+    struct ivee_avl_node node;
 
     /* Region GFN range */
     gpa_t first_gfn;
@@ -38,14 +41,53 @@ struct ivee_guest_memory_region
     /* Region length in bytes */
     size_t length;
 
+    /*
+     * Host mapping of the backing memory object, region memory starts at map_offset into it.
+     * Huge page backed regions extend to huge page boundaries on both sides to keep host and guest addresses
+     * congruent modulo huge page size, otherwise mapping is the same as region memory.
+     */
+    void* map_base;
+    size_t map_length;
+    size_t map_offset;
+
+    /* Host pages backing region memory */
+    ivee_memory_backing_t backing;
+
+    /* NUMA node region pages are allocated on, -1 if they are left to first touch */
+    int numa_node;
+
     /* Guest memory protection bits */
     enum ivee_memory_prot prot;
+
+    /* Memory object backing this region: memfd for anonymous memory or a duplicate of mapped file fd */
+    int fd;
+
+    /* Offset of host mapping into backing memory object, non-zero only for regions mapped from the middle of a file */
+    off_t fd_offset;
+
+    /* Host memory is mapped read-only */
+    bool host_ro;
+
+    /* Host mapping is a private copy-on-write view of the backing memory object */
+    bool is_private;
+
+    /* Read-only view of the backing memory object used to restore snapshot contents, if any */
+    void* pristine_hva;
+
+    /* Host mapping and pristine view are populated and locked in memory, until either one is replaced */
+    bool is_locked;
+
+    /* Memory is shared between host and guest on purpose: never sealed, snapshotted or cloned */
+    bool is_shared;
+
+    /* Host memory belongs to library user, region has no backing memory object and does not unmap it */
+    bool is_user_memory;
 };
 
 /**
  * VM memory map definition.
  *
- * A flat memory map represents a list of guest physical address space regions
+ * A flat memory map represents a sorted set of guest physical address space regions
  * which may be backed by host virtual address regions. Unmapped regions trigger EPT faults
  * and exit into monitor (us).
  *
@@ -54,10 +96,33 @@ struct ivee_guest_memory_region
  */
 struct ivee_memory_map
 {
-    /* List of mapped guest memory regions */
-    LIST_HEAD(, ivee_guest_memory_region) regions;
+    /* Index of mapped guest memory regions */
+    struct ivee_avl_tree regions;
+
+    /* Preferred host pages for new anonymous regions */
+    ivee_memory_backing_t backing;
+
+    /* NUMA node to allocate pages of new regions on, -1 to leave them to first touch */
+    int numa_node;
 };
 
+/**
+ * Get region with the lowest GPA, NULL if memory map is empty
+ */
+struct ivee_guest_memory_region* ivee_first_memory_region(const struct ivee_memory_map* map);
+
+/**
+ * Get next region in GPA order, NULL if region is the last one
+ */
+struct ivee_guest_memory_region* ivee_next_memory_region(const struct ivee_guest_memory_region* mr);
+
+/**
+ * Iterate over memory map regions in GPA order.
+ * Current region should not be removed from memory map.
+ */
+#define IVEE_MEMORY_MAP_FOREACH(mr, map) \
+    for ((mr) = ivee_first_memory_region(map); (mr); (mr) = ivee_next_memory_region(mr))
+
 /**
  * Init fresh memory map with no regions
  */
@@ -76,7 +141,8 @@ void ivee_free_memory_map(struct ivee_memory_map* map);
  * \length      Length of the region in bytes, will be rounded up to guest page size
  *              Only affect what our process context can do with the memory, not what guest can
  * \mmap_fd     Optional argument to specify what fd to use for an mmap call
- *              If -1 then anonymous memory mapping will be created.
+ *              If -1 then anonymous memory mapping will be created, backed by preferred host pages of memory map
+ *              if region is at least one huge page long and those are available.
  * \host_ro     Host memory is mapped as PROT_READ instead of default PROT_READ|PROT_WRITE
  *              This does not affect guest access permissions (see \prot argument for that)
  * \prot        Guest access permissions
@@ -90,7 +156,108 @@ struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* ma
                                                       bool host_ro,
                                                       enum ivee_memory_prot prot);
 
+/**
+ * Map a range of a file into the guest memory map at specified GPA without copying it.
+ *
+ * Guest-writable regions get a private copy-on-write view of the file, the rest are shared read-only mappings.
+ * File contents should not change while it is mapped, regions and their clones would see those changes
+ * in pages they have not written to.
+ *
+ * \map         Flat memory map to make changes to
+ * \gpa         Page-aligned GPA where region will start
+ * \length      Length of the region in bytes, will be rounded up to guest page size.
+ *              Pages past the end of file can't be accessed.
+ * \fd          File to map, region keeps a duplicate of it
+ * \offset      Page-aligned offset into the file
+ * \prot        Guest access permissions
+ *
+ * Returns newly allocated guest memory region on success, stored in memory map.
+ */
+struct ivee_guest_memory_region* ivee_map_file_memory(struct ivee_memory_map* map,
+                                                      gpa_t gpa,
+                                                      size_t length,
+                                                      int fd,
+                                                      off_t offset,
+                                                      enum ivee_memory_prot prot);
+
+/**
+ * Map existing host memory into the guest memory map at specified GPA without taking ownership of it.
+ * Region is shared (see is_shared) and host memory should stay mapped until region is unmapped.
+ *
+ * \map         Flat memory map to make changes to
+ * \gpa         Page-aligned GPA where region will start
+ * \hva         Page-aligned host memory address
+ * \length      Page-aligned length of the region in bytes
+ * \prot        Guest access permissions
+ *
+ * Returns newly allocated guest memory region on success, stored in memory map.
+ */
+struct ivee_guest_memory_region* ivee_map_user_memory(struct ivee_memory_map* map,
+                                                      gpa_t gpa,
+                                                      void* hva,
+                                                      size_t length,
+                                                      enum ivee_memory_prot prot);
+
+/**
+ * Find a region overlapping with GFN range in O(log n)
+ *
+ * Returns any overlapping region or NULL if range is free
+ */
+struct ivee_guest_memory_region* ivee_find_memory_region(const struct ivee_memory_map* map,
+                                                         gpa_t first_gfn,
+                                                         gpa_t last_gfn);
+
 /**
  * Unmap guest region and free associated host memory
  */
-void ivee_unmap_host_memory(struct ivee_guest_memory_region* mr);
+void ivee_unmap_host_memory(struct ivee_memory_map* map, struct ivee_guest_memory_region* mr);
+
+/**
+ * Turn host mapping of a writable region into a private copy-on-write view of its backing memory object.
+ * Contents of backing memory object are frozen from this point on, further writes from host or guest
+ * only change this region's private copy.
+ *
+ * Host mapping address does not change.
+ */
+int ivee_seal_host_memory(struct ivee_guest_memory_region* mr);
+
+/**
+ * Seal all regions in memory map, see ivee_seal_host_memory
+ */
+int ivee_seal_memory_map(struct ivee_memory_map* map);
+
+/**
+ * Populate and lock host pages of all regions in memory map that are not locked yet.
+ * Writable private mappings get their own copies of every page. User memory regions are left alone.
+ * Fails if locked memory limit is exceeded, regions locked so far stay locked.
+ */
+int ivee_lock_memory_map(struct ivee_memory_map* map);
+
+/**
+ * Make current contents of a sealed region restorable with ivee_restore_host_memory.
+ *
+ * \mr          Sealed guest memory region
+ * \rebase      Current contents of region may differ from its backing memory object and have to
+ *              be copied into a new backing memory object first.
+ */
+int ivee_snapshot_host_memory(struct ivee_guest_memory_region* mr, bool rebase);
+
+/**
+ * Restore a range of a region to its snapshot contents
+ *
+ * \mr          Guest memory region with a snapshot
+ * \offset      Page-aligned offset into region
+ * \length      Page-aligned length of range to restore
+ */
+void ivee_restore_host_memory(struct ivee_guest_memory_region* mr, size_t offset, size_t length);
+
+/**
+ * Map a private copy-on-write view of another region's backing memory object at the same GPA range.
+ *
+ * \map         Flat memory map to make changes to
+ * \src         Region to clone, should be sealed if writable
+ *
+ * Returns newly allocated guest memory region on success, stored in memory map.
+ */
+struct ivee_guest_memory_region* ivee_clone_host_memory(struct ivee_memory_map* map,
+                                                        const struct ivee_guest_memory_region* src);
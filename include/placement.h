@@ -0,0 +1,33 @@
+/**
+ * libivee internal NUMA memory placement and thread pinning
+ */
+
+#pragma once
+
+#include <sched.h>
+#include <stddef.h>
+
+/* Highest NUMA node number we can bind memory to, plus one */
+#define IVEE_MAX_NUMA_NODES 1024
+
+/**
+ * Get CPUs of a NUMA node.
+ * Returns -EINVAL if there is no such node.
+ */
+int ivee_get_numa_node_cpus(int node, cpu_set_t* cpus);
+
+/**
+ * Set memory policy of a mapping to allocate its pages on a NUMA node.
+ * Pages are allocated on other nodes rather than failing when node runs out of memory.
+ *
+ * \ptr         Page-aligned start of mapping
+ * \length      Length of mapping in bytes
+ * \node        NUMA node, negative to leave pages to first touch
+ */
+int ivee_bind_memory(void* ptr, size_t length, int node);
+
+/**
+ * Pin calling thread to a set of CPUs.
+ * Threads stay pinned afterwards, pinning them again to the set they already have only reads their affinity.
+ */
+int ivee_pin_thread(const cpu_set_t* cpus);
@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
 static inline void* ivee_alloc(size_t size)
 {
     return malloc(size);
@@ -14,7 +18,19 @@ static inline void* ivee_zalloc(size_t size)
     return calloc(size, 1);
 }
 
+static inline void* ivee_realloc(void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
 static inline void ivee_free(void* ptr)
 {
     free(ptr);
 }
+
+static inline uint64_t ivee_monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
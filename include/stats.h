@@ -0,0 +1,74 @@
+/**
+ * libivee internal execution statistics
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/queue.h>
+
+#include "libivee/libivee.h"
+#include "histogram.h"
+
+/**
+ * Statistics of a single environment.
+ *
+ * Only the thread holding exclusive use of the environment updates them, so counters are bumped with
+ * relaxed loads and stores instead of locked instructions. Readers on other threads see monotonic values.
+ */
+struct ivee_stats_block
+{
+    _Atomic uint64_t calls;
+    _Atomic uint64_t failed_calls;
+    _Atomic uint64_t runs;
+    _Atomic uint64_t run_errors;
+    _Atomic uint64_t exits[IVEE_STATS_EXIT_REASONS];
+
+    /* Ports are claimed in order of first exit, stored as port + 1 so that 0 marks a free entry */
+    _Atomic uint32_t pio_ports[IVEE_STATS_PIO_PORTS];
+    _Atomic uint64_t pio_exits[IVEE_STATS_PIO_PORTS];
+    _Atomic uint64_t pio_other_exits;
+
+    /* Latencies of call phases */
+    struct ivee_histogram call;
+    struct ivee_histogram load;
+    struct ivee_histogram guest;
+    struct ivee_histogram exit;
+    struct ivee_histogram store;
+
+    TAILQ_ENTRY(ivee_stats_block) link;
+};
+
+/**
+ * Add to a counter only one thread writes to
+ */
+static inline void ivee_stats_add(_Atomic uint64_t* counter, uint64_t value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/**
+ * Allocate environment statistics and include them into process-wide aggregate
+ */
+struct ivee_stats_block* ivee_create_stats(void);
+
+/**
+ * Fold environment statistics into process-wide aggregate and free them
+ */
+void ivee_release_stats(struct ivee_stats_block* stats);
+
+/**
+ * Count a VM exit with its KVM exit reason
+ */
+void ivee_stats_record_exit(struct ivee_stats_block* stats, uint32_t kvm_exit_reason);
+
+/**
+ * Count a port IO exit
+ */
+void ivee_stats_record_pio(struct ivee_stats_block* stats, uint16_t port);
+
+/**
+ * Take a snapshot of environment statistics
+ */
+void ivee_stats_get(const struct ivee_stats_block* stats, ivee_stats_t* out);
@@ -6,8 +6,52 @@
 
 #define X86_PTE_PRESENT     (1ul << 0)
 #define X86_PTE_RW          (1ul << 1)
+#define X86_PTE_PS          (1ul << 7)  /* Large page in PDE/PDPE */
 #define X86_PTE_NX          (1ul << 63)
 
+#define X86_CR0_PE          (1ul << 0)
+#define X86_CR0_MP          (1ul << 1)
+#define X86_CR0_NE          (1ul << 5)
+#define X86_CR0_WP          (1ul << 16)
+#define X86_CR0_PG          (1ul << 31)
+
+#define X86_CR4_PAE         (1ul << 5)
+#define X86_CR4_OSFXSR      (1ul << 9)
+#define X86_CR4_OSXMMEXCPT  (1ul << 10)
+#define X86_CR4_OSXSAVE     (1ul << 18)
+
+/* XCR0 bits and XSAVE state component numbers of user state we pass around */
+#define X86_XFEATURE_FP         0
+#define X86_XFEATURE_SSE        1
+#define X86_XFEATURE_YMM        2
+#define X86_XFEATURE_OPMASK     5
+#define X86_XFEATURE_ZMM_HI256  6
+#define X86_XFEATURE_HI16_ZMM   7
+#define X86_XFEATURES           8
+
+#define X86_XCR0_FP         (1ull << X86_XFEATURE_FP)
+#define X86_XCR0_SSE        (1ull << X86_XFEATURE_SSE)
+#define X86_XCR0_YMM        (1ull << X86_XFEATURE_YMM)
+#define X86_XCR0_AVX512     ((1ull << X86_XFEATURE_OPMASK) | (1ull << X86_XFEATURE_ZMM_HI256) | \
+                             (1ull << X86_XFEATURE_HI16_ZMM))
+
+/* XCR0 bits of state components guests never get */
+#define X86_XCR0_MPX        ((1ull << 3) | (1ull << 4))
+#define X86_XCR0_PKRU       (1ull << 9)
+#define X86_XCR0_AMX        ((1ull << 17) | (1ull << 18))
+#define X86_XCR0_APX        (1ull << 19)
+
+/* Standard format XSAVE area layout, offsets of other components are enumerated by CPUID leaf 0xD */
+#define X86_XSAVE_MXCSR_OFFSET      24
+#define X86_XSAVE_XMM_OFFSET        160
+#define X86_XSAVE_HEADER_OFFSET     512
+
+#define X86_MXCSR_DEFAULT   0x1F80
+
+#define X86_LARGE_PAGE_SHIFT    21
+#define X86_LARGE_PAGE_SIZE     (1ul << X86_LARGE_PAGE_SHIFT)
+#define X86_PAGES_PER_LARGE     (X86_LARGE_PAGE_SIZE >> X86_PAGE_SHIFT)
+
 /**
  * x86 segment descriptor
  * This definition is not exactly how actual descriptor is laid out.
@@ -83,4 +127,8 @@ struct x86_cpu_state
     uint32_t cr0, cr2, cr3, cr4;
     uint32_t efer;
     uint32_t apic_base;
+    uint64_t xcr0;
+
+    /* Segment, descriptor table, control register or XCR0 state changed and has to be pushed to vcpu */
+    bool sregs_dirty;
 };
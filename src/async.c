@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+
+#include "libivee/libivee.h"
+#include "platform.h"
+#include "async.h"
+#include "memory.h"
+#include "kvm.h"
+
+struct ivee_async_worker
+{
+    /* Environment we run calls for */
+    ivee_t* ivee;
+
+    pthread_t thread;
+
+    /* Protects request state below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Submitted call not yet picked up by worker thread */
+    bool has_request;
+
+    /* Worker thread should exit */
+    bool stop;
+
+    /* Worker thread is done with the environment */
+    atomic_bool has_exited;
+
+    /* Call request */
+    ivee_arch_state_t* state;
+    void* cookie;
+
+    /*
+     * Worker is busy from submission until completion is drained by ivee_poll_completions,
+     * which lets us embed completion into the worker instead of allocating it per call.
+     * Modified under g_completions.lock once call is submitted.
+     */
+    bool busy;
+    bool is_queued;
+    int result;
+    TAILQ_ENTRY(ivee_async_worker) link;
+};
+
+/**
+ * Process-wide completion queue
+ */
+static struct ivee_completion_queue {
+    pthread_mutex_t lock;
+
+    /* Readable while there are undrained completions */
+    int eventfd;
+
+    TAILQ_HEAD(, ivee_async_worker) completed;
+} g_completions = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .eventfd = -1,
+    .completed = TAILQ_HEAD_INITIALIZER(g_completions.completed),
+};
+
+/* Create completion eventfd on first use, called with g_completions.lock held */
+static int init_completions_locked(void)
+{
+    if (g_completions.eventfd >= 0) {
+        return 0;
+    }
+
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    g_completions.eventfd = fd;
+    return 0;
+}
+
+/* Reset eventfd counter once the queue becomes empty, called with g_completions.lock held */
+static void clear_eventfd_locked(void)
+{
+    uint64_t value;
+    if (TAILQ_EMPTY(&g_completions.completed)) {
+        (void)read(g_completions.eventfd, &value, sizeof(value));
+    }
+}
+
+static void post_completion(struct ivee_async_worker* worker, int result)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&g_completions.lock);
+
+    /* Only signal eventfd on empty to non-empty transition */
+    bool was_empty = TAILQ_EMPTY(&g_completions.completed);
+
+    worker->result = result;
+    worker->is_queued = true;
+    TAILQ_INSERT_TAIL(&g_completions.completed, worker, link);
+
+    if (was_empty) {
+        (void)write(g_completions.eventfd, &one, sizeof(one));
+    }
+
+    pthread_mutex_unlock(&g_completions.lock);
+}
+
+static void* worker_thread(void* arg)
+{
+    struct ivee_async_worker* worker = arg;
+
+    ivee_kvm_block_process_signals();
+
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->stop) {
+        if (!worker->has_request) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+            continue;
+        }
+
+        worker->has_request = false;
+        pthread_mutex_unlock(&worker->lock);
+
+        int res = ivee_call(worker->ivee, worker->state);
+        post_completion(worker, res);
+
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    atomic_store_explicit(&worker->has_exited, true, memory_order_release);
+    return NULL;
+}
+
+struct ivee_async_worker* ivee_create_async_worker(ivee_t* ivee)
+{
+    pthread_mutex_lock(&g_completions.lock);
+    int res = init_completions_locked();
+    pthread_mutex_unlock(&g_completions.lock);
+
+    if (res != 0) {
+        return NULL;
+    }
+
+    struct ivee_async_worker* worker = ivee_zalloc(sizeof(*worker));
+    if (!worker) {
+        return NULL;
+    }
+
+    worker->ivee = ivee;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+
+    if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) {
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->lock);
+        ivee_free(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+void ivee_release_async_worker(struct ivee_async_worker* worker)
+{
+    if (!worker) {
+        return;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+    /*
+     * Guest of in-flight call may never return, stop it.
+     * Worker could be just entering the call, keep kicking until it leaves.
+     */
+    while (!atomic_load_explicit(&worker->has_exited, memory_order_acquire)) {
+        ivee_cancel(worker->ivee);
+
+        struct timespec delay = { .tv_nsec = 100000 };
+        nanosleep(&delay, NULL);
+    }
+
+    pthread_join(worker->thread, NULL);
+
+    pthread_mutex_lock(&g_completions.lock);
+    if (worker->is_queued) {
+        TAILQ_REMOVE(&g_completions.completed, worker, link);
+        clear_eventfd_locked();
+    }
+    pthread_mutex_unlock(&g_completions.lock);
+
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+    ivee_free(worker);
+}
+
+int ivee_async_submit(struct ivee_async_worker* worker, ivee_arch_state_t* state, void* cookie)
+{
+    pthread_mutex_lock(&g_completions.lock);
+    bool busy = worker->busy;
+    worker->busy = true;
+    pthread_mutex_unlock(&g_completions.lock);
+
+    if (busy) {
+        return -EBUSY;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    worker->state = state;
+    worker->cookie = cookie;
+    worker->has_request = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+    return 0;
+}
+
+int ivee_completion_fd(void)
+{
+    pthread_mutex_lock(&g_completions.lock);
+    int res = init_completions_locked();
+    pthread_mutex_unlock(&g_completions.lock);
+
+    return (res != 0 ? res : g_completions.eventfd);
+}
+
+int ivee_poll_completions(ivee_completion_t* completions, size_t max)
+{
+    if (!completions && max) {
+        return -EINVAL;
+    }
+
+    size_t count = 0;
+
+    pthread_mutex_lock(&g_completions.lock);
+    while (count < max && !TAILQ_EMPTY(&g_completions.completed)) {
+        struct ivee_async_worker* worker = TAILQ_FIRST(&g_completions.completed);
+        TAILQ_REMOVE(&g_completions.completed, worker, link);
+
+        completions[count].ivee = worker->ivee;
+        completions[count].cookie = worker->cookie;
+        completions[count].result = worker->result;
+        ++count;
+
+        worker->is_queued = false;
+        worker->busy = false;
+    }
+
+    if (g_completions.eventfd >= 0) {
+        clear_eventfd_locked();
+    }
+    pthread_mutex_unlock(&g_completions.lock);
+
+    return count;
+}
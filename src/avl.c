@@ -0,0 +1,192 @@
+#include <stddef.h>
+
+#include "avl.h"
+
+static int get_height(const struct ivee_avl_node* node)
+{
+    return node ? node->height : 0;
+}
+
+static void update_height(struct ivee_avl_node* node)
+{
+    int left = get_height(node->left);
+    int right = get_height(node->right);
+    node->height = 1 + (left > right ? left : right);
+}
+
+/* Point parent link that referenced old child to new child */
+static void replace_child(struct ivee_avl_tree* tree,
+                          struct ivee_avl_node* parent,
+                          struct ivee_avl_node* old_child,
+                          struct ivee_avl_node* new_child)
+{
+    if (!parent) {
+        tree->root = new_child;
+    } else if (parent->left == old_child) {
+        parent->left = new_child;
+    } else {
+        parent->right = new_child;
+    }
+}
+
+static struct ivee_avl_node* rotate_left(struct ivee_avl_tree* tree, struct ivee_avl_node* node)
+{
+    struct ivee_avl_node* pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left) {
+        pivot->left->parent = node;
+    }
+
+    pivot->parent = node->parent;
+    replace_child(tree, node->parent, node, pivot);
+
+    pivot->left = node;
+    node->parent = pivot;
+
+    update_height(node);
+    update_height(pivot);
+    return pivot;
+}
+
+static struct ivee_avl_node* rotate_right(struct ivee_avl_tree* tree, struct ivee_avl_node* node)
+{
+    struct ivee_avl_node* pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right) {
+        pivot->right->parent = node;
+    }
+
+    pivot->parent = node->parent;
+    replace_child(tree, node->parent, node, pivot);
+
+    pivot->right = node;
+    node->parent = pivot;
+
+    update_height(node);
+    update_height(pivot);
+    return pivot;
+}
+
+/* Restore balance of a subtree whose children are balanced, returns new subtree root */
+static struct ivee_avl_node* rebalance(struct ivee_avl_tree* tree, struct ivee_avl_node* node)
+{
+    update_height(node);
+
+    int balance = get_height(node->left) - get_height(node->right);
+    if (balance > 1) {
+        if (get_height(node->left->left) < get_height(node->left->right)) {
+            rotate_left(tree, node->left);
+        }
+
+        return rotate_right(tree, node);
+    }
+
+    if (balance < -1) {
+        if (get_height(node->right->right) < get_height(node->right->left)) {
+            rotate_right(tree, node->right);
+        }
+
+        return rotate_left(tree, node);
+    }
+
+    return node;
+}
+
+/* Rebalance every subtree on the path from node to the root */
+static void rebalance_path(struct ivee_avl_tree* tree, struct ivee_avl_node* node)
+{
+    while (node) {
+        node = rebalance(tree, node)->parent;
+    }
+}
+
+void ivee_avl_insert(struct ivee_avl_tree* tree,
+                     struct ivee_avl_node* node,
+                     struct ivee_avl_node* parent,
+                     struct ivee_avl_node** link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    *link = node;
+
+    rebalance_path(tree, parent);
+}
+
+void ivee_avl_remove(struct ivee_avl_tree* tree, struct ivee_avl_node* node)
+{
+    struct ivee_avl_node* rebalance_from;
+
+    if (!node->left || !node->right) {
+        struct ivee_avl_node* child = (node->left ? node->left : node->right);
+        if (child) {
+            child->parent = node->parent;
+        }
+
+        replace_child(tree, node->parent, node, child);
+        rebalance_from = node->parent;
+    } else {
+        /* Put in-order successor in place of removed node */
+        struct ivee_avl_node* successor = node->right;
+        while (successor->left) {
+            successor = successor->left;
+        }
+
+        if (successor->parent != node) {
+            rebalance_from = successor->parent;
+
+            successor->parent->left = successor->right;
+            if (successor->right) {
+                successor->right->parent = successor->parent;
+            }
+
+            successor->right = node->right;
+            node->right->parent = successor;
+        } else {
+            rebalance_from = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+
+        successor->parent = node->parent;
+        replace_child(tree, node->parent, node, successor);
+    }
+
+    rebalance_path(tree, rebalance_from);
+}
+
+struct ivee_avl_node* ivee_avl_first(const struct ivee_avl_tree* tree)
+{
+    struct ivee_avl_node* node = tree->root;
+    if (!node) {
+        return NULL;
+    }
+
+    while (node->left) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+struct ivee_avl_node* ivee_avl_next(const struct ivee_avl_node* node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+
+        return (struct ivee_avl_node*)node;
+    }
+
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
@@ -0,0 +1,106 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "histogram.h"
+
+#define SUB_BUCKETS (1u << IVEE_HISTOGRAM_SUB_BITS)
+
+static unsigned bucket_index(uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - IVEE_HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << IVEE_HISTOGRAM_SUB_BITS) + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_upper_bound(unsigned index)
+{
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+
+    unsigned shift = (index >> IVEE_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t lower = (uint64_t)(SUB_BUCKETS | (index & (SUB_BUCKETS - 1))) << shift;
+    return lower + ((1ull << shift) - 1);
+}
+
+static void update_max(_Atomic uint64_t* max, uint64_t value)
+{
+    uint64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > cur && !atomic_compare_exchange_weak_explicit(max, &cur, value,
+                                                                 memory_order_relaxed,
+                                                                 memory_order_relaxed)) {
+        ;
+    }
+}
+
+void ivee_histogram_record(struct ivee_histogram* h, uint64_t value)
+{
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    update_max(&h->max, value);
+}
+
+static void add_single(_Atomic uint64_t* counter, uint64_t value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void ivee_histogram_record_single(struct ivee_histogram* h, uint64_t value)
+{
+    add_single(&h->buckets[bucket_index(value)], 1);
+    add_single(&h->count, 1);
+    add_single(&h->sum, value);
+
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+void ivee_histogram_merge(struct ivee_histogram* dst, const struct ivee_histogram* src)
+{
+    for (unsigned i = 0; i < IVEE_HISTOGRAM_BUCKETS; ++i) {
+        uint64_t count = atomic_load_explicit(&src->buckets[i], memory_order_relaxed);
+        if (count) {
+            atomic_fetch_add_explicit(&dst->buckets[i], count, memory_order_relaxed);
+        }
+    }
+
+    atomic_fetch_add_explicit(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed), memory_order_relaxed);
+    atomic_fetch_add_explicit(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed), memory_order_relaxed);
+    update_max(&dst->max, atomic_load_explicit(&src->max, memory_order_relaxed));
+}
+
+uint64_t ivee_histogram_percentile(const struct ivee_histogram* h, double p)
+{
+    /* Bucket counters may move while we walk them, so don't trust the total counter */
+    uint64_t total = 0;
+    for (unsigned i = 0; i < IVEE_HISTOGRAM_BUCKETS; ++i) {
+        total += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(total * (p / 100.0));
+    if (rank >= total) {
+        rank = total - 1;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < IVEE_HISTOGRAM_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen > rank) {
+            uint64_t upper = bucket_upper_bound(i);
+            uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+            return (upper < max ? upper : max);
+        }
+    }
+
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
@@ -0,0 +1,609 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <gelf.h>
+
+#include "libivee/libivee.h"
+#include "platform.h"
+#include "memory.h"
+#include "x86.h"
+#include "image.h"
+
+/* Number of images we keep around after their last user is gone */
+#define IVEE_IMAGE_CACHE_SIZE 16
+
+/**
+ * Process-wide image cache, most recently used images first
+ */
+static struct ivee_image_cache {
+    pthread_mutex_t lock;
+    size_t nr_images;
+    TAILQ_HEAD(ivee_image_list, ivee_image) images;
+} g_image_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .images = TAILQ_HEAD_INITIALIZER(g_image_cache.images),
+};
+
+static void free_image(struct ivee_image* image)
+{
+    if (image->fd >= 0) {
+        close(image->fd);
+    }
+
+    if (image->memfd >= 0) {
+        close(image->memfd);
+    }
+
+    ivee_free(image->segments);
+    ivee_free(image->symbols);
+    ivee_free(image->symbol_names);
+    ivee_free(image);
+}
+
+static bool is_same_file(const struct ivee_image* image, const struct stat* st)
+{
+    return image->dev == st->st_dev &&
+           image->ino == st->st_ino &&
+           image->size == st->st_size &&
+           image->mtime.tv_sec == st->st_mtim.tv_sec &&
+           image->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Find cached image and take a reference to it, called with cache lock held */
+static struct ivee_image* find_image_locked(const struct stat* st)
+{
+    struct ivee_image* image;
+    TAILQ_FOREACH(image, &g_image_cache.images, link) {
+        if (is_same_file(image, st)) {
+            TAILQ_REMOVE(&g_image_cache.images, image, link);
+            TAILQ_INSERT_HEAD(&g_image_cache.images, image, link);
+            image->refcount++;
+            return image;
+        }
+    }
+
+    return NULL;
+}
+
+static size_t get_segment_pages_length(const struct ivee_image_segment* seg)
+{
+    size_t length = (seg->vaddr & (X86_PAGE_SIZE - 1)) + seg->memsz;
+    return (length + X86_PAGE_SIZE - 1) & ~(X86_PAGE_SIZE - 1);
+}
+
+/* Symbols that name guest addresses: functions, data objects and assembly labels */
+static bool is_address_symbol(const GElf_Sym* sym)
+{
+    int type = GELF_ST_TYPE(sym->st_info);
+    if (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE) {
+        return false;
+    }
+
+    return sym->st_name != 0 && sym->st_shndx != SHN_UNDEF && sym->st_shndx != SHN_ABS;
+}
+
+/* Find full symbol table, or dynamic one if image is stripped */
+static Elf_Scn* find_symbol_table(Elf* elf, GElf_Shdr* out_shdr)
+{
+    Elf_Scn* found = NULL;
+    Elf_Scn* scn = NULL;
+
+    while ((scn = elf_nextscn(elf, scn)) != NULL) {
+        GElf_Shdr shdr;
+        if (!gelf_getshdr(scn, &shdr)) {
+            continue;
+        }
+
+        if (shdr.sh_type == SHT_SYMTAB) {
+            *out_shdr = shdr;
+            return scn;
+        }
+
+        if (shdr.sh_type == SHT_DYNSYM && !found) {
+            *out_shdr = shdr;
+            found = scn;
+        }
+    }
+
+    return found;
+}
+
+static int compare_symbols(const void* a, const void* b)
+{
+    const struct ivee_image_symbol* sa = a;
+    const struct ivee_image_symbol* sb = b;
+
+    if (sa->addr != sb->addr) {
+        return sa->addr < sb->addr ? -1 : 1;
+    }
+
+    return (sa->size > sb->size) - (sa->size < sb->size);
+}
+
+/* Give symbols without size, such as assembly labels, the range up to next symbol or end of their segment */
+static void size_image_symbols(struct ivee_image* image)
+{
+    for (size_t i = 0; i < image->nr_symbols; ++i) {
+        struct ivee_image_symbol* sym = image->symbols + i;
+        if (sym->size != 0) {
+            continue;
+        }
+
+        uint64_t end = 0;
+        for (size_t j = 0; j < image->nr_segments; ++j) {
+            const struct ivee_image_segment* seg = image->segments + j;
+            if (sym->addr >= seg->vaddr && sym->addr - seg->vaddr < seg->memsz) {
+                end = seg->vaddr + seg->memsz;
+                break;
+            }
+        }
+
+        for (size_t j = i + 1; j < image->nr_symbols; ++j) {
+            if (image->symbols[j].addr > sym->addr) {
+                if (image->symbols[j].addr < end) {
+                    end = image->symbols[j].addr;
+                }
+                break;
+            }
+        }
+
+        if (end > sym->addr) {
+            sym->size = end - sym->addr;
+        }
+    }
+}
+
+/*
+ * Read symbol table into image.
+ * Symbols are only used to describe guest addresses, images with missing or unreadable tables load without them.
+ */
+static int parse_elf64_symbols(struct ivee_image* image, Elf* elf)
+{
+    GElf_Shdr shdr;
+    Elf_Scn* scn = find_symbol_table(elf, &shdr);
+    if (!scn || shdr.sh_entsize == 0) {
+        return 0;
+    }
+
+    Elf_Data* data = elf_getdata(scn, NULL);
+    if (!data) {
+        return 0;
+    }
+
+    /* Count symbols and their name lengths first so that names go into a single pool */
+    size_t count = shdr.sh_size / shdr.sh_entsize;
+    size_t nr_symbols = 0;
+    size_t names_size = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        GElf_Sym sym;
+        if (!gelf_getsym(data, i, &sym) || !is_address_symbol(&sym)) {
+            continue;
+        }
+
+        const char* name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+        if (name) {
+            nr_symbols++;
+            names_size += strlen(name) + 1;
+        }
+    }
+
+    if (nr_symbols == 0) {
+        return 0;
+    }
+
+    image->symbols = ivee_alloc(nr_symbols * sizeof(*image->symbols));
+    image->symbol_names = ivee_alloc(names_size);
+    if (!image->symbols || !image->symbol_names) {
+        return -ENOMEM;
+    }
+
+    char* names = image->symbol_names;
+    for (size_t i = 0; i < count && image->nr_symbols < nr_symbols; ++i) {
+        GElf_Sym sym;
+        if (!gelf_getsym(data, i, &sym) || !is_address_symbol(&sym)) {
+            continue;
+        }
+
+        const char* name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+        if (!name) {
+            continue;
+        }
+
+        struct ivee_image_symbol* image_sym = image->symbols + image->nr_symbols++;
+        image_sym->addr = sym.st_value;
+        image_sym->size = sym.st_size;
+        image_sym->name = names;
+        names = stpcpy(names, name) + 1;
+    }
+
+    qsort(image->symbols, image->nr_symbols, sizeof(*image->symbols), compare_symbols);
+    size_image_symbols(image);
+    return 0;
+}
+
+/* Read ELF64 program headers into image */
+static int parse_elf64(struct ivee_image* image, Elf* elf)
+{
+    /*
+     * libelf keeps its own error codes, we don't pass them on as errno values.
+     * Accepted ELF type: ELF64 executable or dso
+     */
+
+    if (elf_kind(elf) != ELF_K_ELF) {
+        return -ENOEXEC;
+    }
+
+    GElf_Ehdr ehdr;
+    if (!gelf_getehdr(elf, &ehdr)) {
+        return -ENOEXEC;
+    }
+
+    if (gelf_getclass(elf) != ELFCLASS64) {
+        return -ENOTSUP;
+    }
+
+    if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) {
+        return -ENOTSUP;
+    }
+
+    if (ehdr.e_machine != EM_X86_64) {
+        return -ENOTSUP;
+    }
+
+    image->segments = ivee_zalloc(ehdr.e_phnum * sizeof(*image->segments));
+    if (!image->segments && ehdr.e_phnum) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < ehdr.e_phnum; ++i ) {
+        GElf_Phdr phdr;
+
+        if (gelf_getphdr(elf, i, &phdr) != &phdr) {
+            return -ENOEXEC;
+        }
+
+        if (phdr.p_type != PT_LOAD || phdr.p_memsz == 0) {
+            continue;
+        }
+
+        if (phdr.p_filesz > phdr.p_memsz) {
+            return -ENOEXEC;
+        }
+
+        /* Segments are mapped from the file, pages past its end would fault with SIGBUS on first access */
+        if (phdr.p_offset > (uint64_t)image->size || phdr.p_filesz > (uint64_t)image->size - phdr.p_offset) {
+            return -ENOEXEC;
+        }
+
+        struct ivee_image_segment* seg = image->segments + image->nr_segments++;
+        seg->vaddr = phdr.p_vaddr;
+        seg->memsz = phdr.p_memsz;
+        seg->file_offset = phdr.p_offset;
+        seg->filesz = phdr.p_filesz;
+        seg->prot = (phdr.p_flags & PF_X ? IVEE_EXEC : 0) |
+                    (phdr.p_flags & PF_R ? IVEE_READ : 0) |
+                    (phdr.p_flags & PF_W ? IVEE_WRITE : 0);
+    }
+
+    image->entry = ehdr.e_entry;
+    return parse_elf64_symbols(image, elf);
+}
+
+/* Read segment file contents from executable file or its in-memory copy */
+static int read_segment(const struct ivee_image* image,
+                        const void* data,
+                        size_t size,
+                        const struct ivee_image_segment* seg,
+                        void* dest)
+{
+    if (data) {
+        if (seg->file_offset > size || seg->filesz > size - seg->file_offset) {
+            return -ENOEXEC;
+        }
+
+        memcpy(dest, (const uint8_t*)data + seg->file_offset, seg->filesz);
+        return 0;
+    }
+
+    ssize_t nbytes = pread(image->fd, dest, seg->filesz, seg->file_offset);
+    if (nbytes < 0) {
+        return -errno;
+    } else if ((size_t)nbytes != seg->filesz) {
+        return -ENOEXEC;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy segments into a memory object and seal it: read-only ones, or all of them for images without a file.
+ * Environments map it shared, so there is one copy of code and constant data per process
+ * that does not change if the file does. Writable segments are mapped from it privately.
+ *
+ * \data        In-memory executable, NULL to read from image file
+ * \size        Size of in-memory executable
+ */
+static int load_memfd_segments(struct ivee_image* image, const void* data, size_t size)
+{
+    int res = 0;
+
+    size_t length = 0;
+    for (size_t i = 0; i < image->nr_segments; ++i) {
+        struct ivee_image_segment* seg = image->segments + i;
+        if (ivee_is_memfd_segment(image, seg)) {
+            seg->memfd_offset = length;
+            length += get_segment_pages_length(seg);
+        }
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    image->memfd = memfd_create("ivee-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (image->memfd < 0) {
+        return -errno;
+    }
+
+    if (ftruncate(image->memfd, length) != 0) {
+        return -errno;
+    }
+
+    uint8_t* ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, image->memfd, 0);
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+
+    for (size_t i = 0; i < image->nr_segments; ++i) {
+        const struct ivee_image_segment* seg = image->segments + i;
+        if (!ivee_is_memfd_segment(image, seg)) {
+            continue;
+        }
+
+        res = read_segment(image, data, size, seg, ptr + seg->memfd_offset + (seg->vaddr & (X86_PAGE_SIZE - 1)));
+        if (res != 0) {
+            break;
+        }
+    }
+
+    munmap(ptr, length);
+    if (res != 0) {
+        return res;
+    }
+
+    /* Write seal requires writable shared mappings to be gone */
+    if (fcntl(image->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static struct ivee_image* alloc_image(void)
+{
+    struct ivee_image* image = ivee_zalloc(sizeof(*image));
+    if (!image) {
+        return NULL;
+    }
+
+    image->fd = -1;
+    image->memfd = -1;
+    image->refcount = 1;
+    return image;
+}
+
+static int create_image(int fd, const struct stat* st, struct ivee_image** out_image)
+{
+    int res = 0;
+
+    if (elf_version(EV_CURRENT) == EV_NONE) {
+        return -ENOTSUP;
+    }
+
+    struct ivee_image* image = alloc_image();
+    if (!image) {
+        return -ENOMEM;
+    }
+
+    image->dev = st->st_dev;
+    image->ino = st->st_ino;
+    image->mtime = st->st_mtim;
+    image->size = st->st_size;
+
+    image->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (image->fd < 0) {
+        res = -errno;
+        goto error_out;
+    }
+
+    Elf* elf = elf_begin(image->fd, ELF_C_READ, NULL);
+    if (!elf) {
+        res = -ENOEXEC;
+        goto error_out;
+    }
+
+    res = parse_elf64(image, elf);
+    elf_end(elf);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    res = load_memfd_segments(image, NULL, 0);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    *out_image = image;
+    return 0;
+
+error_out:
+    free_image(image);
+    return res;
+}
+
+int ivee_create_image_from_memory(const void* data, size_t size, struct ivee_image** out_image)
+{
+    int res = 0;
+
+    if (!data || !size || !out_image) {
+        return -EINVAL;
+    }
+
+    if (elf_version(EV_CURRENT) == EV_NONE) {
+        return -ENOTSUP;
+    }
+
+    struct ivee_image* image = alloc_image();
+    if (!image) {
+        return -ENOMEM;
+    }
+
+    image->size = size;
+
+    /* libelf does not write to read-only images, its prototype just predates const */
+    Elf* elf = elf_memory((char*)data, size);
+    if (!elf) {
+        res = -ENOEXEC;
+        goto error_out;
+    }
+
+    res = parse_elf64(image, elf);
+    elf_end(elf);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    res = load_memfd_segments(image, data, size);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    *out_image = image;
+    return 0;
+
+error_out:
+    free_image(image);
+    return res;
+}
+
+int ivee_get_image(int fd, struct ivee_image** out_image)
+{
+    int res = 0;
+
+    if (fd < 0 || !out_image) {
+        return -EINVAL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&g_image_cache.lock);
+    struct ivee_image* image = find_image_locked(&st);
+    pthread_mutex_unlock(&g_image_cache.lock);
+
+    if (image) {
+        *out_image = image;
+        return 0;
+    }
+
+    /* Parse outside of the lock, someone else might beat us to it in which case we use theirs */
+    struct ivee_image* new_image = NULL;
+    res = create_image(fd, &st, &new_image);
+    if (res != 0) {
+        return res;
+    }
+
+    struct ivee_image* evicted = NULL;
+
+    pthread_mutex_lock(&g_image_cache.lock);
+
+    image = find_image_locked(&st);
+    if (!image) {
+        image = new_image;
+        new_image = NULL;
+
+        /* One reference for the cache, one for the caller */
+        image->refcount++;
+        TAILQ_INSERT_HEAD(&g_image_cache.images, image, link);
+
+        if (++g_image_cache.nr_images > IVEE_IMAGE_CACHE_SIZE) {
+            evicted = TAILQ_LAST(&g_image_cache.images, ivee_image_list);
+            TAILQ_REMOVE(&g_image_cache.images, evicted, link);
+            g_image_cache.nr_images--;
+
+            if (--evicted->refcount != 0) {
+                evicted = NULL;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&g_image_cache.lock);
+
+    if (new_image) {
+        free_image(new_image);
+    }
+
+    if (evicted) {
+        free_image(evicted);
+    }
+
+    *out_image = image;
+    return 0;
+}
+
+void ivee_ref_image(struct ivee_image* image)
+{
+    pthread_mutex_lock(&g_image_cache.lock);
+    image->refcount++;
+    pthread_mutex_unlock(&g_image_cache.lock);
+}
+
+void ivee_put_image(struct ivee_image* image)
+{
+    if (!image) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_image_cache.lock);
+    bool is_last = (--image->refcount == 0);
+    pthread_mutex_unlock(&g_image_cache.lock);
+
+    if (is_last) {
+        free_image(image);
+    }
+}
+
+const struct ivee_image_symbol* ivee_find_image_symbol(const struct ivee_image* image, uint64_t addr)
+{
+    /* Find first symbol past address */
+    size_t lo = 0;
+    size_t hi = image->nr_symbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (image->symbols[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* Symbols starting at the same address as the one before it are aliases, largest one is last */
+    for (size_t i = lo; i > 0 && image->symbols[i - 1].addr == image->symbols[lo - 1].addr; --i) {
+        const struct ivee_image_symbol* sym = image->symbols + i - 1;
+        if (addr == sym->addr || addr - sym->addr < sym->size) {
+            return sym;
+        }
+    }
+
+    return NULL;
+}
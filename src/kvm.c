@@ -1,13 +1,17 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/kvm.h>
 
 #include "libivee/libivee.h"
@@ -17,7 +21,10 @@
 #include "kvm.h"
 
 #define MIN_KVM_VERSION 12
-#define MAX_KVM_MEMORY_SLOTS 16
+#define MIN_KVM_MEMORY_SLOTS 16
+
+/* Register sets we need KVM to synchronize through kvm_run for the fast call path */
+#define IVEE_KVM_SYNC_REGS (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS)
 
 /**
  * KVM memory slot tracking
@@ -41,6 +48,9 @@ struct ivee_kvm_memory_slot
 
     /* Mapped host virtual address */
     uintptr_t hva;
+
+    /* Dirty pages fetched from KVM but not yet handed out, for slots shared by several memory map regions */
+    uint64_t* dirty_bitmap;
 };
 
 /**
@@ -60,16 +70,66 @@ struct ivee_kvm_vm
     /* Mapped KVM vcpu data */
     struct kvm_run* kvm_run;
 
-    /* Memory slot array */
-    struct ivee_kvm_memory_slot memory_slots[MAX_KVM_MEMORY_SLOTS];
+    /* Coalesced port IO ring, mapped along with vcpu data. NULL if not supported. */
+    struct kvm_coalesced_mmio_ring* coalesced_ring;
+
+    /* Vcpu registers are exchanged through kvm_run->s.regs instead of separate ioctls */
+    bool has_sync_regs;
+
+    /* Used memory slots sorted by GPA, up to KVM limit */
+    struct ivee_kvm_memory_slot* memory_slots;
+    size_t nr_memory_slots;
+
+    /* Bitmap of KVM slot indices in use, slots keep their index for as long as they don't change */
+    uint64_t* slot_indices;
+
+    /* Scratch buffer to fetch dirty logs of shared memory slots */
+    uint64_t* dirty_scratch;
+    size_t dirty_scratch_words;
+
+    /* Writable memory slots log dirty pages */
+    bool dirty_logging;
+
+    /* Scratch XSAVE area for vector state exchange, allocated on first use */
+    struct kvm_xsave* xsave;
 };
 
 static struct ivee_kvm_info {
+    /* Set once all other fields are initialized */
+    atomic_bool is_initialized;
+
     int devfd;
+
+    /* Register sets supported by KVM_CAP_SYNC_REGS */
+    uint32_t sync_regs;
+
+    /* Number of memory slots KVM supports per VM */
+    size_t max_memory_slots;
+
+    /* KVM can coalesce port IO writes into a ring instead of exiting */
+    bool has_coalesced_pio;
+
+    /* Exits that KVM_CAP_X86_DISABLE_EXITS can turn off */
+    uint32_t disable_exits;
+
+    /* KVM can build stage 2 page tables ahead of guest accesses */
+    bool has_pre_fault_memory;
+
+    /* CPUID leaves given to every vcpu */
+    struct kvm_cpuid2* cpuid;
+
+    /* XCR0 vcpus start with, 0 if guests can't use XSAVE */
+    uint64_t xcr0;
+
+    /* Standard format XSAVE area offsets of extended state components in xcr0, by component number */
+    uint32_t xsave_offsets[X86_XFEATURES];
 } g_kvm = {
     .devfd = -1,
 };
 
+/* Serializes KVM initialization between threads creating their first environments */
+static pthread_mutex_t g_kvm_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int kvm_ioctl(int fd, unsigned long request, uintptr_t arg)
 {
     int ret = ioctl(fd, request, arg);
@@ -85,53 +145,322 @@ static inline int kvm_ioctl_noargs(int fd, unsigned long request)
     return kvm_ioctl(fd, request, 0);
 }
 
-int ivee_init_kvm(void)
+/* Address carried in siginfo of kicks we send, tells them from application's own IVEE_KICK_SIGNAL */
+static const char g_kick_cookie;
+
+/* Vcpu of the call current thread is running, set for the whole call so that no kick falls through */
+static __thread struct kvm_run* t_kvm_run __attribute__((tls_model("initial-exec")));
+
+/*
+ * Signal delivery interrupts KVM_RUN already. If signal comes anywhere outside of KVM_RUN during a call,
+ * immediate_exit makes next KVM_RUN return right away instead of running guest without a deadline.
+ */
+static void kick_signal_handler(int signo)
 {
-    int res = 0;
+    struct kvm_run* kvm_run = t_kvm_run;
+    if (kvm_run) {
+        __atomic_store_n(&kvm_run->immediate_exit, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Kick signal default action terminates the process, replace it with a handler that does nothing.
+ * Handlers installed by the application are left alone, they get called on kicks.
+ */
+static int install_kick_signal_handler(void)
+{
+    struct sigaction sa;
+    if (sigaction(IVEE_KICK_SIGNAL, NULL, &sa) != 0) {
+        return -errno;
+    }
 
-    /* Already initialized */
-    if (g_kvm.devfd >= 0) {
+    if ((sa.sa_flags & SA_SIGINFO) || (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)) {
         return 0;
     }
 
-    res = open("/dev/kvm", O_RDONLY);
-    if (res < 0) {
-        return res;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = kick_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(IVEE_KICK_SIGNAL, &sa, NULL) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+/* Find CPUID entry of a leaf and subleaf */
+static struct kvm_cpuid_entry2* find_cpuid_entry(struct kvm_cpuid2* cpuid, uint32_t function, uint32_t index)
+{
+    for (uint32_t i = 0; i < cpuid->nent; ++i) {
+        struct kvm_cpuid_entry2* entry = &cpuid->entries[i];
+        if (entry->function == function &&
+            (!(entry->flags & KVM_CPUID_FLAG_SIGNIFCANT_INDEX) || entry->index == index)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Pick XCR0 for guests out of state components KVM supports, 0 if guests can't have XSAVE */
+static uint64_t select_guest_xcr0(int devfd, struct kvm_cpuid2* cpuid)
+{
+    struct kvm_cpuid_entry2* features = find_cpuid_entry(cpuid, 0x1, 0);
+    struct kvm_cpuid_entry2* xstate = find_cpuid_entry(cpuid, 0xD, 0);
+    if (!features || !(features->ecx & (1u << 26)) || !xstate ||
+        kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE) <= 0 ||
+        kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) <= 0) {
+        return 0;
+    }
+
+    uint64_t xcr0 = (((uint64_t)xstate->edx << 32) | xstate->eax) &
+                    (X86_XCR0_FP | X86_XCR0_SSE | X86_XCR0_YMM | X86_XCR0_AVX512);
+
+    for (unsigned i = X86_XFEATURE_YMM; i < X86_XFEATURES; ++i) {
+        if (!(xcr0 & (1ull << i))) {
+            continue;
+        }
+
+        struct kvm_cpuid_entry2* component = find_cpuid_entry(cpuid, 0xD, i);
+        if (!component || component->eax == 0 || component->ebx + component->eax > sizeof(struct kvm_xsave)) {
+            xcr0 &= ~(1ull << i);
+            continue;
+        }
+
+        g_kvm.xsave_offsets[i] = component->ebx;
+    }
+
+    /* Architecture wants these enabled together */
+    if ((xcr0 & (X86_XCR0_FP | X86_XCR0_SSE)) != (X86_XCR0_FP | X86_XCR0_SSE)) {
+        return 0;
+    }
+
+    if (!(xcr0 & X86_XCR0_YMM) || (xcr0 & X86_XCR0_AVX512) != X86_XCR0_AVX512) {
+        xcr0 &= ~X86_XCR0_AVX512;
+    }
+
+    return xcr0;
+}
+
+/* CPUID feature bits of instructions that need XCR0 state components enabled */
+static const struct {
+    uint64_t xcr0;
+    uint32_t function;
+    uint32_t index;
+    size_t reg;
+    uint32_t mask;
+} g_xfeature_cpuid_bits[] = {
+    /* XSAVE itself */
+    { X86_XCR0_FP | X86_XCR0_SSE, 0x1, 0, offsetof(struct kvm_cpuid_entry2, ecx), 1u << 26 },
+
+    /* FMA, AVX, F16C; AVX2; VAES, VPCLMULQDQ; AVX-VNNI, AVX-IFMA; AVX-VNNI-INT8, AVX-NE-CONVERT, AVX-VNNI-INT16 */
+    { X86_XCR0_YMM, 0x1, 0, offsetof(struct kvm_cpuid_entry2, ecx), (1u << 12) | (1u << 28) | (1u << 29) },
+    { X86_XCR0_YMM, 0x7, 0, offsetof(struct kvm_cpuid_entry2, ebx), 1u << 5 },
+    { X86_XCR0_YMM, 0x7, 0, offsetof(struct kvm_cpuid_entry2, ecx), (1u << 9) | (1u << 10) },
+    { X86_XCR0_YMM, 0x7, 1, offsetof(struct kvm_cpuid_entry2, eax), (1u << 4) | (1u << 23) },
+    { X86_XCR0_YMM, 0x7, 1, offsetof(struct kvm_cpuid_entry2, edx), (1u << 4) | (1u << 5) | (1u << 10) },
+
+    /* AVX-512 F, DQ, IFMA, PF, ER, CD, BW, VL; VBMI, VBMI2, VNNI, BITALG, VPOPCNTDQ; 4VNNIW, 4FMAPS,
+     * VP2INTERSECT, FP16; BF16; AVX10 */
+    { X86_XCR0_AVX512, 0x7, 0, offsetof(struct kvm_cpuid_entry2, ebx),
+      (1u << 16) | (1u << 17) | (1u << 21) | (1u << 26) | (1u << 27) | (1u << 28) | (1u << 30) | (1u << 31) },
+    { X86_XCR0_AVX512, 0x7, 0, offsetof(struct kvm_cpuid_entry2, ecx),
+      (1u << 1) | (1u << 6) | (1u << 11) | (1u << 12) | (1u << 14) },
+    { X86_XCR0_AVX512, 0x7, 0, offsetof(struct kvm_cpuid_entry2, edx), (1u << 2) | (1u << 3) | (1u << 8) | (1u << 23) },
+    { X86_XCR0_AVX512, 0x7, 1, offsetof(struct kvm_cpuid_entry2, eax), 1u << 5 },
+    { X86_XCR0_AVX512, 0x7, 1, offsetof(struct kvm_cpuid_entry2, edx), 1u << 19 },
+
+    /* MPX, PKU, AMX-BF16, AMX-TILE, AMX-INT8, AMX-FP16, APX */
+    { X86_XCR0_MPX, 0x7, 0, offsetof(struct kvm_cpuid_entry2, ebx), 1u << 14 },
+    { X86_XCR0_PKRU, 0x7, 0, offsetof(struct kvm_cpuid_entry2, ecx), 1u << 3 },
+    { X86_XCR0_AMX, 0x7, 0, offsetof(struct kvm_cpuid_entry2, edx), (1u << 22) | (1u << 24) | (1u << 25) },
+    { X86_XCR0_AMX, 0x7, 1, offsetof(struct kvm_cpuid_entry2, eax), 1u << 21 },
+    { X86_XCR0_APX, 0x7, 1, offsetof(struct kvm_cpuid_entry2, edx), 1u << 21 },
+};
+
+/*
+ * Guests trust CPUID rather than XGETBV, so features of state components they don't get in XCR0
+ * are cleared from it, along with leaf 0xD subleaves and AMX tile leaves that describe those components.
+ */
+static void hide_disabled_xfeatures(struct kvm_cpuid2* cpuid, uint64_t xcr0)
+{
+    for (size_t i = 0; i < sizeof(g_xfeature_cpuid_bits) / sizeof(*g_xfeature_cpuid_bits); ++i) {
+        if ((xcr0 & g_xfeature_cpuid_bits[i].xcr0) == g_xfeature_cpuid_bits[i].xcr0) {
+            continue;
+        }
+
+        struct kvm_cpuid_entry2* entry = find_cpuid_entry(cpuid,
+                                                          g_xfeature_cpuid_bits[i].function,
+                                                          g_xfeature_cpuid_bits[i].index);
+        if (entry) {
+            *(uint32_t*)((uint8_t*)entry + g_xfeature_cpuid_bits[i].reg) &= ~g_xfeature_cpuid_bits[i].mask;
+        }
+    }
+
+    /* Legacy area and XSAVE header are always there */
+    uint32_t xsave_size = X86_XSAVE_HEADER_OFFSET + 64;
+
+    for (uint32_t i = 0; i < cpuid->nent; ++i) {
+        struct kvm_cpuid_entry2* entry = &cpuid->entries[i];
+
+        /* Subleaves of user state components, ECX bit 0 marks supervisor ones managed through IA32_XSS */
+        bool hidden = (entry->function == 0xD && entry->index >= 2 && entry->index < 64 && !(entry->ecx & 1) &&
+                       !(xcr0 & (1ull << entry->index)));
+        hidden |= ((entry->function == 0x1D || entry->function == 0x1E) && !(xcr0 & X86_XCR0_AMX));
+
+        if (hidden) {
+            entry->eax = entry->ebx = entry->ecx = entry->edx = 0;
+        } else if (entry->function == 0xD && entry->index >= 2 && entry->index < 64 && !(entry->ecx & 1) &&
+                   entry->ebx + entry->eax > xsave_size) {
+            xsave_size = entry->ebx + entry->eax;
+        }
     }
 
-    g_kvm.devfd = res;
+    /* Only enabled components are enumerated in leaf 0xD, maximal XSAVE area size shrinks with them */
+    struct kvm_cpuid_entry2* xstate = find_cpuid_entry(cpuid, 0xD, 0);
+    if (xstate) {
+        xstate->eax = (uint32_t)xcr0;
+        xstate->edx = (uint32_t)(xcr0 >> 32);
+        xstate->ecx = (xcr0 ? xsave_size : 0);
+    }
+}
+
+/*
+ * Give guests everything KVM supports in CPUID and pick XCR0 they start with: user state up to AVX-512
+ * that fits into KVM_GET_XSAVE area. Other state components are hidden from CPUID along with instructions
+ * that use them, so that guests neither enable nor try them.
+ */
+static int init_guest_cpuid(int devfd)
+{
+    struct kvm_cpuid2* cpuid = NULL;
+    for (uint32_t nent = 64; ; nent *= 2) {
+        cpuid = ivee_zalloc(sizeof(*cpuid) + nent * sizeof(cpuid->entries[0]));
+        if (!cpuid) {
+            return -ENOMEM;
+        }
+
+        cpuid->nent = nent;
+        int res = kvm_ioctl(devfd, KVM_GET_SUPPORTED_CPUID, (uintptr_t)cpuid);
+        if (res == 0) {
+            break;
+        }
+
+        ivee_free(cpuid);
+        if (res != -E2BIG || nent >= 4096) {
+            return res;
+        }
+    }
+
+    g_kvm.cpuid = cpuid;
+    g_kvm.xcr0 = select_guest_xcr0(devfd, cpuid);
+    hide_disabled_xfeatures(cpuid, g_kvm.xcr0);
+
+    return 0;
+}
+
+/* Probe KVM and fill g_kvm, called with g_kvm_init_lock held */
+static int init_kvm_locked(void)
+{
+    int res = 0;
+
+    int devfd = open("/dev/kvm", O_RDONLY | O_CLOEXEC);
+    if (devfd < 0) {
+        return -errno;
+    }
 
-    res = kvm_ioctl_noargs(g_kvm.devfd, KVM_GET_API_VERSION);
+    res = kvm_ioctl_noargs(devfd, KVM_GET_API_VERSION);
     if (res < 0) {
-        return res;
+        goto error_out;
     }
 
     if (res < MIN_KVM_VERSION) {
-        return -ENOTSUP;
+        res = -ENOTSUP;
+        goto error_out;
     }
 
-    res = kvm_ioctl(g_kvm.devfd, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
+    res = kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
     if (res < 0) {
-        return res;
+        goto error_out;
     } else if (res < 1) {
         /* Sanity-check that KVM can handle 1 vcpu vms */
-        return -ENOTSUP;
+        res = -ENOTSUP;
+        goto error_out;
     }
 
-    res = kvm_ioctl(g_kvm.devfd, KVM_CHECK_EXTENSION, KVM_CAP_NR_MEMSLOTS);
+    res = kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_NR_MEMSLOTS);
     if (res < 0) {
-        return res;
+        goto error_out;
+    }
+
+    if (res < MIN_KVM_MEMORY_SLOTS) {
+        res = -ENOSPC;
+        goto error_out;
+    }
+
+    g_kvm.max_memory_slots = res;
+
+    /* Optional, we fall back to register ioctls without it */
+    res = kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+    g_kvm.sync_regs = (res > 0 ? res : 0);
+
+    /* Optional, log port writes exit one by one without it */
+    res = kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO);
+    g_kvm.has_coalesced_pio = (res > 0);
+
+    /* Optional, low latency environments take these exits without it */
+    res = kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+    g_kvm.disable_exits = (res > 0 ? res : 0);
+
+#ifdef KVM_CAP_PRE_FAULT_MEMORY
+    /* Optional, low latency environments fault stage 2 page tables in on first guest access without it */
+    res = kvm_ioctl(devfd, KVM_CHECK_EXTENSION, KVM_CAP_PRE_FAULT_MEMORY);
+    g_kvm.has_pre_fault_memory = (res > 0);
+#endif
+
+    res = init_guest_cpuid(devfd);
+    if (res != 0) {
+        goto error_out;
     }
 
-    if (res < MAX_KVM_MEMORY_SLOTS) {
-        return -ENOSPC;
+    res = install_kick_signal_handler();
+    if (res != 0) {
+        goto error_out;
     }
 
+    g_kvm.devfd = devfd;
     return 0;
+
+error_out:
+    close(devfd);
+    return res;
+}
+
+int ivee_init_kvm(void)
+{
+    int res = 0;
+
+    /* Already initialized, g_kvm is immutable from now on */
+    if (atomic_load_explicit(&g_kvm.is_initialized, memory_order_acquire)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_kvm_init_lock);
+
+    if (!atomic_load_explicit(&g_kvm.is_initialized, memory_order_relaxed)) {
+        res = init_kvm_locked();
+        if (res == 0) {
+            atomic_store_explicit(&g_kvm.is_initialized, true, memory_order_release);
+        }
+    }
+
+    pthread_mutex_unlock(&g_kvm_init_lock);
+    return res;
 }
 
 /* Set default signal mask for KVM_RUN:
- * everything is blocked besides SIGUSR1 */
+ * everything is blocked besides IVEE_KICK_SIGNAL */
 static int set_default_signal_mask(struct ivee_kvm_vm* vm)
 {
     int res = 0;
@@ -142,7 +471,7 @@ static int set_default_signal_mask(struct ivee_kvm_vm* vm)
        return res;
     }
 
-    res = sigdelset(&sigset, SIGUSR1);
+    res = sigdelset(&sigset, IVEE_KICK_SIGNAL);
     if (res != 0) {
        return res;
     }
@@ -158,7 +487,102 @@ static int set_default_signal_mask(struct ivee_kvm_vm* vm)
     return kvm_ioctl(vm->vcpu_fd, KVM_SET_SIGNAL_MASK, (uintptr_t)&data.sigmask);
 }
 
-struct ivee_kvm_vm* ivee_create_kvm_vm(void)
+/* Ring entries that fit into its page, linux/kvm.h defines this with kernel PAGE_SIZE */
+#define IVEE_COALESCED_RING_ENTRIES \
+    ((X86_PAGE_SIZE - sizeof(struct kvm_coalesced_mmio_ring)) / sizeof(struct kvm_coalesced_mmio))
+
+/* Let guest writes to log port pile up in coalesced ring, writes exit only once ring is full */
+static int enable_coalesced_log(struct ivee_kvm_vm* vm)
+{
+    size_t ring_offset = KVM_COALESCED_MMIO_PAGE_OFFSET * X86_PAGE_SIZE;
+    if (!g_kvm.has_coalesced_pio || vm->vcpu_mapping_size < ring_offset + X86_PAGE_SIZE) {
+        return 0;
+    }
+
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = IVEE_LOG_PORT,
+        .size = 1,
+        .pio = 1,
+    };
+
+    int res = kvm_ioctl(vm->fd, KVM_REGISTER_COALESCED_MMIO, (uintptr_t)&zone);
+    if (res != 0) {
+        return res;
+    }
+
+    vm->coalesced_ring = (struct kvm_coalesced_mmio_ring*)((uint8_t*)vm->kvm_run + ring_offset);
+    return 0;
+}
+
+/*
+ * Let guest spin on PAUSE without exits, KVM only yields on them to other vcpus and we have just one.
+ * Has to be done before vcpu is created.
+ * HLT exits are left on: guest has no interrupts to wake it up, HLT exit is how a broken guest fails a call.
+ */
+static int disable_pause_exits(struct ivee_kvm_vm* vm)
+{
+    if (!(g_kvm.disable_exits & KVM_X86_DISABLE_EXITS_PAUSE)) {
+        return 0;
+    }
+
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_X86_DISABLE_EXITS,
+        .args[0] = KVM_X86_DISABLE_EXITS_PAUSE,
+    };
+
+    return kvm_ioctl(vm->fd, KVM_ENABLE_CAP, (uintptr_t)&cap);
+}
+
+/*
+ * First KVM_RUN of a vcpu pays for setting it up in KVM and hardware, get that out of the way with
+ * a throwaway run: a scratch page at reset vector halts the vcpu right away.
+ * This has to happen before memory map is pushed, removing scratch slot drops all stage 2 page tables.
+ * Vcpu registers are loaded in full before the first call, we don't restore them.
+ */
+static int warm_up_vcpu(struct ivee_kvm_vm* vm)
+{
+    int res = 0;
+
+    uint8_t* page = mmap(NULL, X86_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        return -errno;
+    }
+
+    /* hlt at 0xfffffff0 */
+    page[X86_PAGE_SIZE - 16] = 0xf4;
+
+    struct kvm_userspace_memory_region memregion = {
+        .slot = 0,
+        .guest_phys_addr = 0x100000000ull - X86_PAGE_SIZE,
+        .memory_size = X86_PAGE_SIZE,
+        .userspace_addr = (uintptr_t)page,
+    };
+
+    res = kvm_ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, (uintptr_t)&memregion);
+    if (res != 0) {
+        goto out;
+    }
+
+    do {
+        res = kvm_ioctl_noargs(vm->vcpu_fd, KVM_RUN);
+    } while (res == -EINTR);
+
+    if (res == 0 && vm->kvm_run->exit_reason != KVM_EXIT_HLT) {
+        res = -EIO;
+    }
+
+    memregion.memory_size = 0;
+    int err = kvm_ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, (uintptr_t)&memregion);
+    if (res == 0) {
+        res = err;
+    }
+
+out:
+    munmap(page, X86_PAGE_SIZE);
+    return res;
+}
+
+struct ivee_kvm_vm* ivee_create_kvm_vm(bool low_latency)
 {
     struct ivee_kvm_vm* vm = ivee_zalloc(sizeof(*vm));
     if (!vm) {
@@ -173,11 +597,20 @@ struct ivee_kvm_vm* ivee_create_kvm_vm(void)
         goto error_out;
     }
 
+    if (low_latency && disable_pause_exits(vm) != 0) {
+        goto error_out;
+    }
+
     vm->vcpu_fd = kvm_ioctl(vm->fd, KVM_CREATE_VCPU, IVEE_VCPU_APIC_ID);
     if (vm->vcpu_fd < 0) {
         goto error_out;
     }
 
+    /* Has to happen before vcpu first runs */
+    if (kvm_ioctl(vm->vcpu_fd, KVM_SET_CPUID2, (uintptr_t)g_kvm.cpuid) != 0) {
+        goto error_out;
+    }
+
     vm->vcpu_mapping_size = kvm_ioctl_noargs(g_kvm.devfd, KVM_GET_VCPU_MMAP_SIZE);
     if (vm->vcpu_mapping_size < 0) {
         goto error_out;
@@ -192,9 +625,18 @@ struct ivee_kvm_vm* ivee_create_kvm_vm(void)
         goto error_out;
     }
 
-    for (size_t i = 0; i < MAX_KVM_MEMORY_SLOTS; ++i) {
-        struct ivee_kvm_memory_slot* slot = vm->memory_slots + i;
-        slot->index = i;
+    if (enable_coalesced_log(vm) != 0) {
+        goto error_out;
+    }
+
+    if (low_latency && warm_up_vcpu(vm) != 0) {
+        goto error_out;
+    }
+
+    /* Ask KVM to dump GPRs into kvm_run on every exit, sregs are only ever pushed by us */
+    if ((g_kvm.sync_regs & IVEE_KVM_SYNC_REGS) == IVEE_KVM_SYNC_REGS) {
+        vm->kvm_run->kvm_valid_regs = KVM_SYNC_X86_REGS;
+        vm->has_sync_regs = true;
     }
 
     return vm;
@@ -224,6 +666,14 @@ void ivee_release_kvm_vm(struct ivee_kvm_vm* vm)
         close(vm->fd);
     }
 
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        ivee_free(vm->memory_slots[i].dirty_bitmap);
+    }
+
+    ivee_free(vm->memory_slots);
+    ivee_free(vm->slot_indices);
+    ivee_free(vm->dirty_scratch);
+    ivee_free(vm->xsave);
     ivee_free(vm);
 }
 
@@ -231,7 +681,7 @@ static int set_memory_slot(struct ivee_kvm_vm* vm, struct ivee_kvm_memory_slot*
 {
     struct kvm_userspace_memory_region memregion;
     memregion.slot = slot->index;
-    memregion.flags = slot->is_ro ? KVM_MEM_READONLY : 0;
+    memregion.flags = slot->is_ro ? KVM_MEM_READONLY : (vm->dirty_logging ? KVM_MEM_LOG_DIRTY_PAGES : 0);
     memregion.guest_phys_addr = slot->first_gpa;
     memregion.memory_size = slot->last_gpa - slot->first_gpa + 1;
     memregion.userspace_addr = slot->hva;
@@ -241,212 +691,617 @@ static int set_memory_slot(struct ivee_kvm_vm* vm, struct ivee_kvm_memory_slot*
 
 static int delete_memory_slot(struct ivee_kvm_vm* vm, struct ivee_kvm_memory_slot* slot)
 {
-    struct kvm_userspace_memory_region memregion;
+    /* KVM validates flags even for slot deletion */
+    struct kvm_userspace_memory_region memregion = { 0 };
     memregion.slot = slot->index;
     memregion.memory_size = 0;
 
     return kvm_ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, (uintptr_t)&memregion);
 }
 
-int ivee_set_kvm_memory_map(struct ivee_kvm_vm* vm, const struct ivee_memory_map* memmap)
+/* Allocate lowest KVM slot index not used by any slot */
+static int alloc_slot_index(struct ivee_kvm_vm* vm)
 {
-    if (!vm || !memmap) {
-        return -EINVAL;
-    }
-
-    /*
-     * Blindly resetting slot contents is expensive in KVM, however we don't expect memory map to change
-     * often (or at all) for our cases, so we will just reconstruct slots entirely from each new memory map.
-     *
-     * If frequency of memmap updates ever changes this could become a problem.
-     */
-
-    for (size_t i = 0; i < MAX_KVM_MEMORY_SLOTS; ++i) {
-        struct ivee_kvm_memory_slot* slot = vm->memory_slots + i;
-        if (!slot->is_used) {
-            continue;
-        }
-
-        int res = delete_memory_slot(vm, slot);
-        if (res != 0) {
-            return res;
+    if (!vm->slot_indices) {
+        vm->slot_indices = ivee_zalloc(((g_kvm.max_memory_slots + 63) / 64) * sizeof(uint64_t));
+        if (!vm->slot_indices) {
+            return -ENOMEM;
         }
-
-        slot->is_used = false;
     }
 
-    size_t index = 0;
-    struct ivee_guest_memory_region* r;
-    LIST_FOREACH(r, &memmap->regions, link) {
-        if (index == MAX_KVM_MEMORY_SLOTS) {
-            return -ENOSPC;
+    for (size_t i = 0; i < (g_kvm.max_memory_slots + 63) / 64; ++i) {
+        if (~vm->slot_indices[i] == 0) {
+            continue;
         }
 
-        struct ivee_kvm_memory_slot* slot = vm->memory_slots + index;
-        slot->first_gpa = r->first_gfn << 12;
-        slot->last_gpa = ((r->last_gfn + 1) << 12) - 1;
-        slot->is_ro = (r->prot & IVEE_WRITE) == 0; /* KVM does not have a non-executable flag */
-        slot->hva = (uintptr_t)r->hva;
-
-        int res = set_memory_slot(vm, slot);
-        if (res != 0) {
-            return res;
+        size_t index = i * 64 + __builtin_ctzll(~vm->slot_indices[i]);
+        if (index >= g_kvm.max_memory_slots) {
+            break;
         }
 
-        slot->is_used = true;
-        ++index;
+        vm->slot_indices[i] |= 1ull << (index % 64);
+        return (int)index;
     }
 
-    return 0;
-}
-
-static void load_segment(struct kvm_segment* kvmseg, const struct x86_segment* seg)
-{
-    kvmseg->base = seg->base;
-    kvmseg->limit = seg->limit;
-    kvmseg->selector = seg->selector;
-    kvmseg->type = seg->type;
-    kvmseg->dpl = seg->dpl;
-    kvmseg->present = !!(seg->flags & X86_SEG_P);
-    kvmseg->db = !!(seg->flags & X86_SEG_DB);
-    kvmseg->s = !!(seg->flags & X86_SEG_S);
-    kvmseg->l = !!(seg->flags & X86_SEG_L);
-    kvmseg->g = !!(seg->flags & X86_SEG_G);
-    kvmseg->avl = !!(seg->flags & X86_SEG_AVL);
-    kvmseg->unusable = !kvmseg->present;
+    return -ENOSPC;
 }
 
-static void store_segment(const struct kvm_segment* kvmseg, struct x86_segment* seg)
+static void free_slot_index(struct ivee_kvm_vm* vm, int index)
 {
-    seg->base = kvmseg->base;
-    seg->limit = kvmseg->limit;
-    seg->selector = kvmseg->selector;
-    seg->type = kvmseg->type;
-    seg->dpl = kvmseg->dpl;
-    seg->flags |= (kvmseg->present ? X86_SEG_P : 0);
-    seg->flags |= (kvmseg->db ? X86_SEG_DB : 0);
-    seg->flags |= (kvmseg->s ? X86_SEG_S : 0);
-    seg->flags |= (kvmseg->l ? X86_SEG_L : 0);
-    seg->flags |= (kvmseg->g ? X86_SEG_G : 0);
-    seg->flags |= (kvmseg->avl ? X86_SEG_AVL : 0);
+    vm->slot_indices[index / 64] &= ~(1ull << (index % 64));
 }
 
-static void load_dtable(struct kvm_dtable* kvm_dtable, const struct x86_dtbl* dtable)
+static bool is_same_slot(const struct ivee_kvm_memory_slot* a, const struct ivee_kvm_memory_slot* b)
 {
-    kvm_dtable->base = dtable->base;
-    kvm_dtable->limit = dtable->limit;
-    memset(kvm_dtable->padding, 0, sizeof(kvm_dtable->padding));
+    return a->first_gpa == b->first_gpa && a->last_gpa == b->last_gpa && a->hva == b->hva && a->is_ro == b->is_ro;
 }
 
-/* Load effective cpu state into KVM vcpu */
-static int load_vcpu_state(struct ivee_kvm_vm* vm, const struct x86_cpu_state* x86_cpu)
+/* Mark every page of a slot as dirty until its log is fetched, used when slot lost its KVM dirty log */
+static int mark_slot_dirty(struct ivee_kvm_memory_slot* slot)
 {
-    int res = 0;
-
-    struct kvm_regs kvm_regs;
-    kvm_regs.rax = x86_cpu->rax;
-    kvm_regs.rbx = x86_cpu->rbx;
-    kvm_regs.rcx = x86_cpu->rcx;
-    kvm_regs.rdx = x86_cpu->rdx;
-    kvm_regs.rsi = x86_cpu->rsi;
-    kvm_regs.rdi = x86_cpu->rdi;
-    kvm_regs.rsp = x86_cpu->rsp;
-    kvm_regs.rbp = x86_cpu->rbp;
-    kvm_regs.r8 = x86_cpu->r8;
-    kvm_regs.r9 = x86_cpu->r9;
-    kvm_regs.r10 = x86_cpu->r10;
-    kvm_regs.r11 = x86_cpu->r11;
-    kvm_regs.r12 = x86_cpu->r12;
-    kvm_regs.r13 = x86_cpu->r13;
-    kvm_regs.r14 = x86_cpu->r14;
-    kvm_regs.r15 = x86_cpu->r15;
-    kvm_regs.rip = x86_cpu->rip;
-    kvm_regs.rflags = x86_cpu->rflags;
+    size_t slot_pages = (slot->last_gpa - slot->first_gpa + 1) >> X86_PAGE_SHIFT;
+    size_t nwords = (slot_pages + 63) / 64;
 
-    res = kvm_ioctl(vm->vcpu_fd, KVM_SET_REGS, (uintptr_t)&kvm_regs);
-    if (res != 0) {
-        return res;
+    slot->dirty_bitmap = ivee_alloc(nwords * sizeof(uint64_t));
+    if (!slot->dirty_bitmap) {
+        return -ENOMEM;
     }
 
-    struct kvm_sregs kvm_sregs = {0};
-    load_segment(&kvm_sregs.cs, &x86_cpu->cs);
-    load_segment(&kvm_sregs.ds, &x86_cpu->ds);
-    load_segment(&kvm_sregs.es, &x86_cpu->es);
-    load_segment(&kvm_sregs.fs, &x86_cpu->fs);
-    load_segment(&kvm_sregs.gs, &x86_cpu->gs);
-    load_segment(&kvm_sregs.ss, &x86_cpu->ss);
-    load_segment(&kvm_sregs.tr, &x86_cpu->tr);
-    load_segment(&kvm_sregs.ldt, &x86_cpu->ldt);
-    load_dtable(&kvm_sregs.gdt, &x86_cpu->gdt);
-    load_dtable(&kvm_sregs.idt, &x86_cpu->idt);
-    kvm_sregs.cr0 = x86_cpu->cr0;
-    kvm_sregs.cr2 = x86_cpu->cr2;
-    kvm_sregs.cr3 = x86_cpu->cr3;
-    kvm_sregs.cr4 = x86_cpu->cr4;
-    kvm_sregs.efer = x86_cpu->efer;
-    kvm_sregs.apic_base = x86_cpu->apic_base;
-
-    res = kvm_ioctl(vm->vcpu_fd, KVM_SET_SREGS, (uintptr_t)&kvm_sregs);
-    if (res != 0) {
-        return res;
+    memset(slot->dirty_bitmap, 0xff, nwords * sizeof(uint64_t));
+    if (slot_pages % 64) {
+        slot->dirty_bitmap[nwords - 1] = (1ull << (slot_pages % 64)) - 1;
     }
 
     return 0;
 }
 
-/* Store effective cpu state from KVM vcpu */
-__attribute__((unused)) static int store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
+static int compare_memory_slots(const void* a, const void* b)
 {
-    int res = 0;
+    const struct ivee_kvm_memory_slot* sa = a;
+    const struct ivee_kvm_memory_slot* sb = b;
+    return (sa->first_gpa > sb->first_gpa) - (sa->first_gpa < sb->first_gpa);
+}
 
-    struct kvm_regs kvm_regs;
-    res = kvm_ioctl(vm->vcpu_fd, KVM_GET_REGS, (uintptr_t)&kvm_regs);
+/* Build sorted slot list for a memory map, coalescing regions that continue previous slot in both GPA and HVA */
+static int build_memory_slots(const struct ivee_memory_map* memmap,
+                              size_t reserve,
+                              struct ivee_kvm_memory_slot** out_slots,
+                              size_t* out_count)
+{
+    struct ivee_kvm_memory_slot* slots = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    struct ivee_guest_memory_region* r;
+    IVEE_MEMORY_MAP_FOREACH(r, memmap) {
+        gpa_t first_gpa = r->first_gfn << X86_PAGE_SHIFT;
+        gpa_t last_gpa = ((r->last_gfn + 1) << X86_PAGE_SHIFT) - 1;
+        bool is_ro = (r->prot & IVEE_WRITE) == 0; /* KVM does not have a non-executable flag */
+
+        struct ivee_kvm_memory_slot* slot = (count ? slots + count - 1 : NULL);
+        if (slot &&
+            slot->last_gpa + 1 == first_gpa &&
+            slot->hva + (slot->last_gpa - slot->first_gpa + 1) == (uintptr_t)r->hva &&
+            slot->is_ro == is_ro) {
+            slot->last_gpa = last_gpa;
+            continue;
+        }
+
+        if (count == g_kvm.max_memory_slots) {
+            ivee_free(slots);
+            return -ENOSPC;
+        }
+
+        if (count == capacity) {
+            capacity = (capacity ? capacity * 2 : MIN_KVM_MEMORY_SLOTS);
+            struct ivee_kvm_memory_slot* p = ivee_realloc(slots, capacity * sizeof(*slots));
+            if (!p) {
+                ivee_free(slots);
+                return -ENOMEM;
+            }
+
+            slots = p;
+        }
+
+        slot = slots + count++;
+        memset(slot, 0, sizeof(*slot));
+        slot->index = -1;
+        slot->first_gpa = first_gpa;
+        slot->last_gpa = last_gpa;
+        slot->is_ro = is_ro;
+        slot->hva = (uintptr_t)r->hva;
+    }
+
+    /* Leave room for slots we might fail to remove */
+    struct ivee_kvm_memory_slot* p = ivee_realloc(slots, (count + reserve) * sizeof(*slots));
+    if (!p && count + reserve) {
+        ivee_free(slots);
+        return -ENOMEM;
+    }
+
+    *out_slots = p;
+    *out_count = count;
+    return 0;
+}
+
+int ivee_set_kvm_memory_map(struct ivee_kvm_vm* vm, const struct ivee_memory_map* memmap)
+{
+    int res = 0;
+
+    if (!vm || !memmap) {
+        return -EINVAL;
+    }
+
+    struct ivee_kvm_memory_slot* slots;
+    size_t count;
+    res = build_memory_slots(memmap, vm->nr_memory_slots, &slots, &count);
     if (res != 0) {
         return res;
     }
 
-    x86_cpu->rax = kvm_regs.rax;
-    x86_cpu->rbx = kvm_regs.rbx;
-    x86_cpu->rcx = kvm_regs.rcx;
-    x86_cpu->rdx = kvm_regs.rdx;
-    x86_cpu->rsi = kvm_regs.rsi;
-    x86_cpu->rdi = kvm_regs.rdi;
-    x86_cpu->rsp = kvm_regs.rsp;
-    x86_cpu->rbp = kvm_regs.rbp;
-    x86_cpu->r8 = kvm_regs.r8;
-    x86_cpu->r9 = kvm_regs.r9;
-    x86_cpu->r10 = kvm_regs.r10;
-    x86_cpu->r11 = kvm_regs.r11;
-    x86_cpu->r12 = kvm_regs.r12;
-    x86_cpu->r13 = kvm_regs.r13;
-    x86_cpu->r14 = kvm_regs.r14;
-    x86_cpu->r15 = kvm_regs.r15;
-    x86_cpu->rip = kvm_regs.rip;
-    x86_cpu->rflags = kvm_regs.rflags;
-
-    struct kvm_sregs kvm_sregs = {0};
-    res = kvm_ioctl(vm->vcpu_fd, KVM_GET_SREGS, (uintptr_t)&kvm_sregs);
+    /*
+     * Both lists are sorted by GPA. Slots that did not change keep their KVM slot and dirty log,
+     * KVM only hears about slots that were added, removed or changed. Changed slots are removed and added back.
+     */
+    size_t j = 0;
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        struct ivee_kvm_memory_slot* old = vm->memory_slots + i;
+        if (!old->is_used) {
+            continue;
+        }
+
+        while (j < count && slots[j].first_gpa < old->first_gpa) {
+            ++j;
+        }
+
+        if (j < count && is_same_slot(old, slots + j)) {
+            slots[j] = *old;
+            old->is_used = false;
+            old->dirty_bitmap = NULL;
+        }
+    }
+
+    /* Removed slots go first, KVM won't let new slots overlap them */
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        struct ivee_kvm_memory_slot* old = vm->memory_slots + i;
+        if (!old->is_used) {
+            continue;
+        }
+
+        res = delete_memory_slot(vm, old);
+        if (res != 0) {
+            goto out;
+        }
+
+        old->is_used = false;
+        free_slot_index(vm, old->index);
+        ivee_free(old->dirty_bitmap);
+        old->dirty_bitmap = NULL;
+
+        /* Pages that moved to a new slot lose whatever KVM logged for them so far */
+        for (size_t k = 0; vm->dirty_logging && !old->is_ro && k < count; ++k) {
+            struct ivee_kvm_memory_slot* slot = slots + k;
+            if (!slot->is_used && !slot->is_ro && !slot->dirty_bitmap &&
+                slot->first_gpa <= old->last_gpa && old->first_gpa <= slot->last_gpa) {
+                res = mark_slot_dirty(slot);
+                if (res != 0) {
+                    goto out;
+                }
+            }
+        }
+    }
+
+    for (size_t k = 0; k < count; ++k) {
+        struct ivee_kvm_memory_slot* slot = slots + k;
+        if (slot->is_used) {
+            continue;
+        }
+
+        res = alloc_slot_index(vm);
+        if (res < 0) {
+            goto out;
+        }
+
+        slot->index = res;
+        res = set_memory_slot(vm, slot);
+        if (res != 0) {
+            free_slot_index(vm, slot->index);
+            goto out;
+        }
+
+        slot->is_used = true;
+    }
+
+out:
+    /* Whatever is in KVM stays tracked, on failure that might include slots we did not get to remove */
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        struct ivee_kvm_memory_slot* old = vm->memory_slots + i;
+        if (old->is_used) {
+            slots[count++] = *old;
+        }
+    }
+
+    size_t nr_used = 0;
+    for (size_t k = 0; k < count; ++k) {
+        if (slots[k].is_used) {
+            slots[nr_used++] = slots[k];
+        } else {
+            ivee_free(slots[k].dirty_bitmap);
+        }
+    }
+
+    if (res != 0) {
+        qsort(slots, nr_used, sizeof(*slots), compare_memory_slots);
+    }
+
+    ivee_free(vm->memory_slots);
+    vm->memory_slots = slots;
+    vm->nr_memory_slots = nr_used;
+    return res;
+}
+
+int ivee_kvm_enable_dirty_log(struct ivee_kvm_vm* vm)
+{
+    if (!vm) {
+        return -EINVAL;
+    }
+
+    if (vm->dirty_logging) {
+        return 0;
+    }
+
+    vm->dirty_logging = true;
+
+    /* Changing only slot flags is allowed without deleting the slot first */
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        struct ivee_kvm_memory_slot* slot = vm->memory_slots + i;
+        if (!slot->is_used || slot->is_ro) {
+            continue;
+        }
+
+        int res = set_memory_slot(vm, slot);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+/* Find used memory slot containing GPA */
+static struct ivee_kvm_memory_slot* find_memory_slot(struct ivee_kvm_vm* vm, gpa_t gpa)
+{
+    size_t first = 0;
+    size_t last = vm->nr_memory_slots;
+    while (first < last) {
+        size_t mid = first + (last - first) / 2;
+        struct ivee_kvm_memory_slot* slot = vm->memory_slots + mid;
+        if (gpa < slot->first_gpa) {
+            last = mid;
+        } else if (gpa > slot->last_gpa) {
+            first = mid + 1;
+        } else {
+            return (slot->is_used ? slot : NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/* Get 64 bits of a bitmap starting at bit position, bits past the end of bitmap are zero */
+static uint64_t get_bitmap_word(const uint64_t* bitmap, size_t nbits, size_t pos)
+{
+    size_t word = pos / 64;
+    size_t shift = pos % 64;
+
+    uint64_t bits = bitmap[word] >> shift;
+    if (shift && word + 1 < (nbits + 63) / 64) {
+        bits |= bitmap[word + 1] << (64 - shift);
+    }
+
+    return bits;
+}
+
+static void clear_bitmap_range(uint64_t* bitmap, size_t pos, size_t count)
+{
+    while (count) {
+        size_t shift = pos % 64;
+        size_t nbits = (64 - shift < count ? 64 - shift : count);
+        uint64_t mask = (nbits == 64 ? ~0ull : ((1ull << nbits) - 1)) << shift;
+
+        bitmap[pos / 64] &= ~mask;
+        pos += nbits;
+        count -= nbits;
+    }
+}
+
+int ivee_kvm_get_dirty_log(struct ivee_kvm_vm* vm, gpa_t gpa, size_t npages, uint64_t* bitmap)
+{
+    int res = 0;
+
+    if (!vm || !bitmap || !npages) {
+        return -EINVAL;
+    }
+
+    if (!vm->dirty_logging) {
+        return -EINVAL;
+    }
+
+    struct ivee_kvm_memory_slot* slot = find_memory_slot(vm, gpa);
+    if (!slot || slot->is_ro) {
+        return -ENOENT;
+    }
+
+    size_t slot_pages = (slot->last_gpa - slot->first_gpa + 1) >> X86_PAGE_SHIFT;
+    size_t first_page = (gpa - slot->first_gpa) >> X86_PAGE_SHIFT;
+    if (npages > slot_pages - first_page) {
+        return -EINVAL;
+    }
+
+    struct kvm_dirty_log log = {0};
+    log.slot = slot->index;
+
+    /* Range covers the whole slot and nothing is accumulated: let KVM write straight into output bitmap */
+    if (npages == slot_pages && !slot->dirty_bitmap) {
+        log.dirty_bitmap = bitmap;
+        return kvm_ioctl(vm->fd, KVM_GET_DIRTY_LOG, (uintptr_t)&log);
+    }
+
+    /*
+     * Slot is shared by several regions. Fetching its log clears it for all of them,
+     * so we accumulate what other regions have not asked for yet.
+     * Recreated slots also start with all of their pages accumulated as dirty.
+     */
+    size_t nwords = (slot_pages + 63) / 64;
+    if (!slot->dirty_bitmap) {
+        slot->dirty_bitmap = ivee_zalloc(nwords * sizeof(uint64_t));
+        if (!slot->dirty_bitmap) {
+            return -ENOMEM;
+        }
+    }
+
+    if (vm->dirty_scratch_words < nwords) {
+        uint64_t* scratch = ivee_alloc(nwords * sizeof(uint64_t));
+        if (!scratch) {
+            return -ENOMEM;
+        }
+
+        ivee_free(vm->dirty_scratch);
+        vm->dirty_scratch = scratch;
+        vm->dirty_scratch_words = nwords;
+    }
+
+    log.dirty_bitmap = vm->dirty_scratch;
+    res = kvm_ioctl(vm->fd, KVM_GET_DIRTY_LOG, (uintptr_t)&log);
     if (res != 0) {
         return res;
     }
 
-    store_segment(&kvm_sregs.cs, &x86_cpu->cs);
-    store_segment(&kvm_sregs.ds, &x86_cpu->ds);
-    store_segment(&kvm_sregs.es, &x86_cpu->es);
-    store_segment(&kvm_sregs.fs, &x86_cpu->fs);
-    store_segment(&kvm_sregs.gs, &x86_cpu->gs);
-    store_segment(&kvm_sregs.ss, &x86_cpu->ss);
-    store_segment(&kvm_sregs.tr, &x86_cpu->tr);
-    store_segment(&kvm_sregs.ldt, &x86_cpu->ldt);
-    x86_cpu->cr0 = kvm_sregs.cr0;
-    x86_cpu->cr2 = kvm_sregs.cr2;
-    x86_cpu->cr3 = kvm_sregs.cr3;
-    x86_cpu->cr4 = kvm_sregs.cr4;
-    x86_cpu->efer = kvm_sregs.efer;
+    for (size_t i = 0; i < nwords; ++i) {
+        slot->dirty_bitmap[i] |= vm->dirty_scratch[i];
+    }
+
+    for (size_t i = 0; i < (npages + 63) / 64; ++i) {
+        bitmap[i] = get_bitmap_word(slot->dirty_bitmap, slot_pages, first_page + i * 64);
+    }
+
+    if (npages % 64) {
+        bitmap[npages / 64] &= (1ull << (npages % 64)) - 1;
+    }
 
+    clear_bitmap_range(slot->dirty_bitmap, first_page, npages);
     return 0;
 }
 
+static void load_segment(struct kvm_segment* kvmseg, const struct x86_segment* seg)
+{
+    kvmseg->base = seg->base;
+    kvmseg->limit = seg->limit;
+    kvmseg->selector = seg->selector;
+    kvmseg->type = seg->type;
+    kvmseg->dpl = seg->dpl;
+    kvmseg->present = !!(seg->flags & X86_SEG_P);
+    kvmseg->db = !!(seg->flags & X86_SEG_DB);
+    kvmseg->s = !!(seg->flags & X86_SEG_S);
+    kvmseg->l = !!(seg->flags & X86_SEG_L);
+    kvmseg->g = !!(seg->flags & X86_SEG_G);
+    kvmseg->avl = !!(seg->flags & X86_SEG_AVL);
+    kvmseg->unusable = !kvmseg->present;
+}
+
+static void load_dtable(struct kvm_dtable* kvm_dtable, const struct x86_dtbl* dtable)
+{
+    kvm_dtable->base = dtable->base;
+    kvm_dtable->limit = dtable->limit;
+    memset(kvm_dtable->padding, 0, sizeof(kvm_dtable->padding));
+}
+
+static void load_regs(struct kvm_regs* kvm_regs, const struct x86_cpu_state* x86_cpu)
+{
+    kvm_regs->rax = x86_cpu->rax;
+    kvm_regs->rbx = x86_cpu->rbx;
+    kvm_regs->rcx = x86_cpu->rcx;
+    kvm_regs->rdx = x86_cpu->rdx;
+    kvm_regs->rsi = x86_cpu->rsi;
+    kvm_regs->rdi = x86_cpu->rdi;
+    kvm_regs->rsp = x86_cpu->rsp;
+    kvm_regs->rbp = x86_cpu->rbp;
+    kvm_regs->r8 = x86_cpu->r8;
+    kvm_regs->r9 = x86_cpu->r9;
+    kvm_regs->r10 = x86_cpu->r10;
+    kvm_regs->r11 = x86_cpu->r11;
+    kvm_regs->r12 = x86_cpu->r12;
+    kvm_regs->r13 = x86_cpu->r13;
+    kvm_regs->r14 = x86_cpu->r14;
+    kvm_regs->r15 = x86_cpu->r15;
+    kvm_regs->rip = x86_cpu->rip;
+    kvm_regs->rflags = x86_cpu->rflags;
+}
+
+static void store_regs(const struct kvm_regs* kvm_regs, struct x86_cpu_state* x86_cpu)
+{
+    x86_cpu->rax = kvm_regs->rax;
+    x86_cpu->rbx = kvm_regs->rbx;
+    x86_cpu->rcx = kvm_regs->rcx;
+    x86_cpu->rdx = kvm_regs->rdx;
+    x86_cpu->rsi = kvm_regs->rsi;
+    x86_cpu->rdi = kvm_regs->rdi;
+    x86_cpu->rsp = kvm_regs->rsp;
+    x86_cpu->rbp = kvm_regs->rbp;
+    x86_cpu->r8 = kvm_regs->r8;
+    x86_cpu->r9 = kvm_regs->r9;
+    x86_cpu->r10 = kvm_regs->r10;
+    x86_cpu->r11 = kvm_regs->r11;
+    x86_cpu->r12 = kvm_regs->r12;
+    x86_cpu->r13 = kvm_regs->r13;
+    x86_cpu->r14 = kvm_regs->r14;
+    x86_cpu->r15 = kvm_regs->r15;
+    x86_cpu->rip = kvm_regs->rip;
+    x86_cpu->rflags = kvm_regs->rflags;
+}
+
+static void load_sregs(struct kvm_sregs* kvm_sregs, const struct x86_cpu_state* x86_cpu)
+{
+    memset(kvm_sregs, 0, sizeof(*kvm_sregs));
+    load_segment(&kvm_sregs->cs, &x86_cpu->cs);
+    load_segment(&kvm_sregs->ds, &x86_cpu->ds);
+    load_segment(&kvm_sregs->es, &x86_cpu->es);
+    load_segment(&kvm_sregs->fs, &x86_cpu->fs);
+    load_segment(&kvm_sregs->gs, &x86_cpu->gs);
+    load_segment(&kvm_sregs->ss, &x86_cpu->ss);
+    load_segment(&kvm_sregs->tr, &x86_cpu->tr);
+    load_segment(&kvm_sregs->ldt, &x86_cpu->ldt);
+    load_dtable(&kvm_sregs->gdt, &x86_cpu->gdt);
+    load_dtable(&kvm_sregs->idt, &x86_cpu->idt);
+    kvm_sregs->cr0 = x86_cpu->cr0;
+    kvm_sregs->cr2 = x86_cpu->cr2;
+    kvm_sregs->cr3 = x86_cpu->cr3;
+    kvm_sregs->cr4 = x86_cpu->cr4;
+    kvm_sregs->efer = x86_cpu->efer;
+    kvm_sregs->apic_base = x86_cpu->apic_base;
+}
+
+/* XCR0 has no place in sregs and goes through its own ioctl */
+static int load_xcr0(struct ivee_kvm_vm* vm, const struct x86_cpu_state* x86_cpu)
+{
+    if (!x86_cpu->xcr0) {
+        return 0;
+    }
+
+    struct kvm_xcrs xcrs = {
+        .nr_xcrs = 1,
+        .xcrs[0] = { .xcr = 0, .value = x86_cpu->xcr0 },
+    };
+
+    return kvm_ioctl(vm->vcpu_fd, KVM_SET_XCRS, (uintptr_t)&xcrs);
+}
+
+/*
+ * Load effective cpu state into KVM vcpu.
+ *
+ * With sync regs support this only fills kvm_run and lets next KVM_RUN pick the state up,
+ * so a call costs us a single ioctl. Segments and control registers are pushed only when
+ * cached state was marked dirty.
+ */
+static int load_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
+{
+    int res = 0;
+
+    if (vm->has_sync_regs) {
+        load_regs(&vm->kvm_run->s.regs.regs, x86_cpu);
+        vm->kvm_run->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+
+        if (x86_cpu->sregs_dirty) {
+            res = load_xcr0(vm, x86_cpu);
+            if (res != 0) {
+                return res;
+            }
+
+            load_sregs(&vm->kvm_run->s.regs.sregs, x86_cpu);
+            vm->kvm_run->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+            x86_cpu->sregs_dirty = false;
+        }
+
+        return 0;
+    }
+
+    struct kvm_regs kvm_regs;
+    load_regs(&kvm_regs, x86_cpu);
+
+    res = kvm_ioctl(vm->vcpu_fd, KVM_SET_REGS, (uintptr_t)&kvm_regs);
+    if (res != 0) {
+        return res;
+    }
+
+    if (x86_cpu->sregs_dirty) {
+        struct kvm_sregs kvm_sregs;
+        load_sregs(&kvm_sregs, x86_cpu);
+
+        res = kvm_ioctl(vm->vcpu_fd, KVM_SET_SREGS, (uintptr_t)&kvm_sregs);
+        if (res != 0) {
+            return res;
+        }
+
+        res = load_xcr0(vm, x86_cpu);
+        if (res != 0) {
+            return res;
+        }
+
+        x86_cpu->sregs_dirty = false;
+    }
+
+    return 0;
+}
+
+/*
+ * Store effective cpu state from KVM vcpu.
+ *
+ * Only general purpose registers are read back. Segments and control registers stay in the vcpu
+ * as they were last loaded or changed by the guest, cached state keeps what we've pushed last.
+ */
+static int store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
+{
+    int res = 0;
+
+    if (vm->has_sync_regs) {
+        store_regs(&vm->kvm_run->s.regs.regs, x86_cpu);
+        return 0;
+    }
+
+    struct kvm_regs kvm_regs;
+    res = kvm_ioctl(vm->vcpu_fd, KVM_GET_REGS, (uintptr_t)&kvm_regs);
+    if (res != 0) {
+        return res;
+    }
+
+    store_regs(&kvm_regs, x86_cpu);
+    return 0;
+}
+
+void ivee_kvm_pre_fault_memory(struct ivee_kvm_vm* vm)
+{
+#ifdef KVM_PRE_FAULT_MEMORY
+    if (!g_kvm.has_pre_fault_memory) {
+        return;
+    }
+
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        struct kvm_pre_fault_memory range = {
+            .gpa = vm->memory_slots[i].first_gpa,
+            .size = vm->memory_slots[i].last_gpa - vm->memory_slots[i].first_gpa + 1,
+        };
+
+        /* KVM advances range as it goes and may stop early */
+        while (range.size != 0) {
+            int res = kvm_ioctl(vm->vcpu_fd, KVM_PRE_FAULT_MEMORY, (uintptr_t)&range);
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                break;
+            }
+        }
+    }
+#endif
+}
+
 int ivee_kvm_load_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
 {
     return load_vcpu_state(vm, x86_cpu);
@@ -457,6 +1312,266 @@ int ivee_kvm_store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_
     return store_vcpu_state(vm, x86_cpu);
 }
 
+uint64_t ivee_kvm_get_guest_xcr0(void)
+{
+    return g_kvm.xcr0;
+}
+
+/* Fetch vcpu XSAVE area into scratch buffer */
+static int get_xsave(struct ivee_kvm_vm* vm)
+{
+    if (!vm->xsave) {
+        vm->xsave = ivee_zalloc(sizeof(*vm->xsave));
+        if (!vm->xsave) {
+            return -ENOMEM;
+        }
+    }
+
+    return kvm_ioctl(vm->vcpu_fd, KVM_GET_XSAVE, (uintptr_t)vm->xsave);
+}
+
+/* Without XSAVE there is only SSE state, it goes through legacy FPU ioctls */
+static int load_fpu_vector_state(struct ivee_kvm_vm* vm, const ivee_vector_state_t* vector_state)
+{
+    struct kvm_fpu fpu;
+    int res = kvm_ioctl(vm->vcpu_fd, KVM_GET_FPU, (uintptr_t)&fpu);
+    if (res != 0) {
+        return res;
+    }
+
+    for (unsigned i = 0; i < 16; ++i) {
+        memcpy(fpu.xmm[i], vector_state->zmm[i], sizeof(fpu.xmm[i]));
+    }
+
+    fpu.mxcsr = vector_state->mxcsr;
+    return kvm_ioctl(vm->vcpu_fd, KVM_SET_FPU, (uintptr_t)&fpu);
+}
+
+static int store_fpu_vector_state(struct ivee_kvm_vm* vm, ivee_vector_state_t* vector_state)
+{
+    struct kvm_fpu fpu;
+    int res = kvm_ioctl(vm->vcpu_fd, KVM_GET_FPU, (uintptr_t)&fpu);
+    if (res != 0) {
+        return res;
+    }
+
+    memset(vector_state, 0, sizeof(*vector_state));
+    for (unsigned i = 0; i < 16; ++i) {
+        memcpy(vector_state->zmm[i], fpu.xmm[i], sizeof(fpu.xmm[i]));
+    }
+
+    vector_state->mxcsr = fpu.mxcsr;
+    return 0;
+}
+
+int ivee_kvm_load_vector_state(struct ivee_kvm_vm* vm, const ivee_vector_state_t* vector_state)
+{
+    if (!g_kvm.xcr0) {
+        return load_fpu_vector_state(vm, vector_state);
+    }
+
+    /* Patch current area to keep x87 and other state we don't pass around */
+    int res = get_xsave(vm);
+    if (res != 0) {
+        return res;
+    }
+
+    uint8_t* area = (uint8_t*)vm->xsave->region;
+    uint64_t xstate_bv;
+    memcpy(&xstate_bv, area + X86_XSAVE_HEADER_OFFSET, sizeof(xstate_bv));
+
+    memcpy(area + X86_XSAVE_MXCSR_OFFSET, &vector_state->mxcsr, sizeof(vector_state->mxcsr));
+    for (unsigned i = 0; i < 16; ++i) {
+        memcpy(area + X86_XSAVE_XMM_OFFSET + i * 16, vector_state->zmm[i], 16);
+    }
+
+    xstate_bv |= X86_XCR0_SSE;
+
+    if (g_kvm.xcr0 & X86_XCR0_YMM) {
+        for (unsigned i = 0; i < 16; ++i) {
+            memcpy(area + g_kvm.xsave_offsets[X86_XFEATURE_YMM] + i * 16, vector_state->zmm[i] + 16, 16);
+        }
+
+        xstate_bv |= X86_XCR0_YMM;
+    }
+
+    if (g_kvm.xcr0 & X86_XCR0_AVX512) {
+        memcpy(area + g_kvm.xsave_offsets[X86_XFEATURE_OPMASK], vector_state->k, sizeof(vector_state->k));
+        for (unsigned i = 0; i < 16; ++i) {
+            memcpy(area + g_kvm.xsave_offsets[X86_XFEATURE_ZMM_HI256] + i * 32, vector_state->zmm[i] + 32, 32);
+            memcpy(area + g_kvm.xsave_offsets[X86_XFEATURE_HI16_ZMM] + i * 64, vector_state->zmm[16 + i], 64);
+        }
+
+        xstate_bv |= X86_XCR0_AVX512;
+    }
+
+    memcpy(area + X86_XSAVE_HEADER_OFFSET, &xstate_bv, sizeof(xstate_bv));
+    return kvm_ioctl(vm->vcpu_fd, KVM_SET_XSAVE, (uintptr_t)vm->xsave);
+}
+
+int ivee_kvm_store_vector_state(struct ivee_kvm_vm* vm, ivee_vector_state_t* vector_state)
+{
+    if (!g_kvm.xcr0) {
+        return store_fpu_vector_state(vm, vector_state);
+    }
+
+    int res = get_xsave(vm);
+    if (res != 0) {
+        return res;
+    }
+
+    /* Components in their initial state are all zeroes and their area contents are stale */
+    const uint8_t* area = (const uint8_t*)vm->xsave->region;
+    uint64_t xstate_bv;
+    memcpy(&xstate_bv, area + X86_XSAVE_HEADER_OFFSET, sizeof(xstate_bv));
+    xstate_bv &= g_kvm.xcr0;
+
+    memset(vector_state, 0, sizeof(*vector_state));
+    memcpy(&vector_state->mxcsr, area + X86_XSAVE_MXCSR_OFFSET, sizeof(vector_state->mxcsr));
+
+    if (xstate_bv & X86_XCR0_SSE) {
+        for (unsigned i = 0; i < 16; ++i) {
+            memcpy(vector_state->zmm[i], area + X86_XSAVE_XMM_OFFSET + i * 16, 16);
+        }
+    }
+
+    if (xstate_bv & X86_XCR0_YMM) {
+        for (unsigned i = 0; i < 16; ++i) {
+            memcpy(vector_state->zmm[i] + 16, area + g_kvm.xsave_offsets[X86_XFEATURE_YMM] + i * 16, 16);
+        }
+    }
+
+    if (xstate_bv & (1ull << X86_XFEATURE_OPMASK)) {
+        memcpy(vector_state->k, area + g_kvm.xsave_offsets[X86_XFEATURE_OPMASK], sizeof(vector_state->k));
+    }
+
+    if (xstate_bv & (1ull << X86_XFEATURE_ZMM_HI256)) {
+        for (unsigned i = 0; i < 16; ++i) {
+            memcpy(vector_state->zmm[i] + 32, area + g_kvm.xsave_offsets[X86_XFEATURE_ZMM_HI256] + i * 32, 32);
+        }
+    }
+
+    if (xstate_bv & (1ull << X86_XFEATURE_HI16_ZMM)) {
+        for (unsigned i = 0; i < 16; ++i) {
+            memcpy(vector_state->zmm[16 + i], area + g_kvm.xsave_offsets[X86_XFEATURE_HI16_ZMM] + i * 64, 64);
+        }
+    }
+
+    return 0;
+}
+
+void ivee_kvm_drain_coalesced_log(struct ivee_kvm_vm* vm,
+                                  void (*fn)(void* ctx, const void* data, size_t size),
+                                  void* ctx)
+{
+    struct kvm_coalesced_mmio_ring* ring = vm->coalesced_ring;
+    if (!ring) {
+        return;
+    }
+
+    /* KVM publishes entries by moving last, we free them by moving first */
+    uint32_t first = ring->first;
+    uint32_t last = __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+
+    while (first != last) {
+        const struct kvm_coalesced_mmio* entry = &ring->coalesced_mmio[first];
+        fn(ctx, entry->data, (entry->len < sizeof(entry->data) ? entry->len : sizeof(entry->data)));
+
+        first = (first + 1) % IVEE_COALESCED_RING_ENTRIES;
+        __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
+    }
+}
+
+void ivee_kvm_set_immediate_exit(struct ivee_kvm_vm* vm, bool immediate_exit)
+{
+    __atomic_store_n(&vm->kvm_run->immediate_exit, immediate_exit, __ATOMIC_SEQ_CST);
+}
+
+/* Older C libraries only have the kernel name of SIGEV_THREAD_ID target */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+void ivee_kvm_block_process_signals(void)
+{
+    /* A blocked kick would stay pending and interrupt every later KVM_RUN */
+    sigset_t sigset;
+    sigfillset(&sigset);
+    sigdelset(&sigset, IVEE_KICK_SIGNAL);
+    pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+}
+
+int ivee_kvm_kick_thread(pthread_t thread)
+{
+    union sigval value = { .sival_ptr = (void*)&g_kick_cookie };
+    return -pthread_sigqueue(thread, IVEE_KICK_SIGNAL, value);
+}
+
+void ivee_kvm_init_kick_event(struct sigevent* sev, pid_t tid)
+{
+    memset(sev, 0, sizeof(*sev));
+    sev->sigev_notify = SIGEV_THREAD_ID;
+    sev->sigev_signo = IVEE_KICK_SIGNAL;
+    sev->sigev_value.sival_ptr = (void*)&g_kick_cookie;
+    sev->sigev_notify_thread_id = tid;
+}
+
+static bool is_kick(const siginfo_t* info)
+{
+    if (info->si_value.sival_ptr != &g_kick_cookie) {
+        return false;
+    }
+
+    return (info->si_code == SI_TIMER) || (info->si_code == SI_QUEUE && info->si_pid == getpid());
+}
+
+void ivee_kvm_consume_kick(void)
+{
+    sigset_t pending;
+    if (sigpending(&pending) != 0 || !sigismember(&pending, IVEE_KICK_SIGNAL)) {
+        return;
+    }
+
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, IVEE_KICK_SIGNAL);
+
+    /*
+     * Signals pending on the thread are dequeued before process-wide ones and kicks are always sent
+     * to the thread, so if the first one we get is not a kick there is no kick pending.
+     */
+    siginfo_t info;
+    struct timespec timeout = { 0 };
+    if (sigtimedwait(&sigset, &info, &timeout) != IVEE_KICK_SIGNAL || is_kick(&info)) {
+        return;
+    }
+
+    /* Not ours, put it back. Kernel won't requeue kill() siginfo from other threads, resend plain signal then. */
+    pid_t pid = getpid();
+    pid_t tid = syscall(SYS_gettid);
+    if (info.si_code == SI_TKILL) {
+        if (syscall(SYS_rt_tgsigqueueinfo, pid, tid, IVEE_KICK_SIGNAL, &info) != 0) {
+            syscall(SYS_tgkill, pid, tid, IVEE_KICK_SIGNAL);
+        }
+    } else {
+        if (syscall(SYS_rt_sigqueueinfo, pid, IVEE_KICK_SIGNAL, &info) != 0) {
+            kill(pid, IVEE_KICK_SIGNAL);
+        }
+    }
+}
+
+void ivee_kvm_begin_call(struct ivee_kvm_vm* vm)
+{
+    t_kvm_run = vm->kvm_run;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void ivee_kvm_end_call(void)
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    t_kvm_run = NULL;
+}
+
 int ivee_kvm_run(struct ivee_kvm_vm* vm, struct ivee_exit* exit)
 {
     int res = 0;
@@ -466,6 +1581,8 @@ int ivee_kvm_run(struct ivee_kvm_vm* vm, struct ivee_exit* exit)
         return res;
     }
 
+    exit->kvm_exit_reason = vm->kvm_run->exit_reason;
+
     switch (vm->kvm_run->exit_reason) {
     case KVM_EXIT_IO:
         exit->exit_reason = IVEE_EXIT_IO;
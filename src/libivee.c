@@ -1,19 +1,39 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
-#include <gelf.h>
-
 #include "libivee/libivee.h"
 #include "platform.h"
 #include "memory.h"
 #include "x86.h"
 #include "kvm.h"
+#include "async.h"
+#include "environment.h"
+#include "image.h"
+#include "histogram.h"
+#include "stats.h"
+#include "placement.h"
 
 struct ivee {
+    /* Usage guard: 0 when idle, number of shared users or IVEE_EXCLUSIVE_USE */
+    atomic_int users;
+
+    /* Creation options, CPU set filled from NUMA node if it was empty */
+    ivee_create_options_t options;
+
+    /* CPUs threads running calls are pinned to, if any */
+    bool has_cpus;
+    cpu_set_t cpus;
+
     /* Underlying KVM VM/VCPU */
     struct ivee_kvm_vm* vm;
 
@@ -26,29 +46,211 @@ struct ivee {
     /* Loaded executable entry point */
     uint64_t entry_addr;
 
+    /* Loaded ELF64 image, kept for its symbols. NULL for other formats. */
+    struct ivee_image* image;
+
     /* Region that maps guest page table pages */
     struct ivee_guest_memory_region* gpt_mr;
 
     /* Flag set to true if guest requested termination */
     bool should_terminate;
+
+    /* Last call ended at IVEE_YIELD_PORT, VCPU keeps guest context for ivee_resume */
+    bool is_yielded;
+
+    /* Guest memory may have diverged from its backing memory objects */
+    bool memory_diverged;
+
+    /* Snapshot taken with ivee_snapshot */
+    bool has_snapshot;
+    struct x86_cpu_state snapshot_x86_cpu;
+
+    /*
+     * Memory map changed after snapshot: guest page tables were patched and restoring
+     * their snapshot contents rolls those patches back.
+     */
+    bool memory_map_changed;
+
+    /* Scratch buffer for dirty page bitmaps */
+    uint64_t* dirty_bitmap;
+    size_t dirty_bitmap_words;
+
+    /* VCPU thread for asynchronous calls, created on first use under exclusive use and never replaced */
+    struct ivee_async_worker* async;
+
+    /* Hypercall table indexed by hypercall number */
+    struct ivee_hypercall {
+        ivee_hypercall_t fn;
+        void* ctx;
+    } hypercalls[IVEE_MAX_HYPERCALLS];
+
+    /* Guest log output handler and output collected for it */
+    ivee_log_handler_t log_handler;
+    void* log_ctx;
+    size_t log_length;
+    char log_buffer[1024];
+
+    /* Execution statistics, updated by the thread running calls */
+    struct ivee_stats_block* stats;
+
+    /*
+     * Thread running a call, if any. Protected by run_lock so that ivee_cancel
+     * only kicks a thread that is still inside the call it wants to stop.
+     */
+    pthread_mutex_t run_lock;
+    bool is_running;
+    pthread_t run_thread;
+    atomic_bool cancel_requested;
+
+    /* Deadline timer, created on first call with a deadline. Timers signal the thread they were created for. */
+    bool has_deadline_timer;
+    timer_t deadline_timer;
+    pid_t deadline_timer_tid;
 };
 
+#define IVEE_EXCLUSIVE_USE (-1)
+
+/*
+ * Environment usage guards.
+ *
+ * Environments are not meant to be shared between threads without external synchronization,
+ * guards only detect such misuse and turn it into -EBUSY instead of a data race.
+ * Calls that change environment state take exclusive use, calls that only read it take shared use.
+ */
+int ivee_enter_exclusive(struct ivee* ivee)
+{
+    int expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&ivee->users, &expected, IVEE_EXCLUSIVE_USE,
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+void ivee_leave_exclusive(struct ivee* ivee)
+{
+    atomic_store_explicit(&ivee->users, 0, memory_order_release);
+}
+
+static int enter_shared(struct ivee* ivee)
+{
+    int users = atomic_load_explicit(&ivee->users, memory_order_relaxed);
+    do {
+        if (users == IVEE_EXCLUSIVE_USE) {
+            return -EBUSY;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&ivee->users, &users, users + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
+
+    return 0;
+}
+
+static void leave_shared(struct ivee* ivee)
+{
+    atomic_fetch_sub_explicit(&ivee->users, 1, memory_order_release);
+}
+
 uint64_t ivee_list_platform_capabilities(void)
 {
     /* TODO: we don't support any caps yet */
     return 0;
 }
 
+uint64_t ivee_list_vector_features(void)
+{
+    if (ivee_init_kvm() != 0) {
+        return 0;
+    }
+
+    uint64_t xcr0 = ivee_kvm_get_guest_xcr0();
+    uint64_t features = IVEE_VECTOR_SSE;
+
+    if (xcr0 & X86_XCR0_YMM) {
+        features |= IVEE_VECTOR_AVX;
+    }
+
+    if (xcr0 & X86_XCR0_AVX512) {
+        features |= IVEE_VECTOR_AVX512;
+    }
+
+    return features;
+}
+
+void ivee_init_create_options(ivee_create_options_t* options)
+{
+    if (!options) {
+        return;
+    }
+
+    memset(options, 0, sizeof(*options));
+    options->numa_node = IVEE_NUMA_NODE_ANY;
+}
+
+/* Resolve CPU set of creation options and check NUMA node exists */
+static int init_placement(struct ivee* ivee, const ivee_create_options_t* options)
+{
+    int res = 0;
+
+    ivee->options = *options;
+
+    CPU_ZERO(&ivee->cpus);
+    for (size_t cpu = 0; cpu < IVEE_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+        if (options->cpus[cpu / 64] & (1ull << (cpu % 64))) {
+            CPU_SET(cpu, &ivee->cpus);
+        }
+    }
+
+    if (options->numa_node != IVEE_NUMA_NODE_ANY) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", options->numa_node);
+        if (options->numa_node < 0 || options->numa_node >= IVEE_MAX_NUMA_NODES || access(path, F_OK) != 0) {
+            return -EINVAL;
+        }
+
+        if (CPU_COUNT(&ivee->cpus) == 0) {
+            res = ivee_get_numa_node_cpus(options->numa_node, &ivee->cpus);
+            if (res != 0) {
+                return res;
+            }
+
+            /* Clones start from resolved set and don't read it again */
+            for (size_t cpu = 0; cpu < IVEE_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &ivee->cpus)) {
+                    ivee->options.cpus[cpu / 64] |= 1ull << (cpu % 64);
+                }
+            }
+        }
+    }
+
+    /* Memory-only nodes have no CPUs, we don't pin to them */
+    ivee->has_cpus = (CPU_COUNT(&ivee->cpus) != 0);
+    return 0;
+}
+
 int ivee_create(enum ivee_capabilities caps, struct ivee** out_ivee_ptr)
 {
-    if (!out_ivee_ptr) {
+    ivee_create_options_t options;
+    ivee_init_create_options(&options);
+    options.caps = caps;
+
+    return ivee_create_ex(&options, out_ivee_ptr);
+}
+
+int ivee_create_ex(const ivee_create_options_t* options, struct ivee** out_ivee_ptr)
+{
+    if (!options || !out_ivee_ptr) {
         return -EINVAL;
     }
 
-    if (caps & ~ivee_list_platform_capabilities()) {
+    if (options->caps & ~ivee_list_platform_capabilities()) {
         return -ENOTSUP;
     }
 
+    if (options->flags & ~IVEE_CREATE_LOW_LATENCY) {
+        return -EINVAL;
+    }
+
     int res = 0;
 
     struct ivee* ivee = ivee_zalloc(sizeof(*ivee));
@@ -56,12 +258,25 @@ int ivee_create(enum ivee_capabilities caps, struct ivee** out_ivee_ptr)
         return -ENOMEM;
     }
 
+    pthread_mutex_init(&ivee->run_lock, NULL);
+
+    res = init_placement(ivee, options);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    ivee->stats = ivee_create_stats();
+    if (!ivee->stats) {
+        res = -ENOMEM;
+        goto error_out;
+    }
+
     res = ivee_init_kvm();
     if (res != 0) {
         goto error_out;
     }
 
-    ivee->vm = ivee_create_kvm_vm();
+    ivee->vm = ivee_create_kvm_vm((options->flags & IVEE_CREATE_LOW_LATENCY) != 0);
     if (!ivee->vm) {
         res = -ENXIO;
         goto error_out;
@@ -72,6 +287,8 @@ int ivee_create(enum ivee_capabilities caps, struct ivee** out_ivee_ptr)
         goto error_out;
     }
 
+    ivee->memory_map.numa_node = options->numa_node;
+
     *out_ivee_ptr = ivee;
     return 0;
 
@@ -86,15 +303,82 @@ void ivee_destroy(struct ivee* ivee)
         return;
     }
 
+    ivee_release_async_worker(ivee->async);
     ivee_release_kvm_vm(ivee->vm);
+    ivee_free_memory_map(&ivee->memory_map);
+    ivee_free(ivee->dirty_bitmap);
+    ivee_put_image(ivee->image);
+    ivee_release_stats(ivee->stats);
+
+    if (ivee->has_deadline_timer) {
+        timer_delete(ivee->deadline_timer);
+    }
+
+    pthread_mutex_destroy(&ivee->run_lock);
     ivee_free(ivee);
 }
 
+int ivee_set_memory_backing(struct ivee* ivee, ivee_memory_backing_t backing)
+{
+    int res = 0;
+
+    if (!ivee || backing < IVEE_MEMORY_NORMAL || backing > IVEE_MEMORY_HUGETLB_1G) {
+        return -EINVAL;
+    }
+
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    ivee->memory_map.backing = backing;
+
+    ivee_leave_exclusive(ivee);
+    return 0;
+}
+
+int ivee_get_memory_backing(struct ivee* ivee, ivee_memory_backing_t* backing)
+{
+    int res = 0;
+
+    if (!ivee || !backing) {
+        return -EINVAL;
+    }
+
+    res = enter_shared(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    /* Regions we allocate ourselves that are large enough to get huge pages */
+    bool has_eligible = false;
+    ivee_memory_backing_t weakest = IVEE_MEMORY_HUGETLB_1G;
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        if (mr->is_user_memory || mr->host_ro || mr->length < X86_LARGE_PAGE_SIZE) {
+            continue;
+        }
+
+        has_eligible = true;
+        if (mr->backing < weakest) {
+            weakest = mr->backing;
+        }
+    }
+
+    *backing = (has_eligible ? weakest : IVEE_MEMORY_NORMAL);
+
+    leave_shared(ivee);
+    return 0;
+}
+
 /*
  * We need the following amount of 4KiB guest page table pages to map 1GiB of memory in 4KiB pages:
  * 1 for PML4 + 1 for PDPE + 1 for PDE + 512 for PTEs = 515 pages
  *
  * Statically compute guest GPA for PML4 base address if we map it at the end of 4GiB address space.
+ *
+ * Each PDE has its own PTE page reserved, but PTE pages are only used (and populated) for 2MiB ranges
+ * that can't be mapped with a single large PDE.
  */
 #define IVEE_GUEST_MEMORY_SIZE  (0x40000000ull)
 #define IVEE_GUEST_PAGES_COUNT  (IVEE_GUEST_MEMORY_SIZE >> X86_PAGE_SHIFT)
@@ -104,11 +388,116 @@ void ivee_destroy(struct ivee* ivee)
 #define IVEE_PDE_BASE_GPA       (IVEE_PDPE_BASE_GPA + X86_PAGE_SIZE)
 #define IVEE_PTE_BASE_GPA       (IVEE_PDE_BASE_GPA + X86_PAGE_SIZE)
 
+/* Translate page table GPA into host address */
+static uint64_t* get_page_table(struct ivee* ivee, gpa_t gpa)
+{
+    return (uint64_t*)((uint8_t*)ivee->gpt_mr->hva + (gpa - IVEE_PML4_BASE_GPA));
+}
+
+/* Page table entry access bits for region */
+static uint64_t get_pte_prot(const struct ivee_guest_memory_region* mr)
+{
+    return (mr->prot & IVEE_WRITE ? X86_PTE_RW : 0) |
+           (mr->prot & IVEE_EXEC ?  0 : X86_PTE_NX) |
+           X86_PTE_PRESENT;
+}
+
+/* Get PTE page for a PDE, making PDE point to it if it does not already */
+static uint64_t* get_pte_page(struct ivee* ivee, uint64_t* pde, size_t index)
+{
+    gpa_t pte_page_gpa = IVEE_PTE_BASE_GPA + X86_PAGE_SIZE * index;
+    uint64_t* ptes = get_page_table(ivee, pte_page_gpa);
+
+    /* Large PDEs only cover whole 2MiB ranges of a single region, so we never need to split one */
+    if (!(*pde & X86_PTE_PRESENT)) {
+        memset(ptes, 0, X86_PAGE_SIZE);
+        *pde = pte_page_gpa | X86_PTE_PRESENT | X86_PTE_RW;
+    }
+
+    return ptes;
+}
+
+/*
+ * Identity-map region pages in guest page table.
+ * 2MiB ranges fully covered by region are mapped with large PDEs, the rest with 4KiB PTEs.
+ */
+static int map_guest_pages(struct ivee* ivee, const struct ivee_guest_memory_region* mr)
+{
+    if (mr->last_gfn >= IVEE_GUEST_PAGES_COUNT) {
+        return -ERANGE;
+    }
+
+    uint64_t* pdes = get_page_table(ivee, IVEE_PDE_BASE_GPA);
+    uint64_t prot = get_pte_prot(mr);
+
+    gpa_t gfn = mr->first_gfn;
+    while (gfn <= mr->last_gfn) {
+        size_t index = gfn / X86_PAGES_PER_LARGE;
+        gpa_t large_first_gfn = index * X86_PAGES_PER_LARGE;
+        gpa_t large_last_gfn = large_first_gfn + X86_PAGES_PER_LARGE - 1;
+
+        if (gfn == large_first_gfn && large_last_gfn <= mr->last_gfn) {
+            pdes[index] = (large_first_gfn << X86_PAGE_SHIFT) | X86_PTE_PS | prot;
+            gfn = large_last_gfn + 1;
+            continue;
+        }
+
+        uint64_t* ptes = get_pte_page(ivee, &pdes[index], index);
+        gpa_t last_gfn = (large_last_gfn < mr->last_gfn ? large_last_gfn : mr->last_gfn);
+        for (; gfn <= last_gfn; ++gfn) {
+            ptes[gfn - large_first_gfn] = (gfn << X86_PAGE_SHIFT) | prot;
+        }
+    }
+
+    return 0;
+}
+
+/* Remove region pages from guest page table */
+static void unmap_guest_pages(struct ivee* ivee, const struct ivee_guest_memory_region* mr)
+{
+    uint64_t* pdes = get_page_table(ivee, IVEE_PDE_BASE_GPA);
+
+    gpa_t gfn = mr->first_gfn;
+    while (gfn <= mr->last_gfn) {
+        size_t index = gfn / X86_PAGES_PER_LARGE;
+        gpa_t large_first_gfn = index * X86_PAGES_PER_LARGE;
+        gpa_t large_last_gfn = large_first_gfn + X86_PAGES_PER_LARGE - 1;
+        gpa_t last_gfn = (large_last_gfn < mr->last_gfn ? large_last_gfn : mr->last_gfn);
+
+        if (pdes[index] & X86_PTE_PS) {
+            pdes[index] = 0;
+        } else if (pdes[index] & X86_PTE_PRESENT) {
+            uint64_t* ptes = get_page_table(ivee, IVEE_PTE_BASE_GPA + X86_PAGE_SIZE * index);
+            memset(&ptes[gfn - large_first_gfn], 0, (last_gfn - gfn + 1) * sizeof(*ptes));
+        }
+
+        gfn = last_gfn + 1;
+    }
+}
+
+/* Rebuild guest page tables from current memory map */
+static int map_all_guest_pages(struct ivee* ivee)
+{
+    /* Mark all PDEs as non-present first, PTE pages are cleared when PDEs start using them */
+    memset(get_page_table(ivee, IVEE_PDE_BASE_GPA), 0, X86_PAGE_SIZE);
+
+    /* Go over guest regions and map present entries */
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        int res = map_guest_pages(ivee, mr);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    return 0;
+}
+
 /*
- * Setup guest identity-mapped 4KB page tables based on current guest memory map.
+ * Setup guest identity-mapped page tables based on current guest memory map.
  * Memory map should be finalized at this point.
  *
- * We will allocate and map host memory enough to hold full 1GiB guest identity mapping,
+ * We will allocate and map host memory enough to hold full 1GiB guest identity mapping in 4KiB pages,
  * however only currently mapped physical memory will be mapped in those page tables.
  * The rest is reserved for guest to make it's own mappings when needed.
  */
@@ -127,38 +516,13 @@ static int init_guest_page_table(struct ivee* ivee)
         return -ENOMEM;
     }
 
-    uint64_t* pentry = (uint64_t*) ivee->gpt_mr->hva;
-
     /* 1 entry in PML4 always present */
-    *pentry = IVEE_PDPE_BASE_GPA | X86_PTE_PRESENT;
-    pentry += X86_PAGE_SIZE / sizeof(*pentry);
+    *get_page_table(ivee, IVEE_PML4_BASE_GPA) = IVEE_PDPE_BASE_GPA | X86_PTE_PRESENT | X86_PTE_RW;
 
     /* 1 entry in PDPE always present */
-    *pentry = IVEE_PDE_BASE_GPA | X86_PTE_PRESENT;
-    pentry += X86_PAGE_SIZE / sizeof(*pentry);
+    *get_page_table(ivee, IVEE_PDPE_BASE_GPA) = IVEE_PDE_BASE_GPA | X86_PTE_PRESENT | X86_PTE_RW;
 
-    /* 4KiB worth of PDE mappings always present */
-    for (size_t i = 0; i < X86_PTES_PER_PAGE; ++i, ++pentry) {
-        *pentry = (IVEE_PTE_BASE_GPA + X86_PAGE_SIZE * i) | X86_PTE_PRESENT | X86_PTE_RW;
-    }
-
-    /* Mark all PTEs as non-present first */
-    uint64_t* pte_pages_base = pentry;
-    memset(pte_pages_base, 0, IVEE_GUEST_PAGES_COUNT * sizeof(*pentry));
-
-    /* Go over guest regions and map present PTE entries */
-    struct ivee_guest_memory_region* mr;
-    LIST_FOREACH(mr, &ivee->memory_map.regions, link) {
-        for (uint64_t gfn = mr->first_gfn; gfn <= mr->last_gfn; ++gfn) {
-            uint64_t* ppte = &pte_pages_base[((gfn >> 9) & 0x1FF) * X86_PTES_PER_PAGE];
-            ppte[gfn & 0x1FF] = (gfn << X86_PAGE_SHIFT) |
-                (mr->prot & IVEE_WRITE ? X86_PTE_RW : 0) |
-                (mr->prot & IVEE_EXEC ?  0 : X86_PTE_NX) |
-                X86_PTE_PRESENT;
-        }
-    }
-
-    return 0;
+    return map_all_guest_pages(ivee);
 }
 
 static void reset_x86_segment(struct x86_segment* seg,
@@ -216,192 +580,264 @@ static void init_x86_cpu(struct x86_cpu_state* x86_cpu)
     /*
      * Setup the rest of 64-bit control register context
      */
-    x86_cpu->cr0 = 0x80010001;  /* PG | PE | WP */
-    x86_cpu->cr4 = 0x20;        /* PAE */
-    x86_cpu->efer = 0x500;      /* LMA | LME */
+    x86_cpu->cr0 = X86_CR0_PG | X86_CR0_WP | X86_CR0_NE | X86_CR0_MP | X86_CR0_PE;
+    x86_cpu->cr4 = X86_CR4_PAE;
+    x86_cpu->efer = 0xD00;      /* NXE | LMA | LME */
     x86_cpu->cr3 = IVEE_PML4_BASE_GPA;
+
+    /*
+     * Let guest use SSE and whatever AVX state KVM supports, like a host OS would.
+     * SIMD floating point exceptions are reported as #XM, not through legacy x87 #MF.
+     */
+    x86_cpu->cr4 |= X86_CR4_OSFXSR | X86_CR4_OSXMMEXCPT;
+    x86_cpu->xcr0 = ivee_kvm_get_guest_xcr0();
+    if (x86_cpu->xcr0) {
+        x86_cpu->cr4 |= X86_CR4_OSXSAVE;
+    }
+
+    x86_cpu->sregs_dirty = true;
 }
 
-/* Load flat binary into VM and create a page table for it */
-static int load_bin(struct ivee* ivee, const char* file)
+/**
+ * Where we load an executable from: either a file or a memory buffer
+ */
+struct ivee_executable_source
 {
-    int res = 0;
+    int fd;
 
-    struct stat st;
-    res = stat(file, &st);
-    if (res != 0) {
-        return res;
-    }
-
-    size_t size = st.st_size;
-    if (size == 0) {
-        return -EINVAL;
-    }
+    const void* data;
+    size_t size;
+};
 
+/* Load flat binary into VM and create a page table for it */
+static int load_bin(struct ivee* ivee, const struct ivee_executable_source* src)
+{
     /*
      * Memory map the binary and map that into guest directly for readonly.
-     * No other memory is mapped.
+     * No other memory is mapped. Binaries in memory are copied, they have to outlive their buffer.
      */
 
-    int fd = open(file, O_RDONLY);
-    if (fd < 0) {
-        return fd;
+    size_t size = src->size;
+    if (!src->data) {
+        struct stat st;
+        if (fstat(src->fd, &st) != 0) {
+            return -errno;
+        }
+
+        size = st.st_size;
+    }
+
+    if (size == 0) {
+        return -EINVAL;
     }
 
     ivee->entry_addr = 0x400000;
     struct ivee_guest_memory_region* image_mr = ivee_map_host_memory(&ivee->memory_map,
                                                                      ivee->entry_addr,
                                                                      size,
-                                                                     fd,
-                                                                     true,
+                                                                     (src->data ? -1 : src->fd),
+                                                                     (src->data ? false : true),
                                                                      IVEE_READ | IVEE_EXEC);
-    close(fd);
     if (!image_mr) {
         return -ENOMEM;
     }
 
+    if (src->data) {
+        memcpy(image_mr->hva, src->data, size);
+    }
+
     return 0;
 }
 
-int load_elf64(struct ivee* ivee, const char* file)
+/* Allocate anonymous memory for a range of segment pages and read segment file contents into it at data_offset */
+static int copy_elf64_segment_pages(struct ivee* ivee,
+                                    int fd,
+                                    gpa_t gpa,
+                                    size_t length,
+                                    size_t data_offset,
+                                    off_t file_offset,
+                                    size_t file_length,
+                                    enum ivee_memory_prot prot)
 {
-    int res = 0;
+    struct ivee_guest_memory_region* mr = ivee_map_host_memory(&ivee->memory_map, gpa, length, -1, false, prot);
+    if (!mr) {
+        return -ENOMEM;
+    }
 
-    if (elf_version(EV_CURRENT) == EV_NONE) {
-        return -ENOTSUP;
+    ssize_t nbytes = pread(fd, (uint8_t*)mr->hva + data_offset, file_length, file_offset);
+    if (nbytes < 0) {
+        return -errno;
+    } else if ((size_t)nbytes != file_length) {
+        return -EINVAL;
     }
 
-    int fd = open(file, O_RDONLY);
-    if (fd < 0) {
-        return fd;
+    return 0;
+}
+
+/*
+ * Map a writable segment into guest memory.
+ *
+ * Segments whose file offset is congruent to their address modulo page size are mapped straight from the file,
+ * which is true for anything a regular linker produces. Page that holds the end of file contents is copied
+ * into anonymous memory along with zero-filled .bss pages if segment has any: file mapping would show
+ * unrelated file bytes past p_filesz and clones won't see zeroes written into it.
+ * Misaligned segments are copied entirely.
+ */
+static int load_elf64_writable_segment(struct ivee* ivee, int fd, const struct ivee_image_segment* seg)
+{
+    /* Segment might not start on a page boundary, guest memory has to */
+    size_t page_offset = seg->vaddr & (X86_PAGE_SIZE - 1);
+    gpa_t gpa = seg->vaddr - page_offset;
+    size_t length = page_offset + seg->memsz;
+
+    if ((seg->file_offset & (X86_PAGE_SIZE - 1)) != page_offset) {
+        return copy_elf64_segment_pages(ivee, fd, gpa, length, page_offset, seg->file_offset, seg->filesz, seg->prot);
     }
 
-    Elf* elf = elf_begin(fd, ELF_C_READ, NULL);
-    if (!elf) {
-        res = -elf_errno();
-        goto error_out;
+    off_t file_offset = seg->file_offset - page_offset;
+    size_t file_length = page_offset + seg->filesz;
+
+    /* Without .bss the last partial page can come from the file as well */
+    size_t mapped_length = (seg->memsz == seg->filesz ?
+                            length :
+                            file_length & ~(X86_PAGE_SIZE - 1));
+    if (mapped_length) {
+        struct ivee_guest_memory_region* mr = ivee_map_file_memory(&ivee->memory_map,
+                                                                   gpa,
+                                                                   mapped_length,
+                                                                   fd,
+                                                                   file_offset,
+                                                                   seg->prot);
+        if (!mr) {
+            return -ENOMEM;
+        }
     }
 
-    if (elf_kind(elf) != ELF_K_ELF) {
-        res = -elf_errno();
-        goto error_out;
+    if (mapped_length >= length) {
+        return 0;
     }
 
-    /*
-     * Accepted ELF type: ELF64 executable or dso
-     */
+    return copy_elf64_segment_pages(ivee,
+                                    fd,
+                                    gpa + mapped_length,
+                                    length - mapped_length,
+                                    0,
+                                    file_offset + mapped_length,
+                                    file_length - mapped_length,
+                                    seg->prot);
+}
 
-    GElf_Ehdr ehdr;
-    if (!gelf_getehdr(elf, &ehdr)) {
-        res = -elf_errno();
-        goto error_out;
+/* Map a segment of a parsed image into guest memory */
+static int load_elf64_segment(struct ivee* ivee, const struct ivee_image* image, const struct ivee_image_segment* seg)
+{
+    if (!ivee_is_memfd_segment(image, seg)) {
+        return load_elf64_writable_segment(ivee, image->fd, seg);
     }
 
-    if (gelf_getclass(elf) != ELFCLASS64) {
-        res = -ENOTSUP;
-        goto error_out;
+    /* Shared by every environment loading this image, writable segments get a private view */
+    gpa_t gpa = seg->vaddr & ~(X86_PAGE_SIZE - 1);
+    size_t length = (seg->vaddr & (X86_PAGE_SIZE - 1)) + seg->memsz;
+    struct ivee_guest_memory_region* mr = ivee_map_file_memory(&ivee->memory_map,
+                                                               gpa,
+                                                               length,
+                                                               image->memfd,
+                                                               seg->memfd_offset,
+                                                               seg->prot);
+    if (!mr) {
+        return -ENOMEM;
     }
 
-    if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) {
-        res = -ENOTSUP;
-        goto error_out;
+    return 0;
+}
+
+static int load_elf64(struct ivee* ivee, const struct ivee_executable_source* src)
+{
+    int res = 0;
+
+    /* Files are parsed once per process, see image.c */
+    struct ivee_image* image = NULL;
+    if (src->data) {
+        res = ivee_create_image_from_memory(src->data, src->size, &image);
+    } else {
+        res = ivee_get_image(src->fd, &image);
     }
 
-    if (ehdr.e_machine != EM_X86_64) {
-        res = -ENOTSUP;
-        goto error_out;
+    if (res != 0) {
+        return res;
     }
 
     /*
-     * For each segment in program header table:
-     * - Create a memory region to be mapped into guest with proper permissions
-     * - Load segment into memory region
-     * - Map region into guest address space at the base address specified in segment entry
+     * For each loadable segment in program header table map its memory into guest address space
+     * at the base address specified in segment entry.
      */
 
-    for (size_t i = 0; i < ehdr.e_phnum; ++i ) {
-        GElf_Phdr phdr;
-
-        if (gelf_getphdr(elf, i, &phdr) != &phdr) {
-            res = -elf_errno();
-            goto error_out;
+    for (size_t i = 0; i < image->nr_segments; ++i) {
+        res = load_elf64_segment(ivee, image, image->segments + i);
+        if (res != 0) {
+            goto out;
         }
+    }
 
-        if (phdr.p_type != PT_LOAD) {
-            continue;
-        }
+    ivee->entry_addr = image->entry;
 
-        struct ivee_guest_memory_region* segment_mr = ivee_map_host_memory(&ivee->memory_map,
-                                                                           phdr.p_vaddr,
-                                                                           phdr.p_memsz,
-                                                                           -1,
-                                                                           false,
-                                                                           (phdr.p_flags & PF_X ? IVEE_EXEC : 0) |
-                                                                           (phdr.p_flags & PF_R ? IVEE_READ : 0) |
-                                                                           (phdr.p_flags & PF_W ? IVEE_WRITE : 0));
-        if (!segment_mr) {
-            goto error_out;
-        }
-
-        ssize_t nbytes = pread(fd, segment_mr->hva, phdr.p_filesz, phdr.p_offset);
-        if (nbytes != phdr.p_filesz) {
-            res = -errno;
-            goto error_out;
-        }
-    }
-
-    ivee->entry_addr = ehdr.e_entry;
-
-    elf_end(elf);
-    close(fd);
-
-    return 0;
-
-error_out:
-    elf_end(elf);
-    close(fd);
+    /* Environment keeps our reference */
+    ivee->image = image;
+    return 0;
 
+out:
+    ivee_put_image(image);
     return res;
 }
 
-int load_any(struct ivee* ivee, const char* file)
+static int load_any(struct ivee* ivee, const struct ivee_executable_source* src)
 {
     int res = 0;
 
-    res = load_elf64(ivee, file);
-    if (res == 0) {
+    res = load_elf64(ivee, src);
+    if (res != -ENOEXEC) {
         return res;
     }
 
-    return load_bin(ivee, file);
+    return load_bin(ivee, src);
 }
 
-int ivee_load_executable(struct ivee* ivee, const char* file, ivee_executable_format_t format)
+/* Low latency environments take host page faults up front, every time memory map changes */
+static int lock_memory_map(struct ivee* ivee)
 {
-    int res = 0;
-
-    if (!ivee) {
-        return -EINVAL;
+    if (!(ivee->options.flags & IVEE_CREATE_LOW_LATENCY)) {
+        return 0;
     }
 
-    if (!file) {
-        return -EINVAL;
-    }
+    return ivee_lock_memory_map(&ivee->memory_map);
+}
 
-    /* We must have read and execute access for the file */
-    if (0 != access(file, R_OK | X_OK)) {
-        return -EINVAL;
+/* Same for stage 2 page faults, once memory map is pushed to KVM */
+static void pre_fault_memory_map(struct ivee* ivee)
+{
+    if (ivee->options.flags & IVEE_CREATE_LOW_LATENCY) {
+        ivee_kvm_pre_fault_memory(ivee->vm);
     }
+}
+
+static int load_executable(struct ivee* ivee,
+                           const struct ivee_executable_source* src,
+                           ivee_executable_format_t format)
+{
+    int res = 0;
+
+    ivee_put_image(ivee->image);
+    ivee->image = NULL;
+    ivee->is_yielded = false;
 
     switch (format) {
     case IVEE_EXEC_BIN:
-        res = load_bin(ivee, file);
+        res = load_bin(ivee, src);
         break;
     case IVEE_EXEC_ELF64:
-        res = load_elf64(ivee, file);
+        res = load_elf64(ivee, src);
         break;
     case IVEE_EXEC_ANY:
-        res = load_any(ivee, file);
+        res = load_any(ivee, src);
         break;
     default:
         res = -ENOTSUP;
@@ -416,116 +852,1232 @@ int ivee_load_executable(struct ivee* ivee, const char* file, ivee_executable_fo
         goto error_out;
     }
 
+    /* Freeze loaded image in backing memory, this is what clones will start from */
+    res = ivee_seal_memory_map(&ivee->memory_map);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    /* Lock before KVM sees new regions, mlock is the step most likely to fail */
+    res = lock_memory_map(ivee);
+    if (res != 0) {
+        goto error_out;
+    }
+
     res = ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
     if (res != 0) {
         goto error_out;
     }
 
+    pre_fault_memory_map(ivee);
+
     init_x86_cpu(&ivee->x86_cpu);
     return 0;
 
 error_out:
-    /* On failure drop memory map we've accumulated */
+    /*
+     * On failure drop memory map we've accumulated along with image and KVM slots that refer to it.
+     * Slots could be there from a push that failed half way or from an earlier load.
+     */
     ivee_free_memory_map(&ivee->memory_map);
+    ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+
+    ivee->gpt_mr = NULL;
+    ivee_put_image(ivee->image);
+    ivee->image = NULL;
     return res;
 }
 
-static int load_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
+static int load_executable_locked(struct ivee* ivee,
+                                  const struct ivee_executable_source* src,
+                                  ivee_executable_format_t format)
 {
-    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
-    x86_cpu->rax = state->rax;
-    x86_cpu->rbx = state->rbx;
-    x86_cpu->rcx = state->rcx;
-    x86_cpu->rdx = state->rdx;
-    x86_cpu->rsi = state->rsi;
-    x86_cpu->rdi = state->rdi;
-    x86_cpu->rbp = state->rbp;
-    x86_cpu->r8 = state->r8;
-    x86_cpu->r9 = state->r9;
-    x86_cpu->r10 = state->r10;
-    x86_cpu->r11 = state->r11;
-    x86_cpu->r12 = state->r12;
-    x86_cpu->r13 = state->r13;
-    x86_cpu->r14 = state->r14;
-    x86_cpu->r15 = state->r15;
-    x86_cpu->rip = ivee->entry_addr;
+    int res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
 
-    return ivee_kvm_load_vcpu_state(ivee->vm, x86_cpu);
+    res = load_executable(ivee, src, format);
+
+    ivee_leave_exclusive(ivee);
+    return res;
 }
 
-static int store_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
+int ivee_load_executable(struct ivee* ivee, const char* file, ivee_executable_format_t format)
 {
-    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
-    int res = ivee_kvm_store_vcpu_state(ivee->vm, x86_cpu);
-    if (res != 0) {
-        return res;
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
     }
 
-    state->rax = x86_cpu->rax;
-    state->rbx = x86_cpu->rbx;
-    state->rcx = x86_cpu->rcx;
-    state->rdx = x86_cpu->rdx;
-    state->rsi = x86_cpu->rsi;
-    state->rdi = x86_cpu->rdi;
-    state->r8 = x86_cpu->r8;
-    state->r9 = x86_cpu->r9;
-    state->r10 = x86_cpu->r10;
-    state->r11 = x86_cpu->r11;
-    state->r12 = x86_cpu->r12;
-    state->r13 = x86_cpu->r13;
-    state->r14 = x86_cpu->r14;
-    state->r15 = x86_cpu->r15;
+    if (!file) {
+        return -EINVAL;
+    }
 
-    return 0;
+    /* We must have read and execute access for the file */
+    if (0 != access(file, R_OK | X_OK)) {
+        return -EINVAL;
+    }
+
+    struct ivee_executable_source src = { .fd = open(file, O_RDONLY | O_CLOEXEC) };
+    if (src.fd < 0) {
+        return -errno;
+    }
+
+    res = load_executable_locked(ivee, &src, format);
+
+    close(src.fd);
+    return res;
 }
 
-static int handle_pio(struct ivee* ivee, struct ivee_pio_exit* pio)
+int ivee_load_executable_fd(struct ivee* ivee, int fd, ivee_executable_format_t format)
 {
-    switch (pio->port) {
-    case IVEE_PIO_EXIT_PORT:
-        /* Don't care about value */
-        ivee->should_terminate = true;
-        return 0;
-    default:
-        return -ENOTSUP;
+    if (!ivee || fd < 0) {
+        return -EINVAL;
     }
+
+    struct ivee_executable_source src = { .fd = fd };
+    return load_executable_locked(ivee, &src, format);
 }
 
-int ivee_call(struct ivee* ivee, struct ivee_arch_state* state)
+int ivee_load_executable_mem(struct ivee* ivee, const void* data, size_t size, ivee_executable_format_t format)
+{
+    if (!ivee || !data || !size) {
+        return -EINVAL;
+    }
+
+    struct ivee_executable_source src = { .fd = -1, .data = data, .size = size };
+    return load_executable_locked(ivee, &src, format);
+}
+
+static int clone_environment(const struct ivee* tmpl, struct ivee** out_ivee_ptr)
 {
     int res = 0;
 
-    if (!ivee || !state) {
+    /* Template should have an executable loaded */
+    if (!tmpl->gpt_mr) {
         return -EINVAL;
     }
 
-    res = load_vcpu_state(ivee, state);
+    struct ivee* ivee = NULL;
+    res = ivee_create_ex(&tmpl->options, &ivee);
     if (res != 0) {
         return res;
     }
 
-    ivee->should_terminate = false;
+    /* Guest page tables are cloned along with the rest of template memory */
+    struct ivee_guest_memory_region* src_mr;
+    IVEE_MEMORY_MAP_FOREACH(src_mr, &tmpl->memory_map) {
+        if (src_mr->is_shared) {
+            continue;
+        }
 
-    do {
-        struct ivee_exit exit;
-        res = ivee_kvm_run(ivee->vm, &exit);
+        struct ivee_guest_memory_region* mr = ivee_clone_host_memory(&ivee->memory_map, src_mr);
+        if (!mr) {
+            res = -ENOMEM;
+            goto error_out;
+        }
+
+        if (src_mr == tmpl->gpt_mr) {
+            ivee->gpt_mr = mr;
+        }
+    }
+
+    /* Cloned page tables may still map template's shared regions */
+    IVEE_MEMORY_MAP_FOREACH(src_mr, &tmpl->memory_map) {
+        if (src_mr->is_shared) {
+            unmap_guest_pages(ivee, src_mr);
+        }
+    }
+
+    res = ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    res = lock_memory_map(ivee);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    pre_fault_memory_map(ivee);
+
+    ivee->entry_addr = tmpl->entry_addr;
+    memcpy(ivee->hypercalls, tmpl->hypercalls, sizeof(ivee->hypercalls));
+    ivee->log_handler = tmpl->log_handler;
+    ivee->log_ctx = tmpl->log_ctx;
+
+    if (tmpl->image) {
+        ivee_ref_image(tmpl->image);
+        ivee->image = tmpl->image;
+    }
+
+    /* New vcpu has not seen any of the template state yet */
+    ivee->x86_cpu = tmpl->x86_cpu;
+    ivee->x86_cpu.sregs_dirty = true;
+
+    *out_ivee_ptr = ivee;
+    return 0;
+
+error_out:
+    ivee_destroy(ivee);
+    return res;
+}
+
+int ivee_clone(const struct ivee* tmpl, struct ivee** out_ivee_ptr)
+{
+    int res = 0;
+
+    if (!tmpl || !out_ivee_ptr) {
+        return -EINVAL;
+    }
+
+    /* Template is only read, usage guard is the one thing we modify */
+    struct ivee* guarded_tmpl = (struct ivee*)tmpl;
+
+    res = enter_shared(guarded_tmpl);
+    if (res != 0) {
+        return res;
+    }
+
+    res = clone_environment(tmpl, out_ivee_ptr);
+
+    leave_shared(guarded_tmpl);
+    return res;
+}
+
+/*
+ * Regions we snapshot and restore: sealed memory the guest can write to.
+ * Everything else either can't change or is shared with host on purpose.
+ */
+static bool is_snapshot_region(const struct ivee_guest_memory_region* mr)
+{
+    return mr->is_private && (mr->prot & IVEE_WRITE);
+}
+
+/*
+ * Fetch dirty page logs of snapshot regions and optionally restore dirty pages to snapshot contents.
+ * Fetching dirty log also clears it.
+ */
+static int sync_dirty_pages(struct ivee* ivee, bool restore)
+{
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        if (!is_snapshot_region(mr)) {
+            continue;
+        }
+
+        size_t npages = mr->last_gfn - mr->first_gfn + 1;
+        size_t nwords = (npages + 63) / 64;
+        if (nwords > ivee->dirty_bitmap_words) {
+            uint64_t* bitmap = ivee_alloc(nwords * sizeof(*bitmap));
+            if (!bitmap) {
+                return -ENOMEM;
+            }
+
+            ivee_free(ivee->dirty_bitmap);
+            ivee->dirty_bitmap = bitmap;
+            ivee->dirty_bitmap_words = nwords;
+        }
+
+        int res = ivee_kvm_get_dirty_log(ivee->vm, mr->first_gfn << X86_PAGE_SHIFT, npages, ivee->dirty_bitmap);
         if (res != 0) {
             return res;
         }
 
-        switch (exit.exit_reason) {
-        case IVEE_EXIT_IO:
-            res = handle_pio(ivee, &exit.io);
-            break;
-        default:
-            res = -ENOTSUP;
-            break;
+        if (!restore) {
+            continue;
+        }
+
+        for (size_t i = 0; i < nwords; ++i) {
+            for (uint64_t bits = ivee->dirty_bitmap[i]; bits != 0; bits &= bits - 1) {
+                size_t page = i * 64 + __builtin_ctzll(bits);
+                ivee_restore_host_memory(mr, page << X86_PAGE_SHIFT, X86_PAGE_SIZE);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int take_snapshot(struct ivee* ivee)
+{
+    int res = 0;
+
+    if (!ivee->gpt_mr) {
+        return -EINVAL;
+    }
+
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        if (!is_snapshot_region(mr)) {
+            continue;
         }
 
+        res = ivee_snapshot_host_memory(mr, ivee->memory_diverged);
         if (res != 0) {
             return res;
         }
-    } while (!ivee->should_terminate);
+    }
+
+    res = ivee_kvm_enable_dirty_log(ivee->vm);
+    if (res != 0) {
+        return res;
+    }
+
+    /* Anything logged so far is part of the snapshot */
+    res = sync_dirty_pages(ivee, false);
+    if (res != 0) {
+        return res;
+    }
+
+    /* Rebased regions and pristine views are new mappings */
+    res = lock_memory_map(ivee);
+    if (res != 0) {
+        return res;
+    }
 
-    return store_vcpu_state(ivee, state);
+    pre_fault_memory_map(ivee);
+
+    ivee->snapshot_x86_cpu = ivee->x86_cpu;
+    ivee->has_snapshot = true;
+    ivee->memory_diverged = false;
+    ivee->memory_map_changed = false;
+
+    return 0;
+}
+
+static int reset_to_snapshot(struct ivee* ivee)
+{
+    int res = 0;
+
+    if (!ivee->has_snapshot) {
+        return -EINVAL;
+    }
+
+    res = sync_dirty_pages(ivee, true);
+    if (res != 0) {
+        return res;
+    }
+
+    /*
+     * Restored page tables are from before memory map changed.
+     * Guest sets accessed bits on every run, so they are restored on every reset until next snapshot.
+     */
+    if (ivee->memory_map_changed) {
+        res = map_all_guest_pages(ivee);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    /* Guest might have changed segments or control registers, push snapshot ones again */
+    ivee->x86_cpu = ivee->snapshot_x86_cpu;
+    ivee->x86_cpu.sregs_dirty = true;
+    ivee->memory_diverged = false;
+    ivee->is_yielded = false;
+
+    return 0;
+}
+
+int ivee_snapshot(struct ivee* ivee)
+{
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    res = take_snapshot(ivee);
+
+    ivee_leave_exclusive(ivee);
+    return res;
+}
+
+int ivee_reset(struct ivee* ivee)
+{
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    res = reset_to_snapshot(ivee);
+
+    ivee_leave_exclusive(ivee);
+    return res;
+}
+
+/*
+ * Find a free GPA range for a new region below guest page tables.
+ * Regions of at least 2MiB are aligned to 2MiB, so that guest can map them with large pages.
+ */
+static int find_free_gpa(struct ivee* ivee, size_t length, gpa_t* out_gpa)
+{
+    gpa_t npages = (length + X86_PAGE_SIZE - 1) >> X86_PAGE_SHIFT;
+    gpa_t align = (npages >= X86_PAGES_PER_LARGE ? X86_PAGES_PER_LARGE : 1);
+    gpa_t end_gfn = IVEE_PML4_BASE_GPA >> X86_PAGE_SHIFT;
+
+    /* Never hand out GFN 0 to catch guest null pointers */
+    while (end_gfn > npages) {
+        gpa_t first_gfn = (end_gfn - npages) & ~(align - 1);
+        if (first_gfn == 0) {
+            break;
+        }
+
+        gpa_t last_gfn = first_gfn + npages - 1;
+        struct ivee_guest_memory_region* mr = ivee_find_memory_region(&ivee->memory_map, first_gfn, last_gfn);
+        if (!mr) {
+            *out_gpa = first_gfn << X86_PAGE_SHIFT;
+            return 0;
+        }
+
+        end_gfn = mr->first_gfn;
+    }
+
+    return -ENOSPC;
+}
+
+/* Push memory map changes to KVM */
+static int update_memory_map(struct ivee* ivee)
+{
+    /* Lock before KVM sees new regions, so that failure leaves KVM memory map as it was */
+    int res = lock_memory_map(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    res = ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+    if (res != 0) {
+        return res;
+    }
+
+    pre_fault_memory_map(ivee);
+
+    /* Guest page tables are patched for the new map */
+    if (ivee->has_snapshot) {
+        ivee->memory_map_changed = true;
+    }
+
+    return 0;
+}
+
+/* Make a newly mapped shared region visible to guest, region is dropped on failure */
+static int attach_shared_region(struct ivee* ivee, struct ivee_guest_memory_region* mr)
+{
+    int res = map_guest_pages(ivee, mr);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    res = update_memory_map(ivee);
+    if (res != 0) {
+        unmap_guest_pages(ivee, mr);
+        goto error_out;
+    }
+
+    return 0;
+
+error_out:
+    ivee_unmap_host_memory(&ivee->memory_map, mr);
+    return res;
+}
+
+int ivee_map_shared_memory(struct ivee* ivee,
+                           size_t length,
+                           enum ivee_memory_prot prot,
+                           struct ivee_guest_memory_region** out_mr)
+{
+    int res = 0;
+
+    if (!ivee || !length || !out_mr || !ivee->gpt_mr) {
+        return -EINVAL;
+    }
+
+    gpa_t gpa;
+    res = find_free_gpa(ivee, length, &gpa);
+    if (res != 0) {
+        return res;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_map_host_memory(&ivee->memory_map, gpa, length, -1, false, prot);
+    if (!mr) {
+        return -ENOMEM;
+    }
+
+    mr->is_shared = true;
+
+    res = attach_shared_region(ivee, mr);
+    if (res != 0) {
+        return res;
+    }
+
+    *out_mr = mr;
+    return 0;
+}
+
+int ivee_unmap_shared_memory(struct ivee* ivee, struct ivee_guest_memory_region* mr)
+{
+    if (!ivee || !mr || !mr->is_shared) {
+        return -EINVAL;
+    }
+
+    unmap_guest_pages(ivee, mr);
+    ivee_unmap_host_memory(&ivee->memory_map, mr);
+    return update_memory_map(ivee);
+}
+
+static int map_buffer(struct ivee* ivee, void* buf, size_t length, ivee_buffer_access_t access, uint64_t* out_gva)
+{
+    int res = 0;
+
+    if (!ivee->gpt_mr) {
+        return -EINVAL;
+    }
+
+    gpa_t gpa;
+    res = find_free_gpa(ivee, length, &gpa);
+    if (res != 0) {
+        return res;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_map_user_memory(&ivee->memory_map,
+                                                               gpa,
+                                                               buf,
+                                                               length,
+                                                               (access & IVEE_BUFFER_READ ? IVEE_READ : 0) |
+                                                               (access & IVEE_BUFFER_WRITE ? IVEE_WRITE : 0));
+    if (!mr) {
+        return -ENOMEM;
+    }
+
+    res = attach_shared_region(ivee, mr);
+    if (res != 0) {
+        return res;
+    }
+
+    /* Guest memory is identity-mapped */
+    *out_gva = gpa;
+    return 0;
+}
+
+int ivee_map_buffer(struct ivee* ivee, void* buf, size_t length, ivee_buffer_access_t access, uint64_t* out_gva)
+{
+    int res = 0;
+
+    if (!ivee || !buf || !length || !out_gva) {
+        return -EINVAL;
+    }
+
+    if (((uintptr_t)buf | length) & (X86_PAGE_SIZE - 1)) {
+        return -EINVAL;
+    }
+
+    /* Mapped pages are always readable, there is no way to express write-only or no access */
+    if (!(access & IVEE_BUFFER_READ) || (access & ~(IVEE_BUFFER_READ | IVEE_BUFFER_WRITE))) {
+        return -EINVAL;
+    }
+
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    res = map_buffer(ivee, buf, length, access, out_gva);
+
+    ivee_leave_exclusive(ivee);
+    return res;
+}
+
+int ivee_unmap_buffer(struct ivee* ivee, uint64_t gva)
+{
+    int res = 0;
+
+    if (!ivee || (gva & (X86_PAGE_SIZE - 1))) {
+        return -EINVAL;
+    }
+
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    gpa_t gfn = gva >> X86_PAGE_SHIFT;
+    struct ivee_guest_memory_region* mr = ivee_find_memory_region(&ivee->memory_map, gfn, gfn);
+    if (!mr || !mr->is_user_memory || mr->first_gfn != gfn) {
+        res = -ENOENT;
+    } else {
+        res = ivee_unmap_shared_memory(ivee, mr);
+    }
+
+    ivee_leave_exclusive(ivee);
+    return res;
+}
+
+/* Drop all buffers mapped with ivee_map_buffer, host memory behind them may go away with their user */
+static int unmap_all_buffers(struct ivee* ivee)
+{
+    bool unmapped = false;
+
+    struct ivee_guest_memory_region* mr = ivee_first_memory_region(&ivee->memory_map);
+    while (mr) {
+        struct ivee_guest_memory_region* next = ivee_next_memory_region(mr);
+        if (mr->is_user_memory) {
+            unmap_guest_pages(ivee, mr);
+            ivee_unmap_host_memory(&ivee->memory_map, mr);
+            unmapped = true;
+        }
+
+        mr = next;
+    }
+
+    return (unmapped ? update_memory_map(ivee) : 0);
+}
+
+int ivee_recycle(struct ivee* ivee)
+{
+    int res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    res = unmap_all_buffers(ivee);
+    if (res != 0) {
+        goto out;
+    }
+
+    memset(ivee->hypercalls, 0, sizeof(ivee->hypercalls));
+    ivee->log_handler = NULL;
+    ivee->log_ctx = NULL;
+
+    /* Guest page tables are restored after buffers are gone */
+    res = reset_to_snapshot(ivee);
+
+out:
+    ivee_leave_exclusive(ivee);
+    return res;
+}
+
+static void load_arch_state(struct x86_cpu_state* x86_cpu, const struct ivee_arch_state* state)
+{
+    x86_cpu->rax = state->rax;
+    x86_cpu->rbx = state->rbx;
+    x86_cpu->rcx = state->rcx;
+    x86_cpu->rdx = state->rdx;
+    x86_cpu->rsi = state->rsi;
+    x86_cpu->rdi = state->rdi;
+    x86_cpu->rbp = state->rbp;
+    x86_cpu->r8 = state->r8;
+    x86_cpu->r9 = state->r9;
+    x86_cpu->r10 = state->r10;
+    x86_cpu->r11 = state->r11;
+    x86_cpu->r12 = state->r12;
+    x86_cpu->r13 = state->r13;
+    x86_cpu->r14 = state->r14;
+    x86_cpu->r15 = state->r15;
+}
+
+static void store_arch_state(const struct x86_cpu_state* x86_cpu, struct ivee_arch_state* state)
+{
+    state->rax = x86_cpu->rax;
+    state->rbx = x86_cpu->rbx;
+    state->rcx = x86_cpu->rcx;
+    state->rdx = x86_cpu->rdx;
+    state->rsi = x86_cpu->rsi;
+    state->rdi = x86_cpu->rdi;
+    state->rbp = x86_cpu->rbp;
+    state->r8 = x86_cpu->r8;
+    state->r9 = x86_cpu->r9;
+    state->r10 = x86_cpu->r10;
+    state->r11 = x86_cpu->r11;
+    state->r12 = x86_cpu->r12;
+    state->r13 = x86_cpu->r13;
+    state->r14 = x86_cpu->r14;
+    state->r15 = x86_cpu->r15;
+}
+
+static int load_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state, bool resume)
+{
+    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
+    load_arch_state(x86_cpu, state);
+
+    /* Resumed guest stays at the yield OUT instruction, KVM completes it on next run */
+    if (!resume) {
+        x86_cpu->rip = ivee->entry_addr;
+    }
+
+    return ivee_kvm_load_vcpu_state(ivee->vm, x86_cpu);
+}
+
+static int store_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
+{
+    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
+    int res = ivee_kvm_store_vcpu_state(ivee->vm, x86_cpu);
+    if (res != 0) {
+        return res;
+    }
+
+    store_arch_state(x86_cpu, state);
+    return 0;
+}
+
+static void flush_log(struct ivee* ivee)
+{
+    if (ivee->log_length != 0) {
+        ivee->log_handler(ivee->log_ctx, ivee->log_buffer, ivee->log_length);
+        ivee->log_length = 0;
+    }
+}
+
+static void append_log(void* ctx, const void* data, size_t size)
+{
+    struct ivee* ivee = ctx;
+    if (!ivee->log_handler) {
+        return;
+    }
+
+    if (size > sizeof(ivee->log_buffer) - ivee->log_length) {
+        flush_log(ivee);
+    }
+
+    memcpy(ivee->log_buffer + ivee->log_length, data, size);
+    ivee->log_length += size;
+}
+
+/* Deliver all log output guest wrote so far */
+static void drain_log(struct ivee* ivee)
+{
+    ivee_kvm_drain_coalesced_log(ivee->vm, append_log, ivee);
+    if (ivee->log_handler) {
+        flush_log(ivee);
+    }
+}
+
+/*
+ * Dispatch a hypercall and resume guest with registers handler left.
+ * Guest instruction pointer is kept, KVM completes the OUT instruction on next run.
+ */
+static int handle_hypercall(struct ivee* ivee)
+{
+    int res = 0;
+    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
+
+    res = ivee_kvm_store_vcpu_state(ivee->vm, x86_cpu);
+    if (res != 0) {
+        return res;
+    }
+
+    uint64_t nr = x86_cpu->rax;
+    const struct ivee_hypercall* hc = (nr < IVEE_MAX_HYPERCALLS ? &ivee->hypercalls[nr] : NULL);
+
+    if (hc && hc->fn) {
+        /* Handler should see guest logs from before the hypercall */
+        drain_log(ivee);
+
+        struct ivee_arch_state regs;
+        store_arch_state(x86_cpu, &regs);
+
+        res = hc->fn(hc->ctx, &regs);
+        if (res < 0) {
+            return res;
+        }
+
+        load_arch_state(x86_cpu, &regs);
+    } else {
+        x86_cpu->rax = (uint64_t)-ENOSYS;
+    }
+
+    return ivee_kvm_load_vcpu_state(ivee->vm, x86_cpu);
+}
+
+static int handle_pio(struct ivee* ivee, struct ivee_pio_exit* pio)
+{
+    switch (pio->port) {
+    case IVEE_PIO_EXIT_PORT:
+        /* Don't care about value */
+        ivee->should_terminate = true;
+        return 0;
+    case IVEE_YIELD_PORT:
+        ivee->is_yielded = true;
+        ivee->should_terminate = true;
+        return 0;
+    case IVEE_HYPERCALL_PORT:
+        /* Only OUT, there is no input data to complete IN with */
+        return (pio->op == 1 ? handle_hypercall(ivee) : -ENOTSUP);
+    case IVEE_LOG_PORT:
+        if (pio->op != 1) {
+            return -ENOTSUP;
+        }
+
+        /* Coalesced ring is full or not supported, what is in it was written before this */
+        ivee_kvm_drain_coalesced_log(ivee->vm, append_log, ivee);
+        append_log(ivee, &pio->data, pio->size);
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+/* Arm deadline timer to kick calling thread out of the guest at deadline */
+static int arm_deadline_timer(struct ivee* ivee, uint64_t deadline_ns)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    if (ivee->has_deadline_timer && ivee->deadline_timer_tid != tid) {
+        timer_delete(ivee->deadline_timer);
+        ivee->has_deadline_timer = false;
+    }
+
+    if (!ivee->has_deadline_timer) {
+        struct sigevent sev;
+        ivee_kvm_init_kick_event(&sev, tid);
+
+        if (timer_create(CLOCK_MONOTONIC, &sev, &ivee->deadline_timer) != 0) {
+            return -errno;
+        }
+
+        ivee->has_deadline_timer = true;
+        ivee->deadline_timer_tid = tid;
+    }
+
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = deadline_ns / 1000000000ull,
+            .tv_nsec = deadline_ns % 1000000000ull,
+        },
+    };
+
+    if (timer_settime(ivee->deadline_timer, TIMER_ABSTIME, &its, NULL) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void disarm_deadline_timer(struct ivee* ivee)
+{
+    struct itimerspec its = { 0 };
+    timer_settime(ivee->deadline_timer, 0, &its, NULL);
+}
+
+/* Publish calling thread as the one running a call on this environment */
+static int begin_call(struct ivee* ivee, uint64_t deadline_ns)
+{
+    if (ivee->has_cpus) {
+        int res = ivee_pin_thread(&ivee->cpus);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    pthread_mutex_lock(&ivee->run_lock);
+
+    ivee->is_running = true;
+    ivee->run_thread = pthread_self();
+    atomic_store(&ivee->cancel_requested, false);
+    ivee_kvm_set_immediate_exit(ivee->vm, false);
+    ivee_kvm_begin_call(ivee->vm);
+
+    pthread_mutex_unlock(&ivee->run_lock);
+
+    return (deadline_ns ? arm_deadline_timer(ivee, deadline_ns) : 0);
+}
+
+static void end_call(struct ivee* ivee, uint64_t deadline_ns)
+{
+    if (deadline_ns && ivee->has_deadline_timer) {
+        disarm_deadline_timer(ivee);
+    }
+
+    pthread_mutex_lock(&ivee->run_lock);
+    ivee->is_running = false;
+    ivee_kvm_end_call();
+    pthread_mutex_unlock(&ivee->run_lock);
+}
+
+/* Interrupted runs in a row that were neither cancellation nor deadline, call gives up after that many */
+#define IVEE_MAX_STRAY_KICKS 64
+
+static int run_call(struct ivee* ivee,
+                    struct ivee_arch_state* state,
+                    ivee_vector_state_t* vector_state,
+                    uint64_t deadline_ns,
+                    bool resume)
+{
+    int res = 0;
+    struct ivee_stats_block* stats = ivee->stats;
+
+    uint64_t start = ivee_monotonic_ns();
+
+    /* Whatever happens next, guest context of the previous yield is gone */
+    ivee->is_yielded = false;
+
+    res = load_vcpu_state(ivee, state, resume);
+    if (res != 0) {
+        return res;
+    }
+
+    if (vector_state) {
+        res = ivee_kvm_load_vector_state(ivee->vm, vector_state);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    ivee->should_terminate = false;
+    ivee->memory_diverged = true;
+
+    uint64_t now = ivee_monotonic_ns();
+    ivee_histogram_record_single(&stats->load, now - start);
+
+    unsigned stray_kicks = 0;
+
+    do {
+        /* Checked before every entry into guest, later kicks set immediate_exit and make KVM_RUN return -EINTR */
+        if (atomic_load(&ivee->cancel_requested)) {
+            return -ECANCELED;
+        }
+
+        if (deadline_ns && now >= deadline_ns) {
+            return -ETIMEDOUT;
+        }
+
+        uint64_t run_start = now;
+
+        struct ivee_exit exit;
+        res = ivee_kvm_run(ivee->vm, &exit);
+        ivee_stats_add(&stats->runs, 1);
+        if (res == -EINTR) {
+            /*
+             * Kicked, checks above tell cancellation and deadline from stray signals.
+             * Kicks late for previous calls stay pending on threads that block them, drop those.
+             */
+            ivee_kvm_set_immediate_exit(ivee->vm, false);
+            ivee_kvm_consume_kick();
+            now = ivee_monotonic_ns();
+
+            if (++stray_kicks > IVEE_MAX_STRAY_KICKS) {
+                ivee_stats_add(&stats->run_errors, 1);
+                return -EINTR;
+            }
+
+            continue;
+        } else if (res != 0) {
+            ivee_stats_add(&stats->run_errors, 1);
+            return res;
+        }
+
+        stray_kicks = 0;
+        now = ivee_monotonic_ns();
+        ivee_histogram_record_single(&stats->guest, now - run_start);
+        ivee_stats_record_exit(stats, exit.kvm_exit_reason);
+
+        switch (exit.exit_reason) {
+        case IVEE_EXIT_IO:
+            ivee_stats_record_pio(stats, exit.io.port);
+            res = handle_pio(ivee, &exit.io);
+            break;
+        default:
+            res = -ENOTSUP;
+            break;
+        }
+
+        if (res != 0) {
+            return res;
+        }
+
+        uint64_t exit_start = now;
+        now = ivee_monotonic_ns();
+        ivee_histogram_record_single(&stats->exit, now - exit_start);
+    } while (!ivee->should_terminate);
+
+    res = store_vcpu_state(ivee, state);
+    if (res != 0) {
+        return res;
+    }
+
+    if (vector_state) {
+        res = ivee_kvm_store_vector_state(ivee->vm, vector_state);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    uint64_t end = ivee_monotonic_ns();
+    ivee_histogram_record_single(&stats->store, end - now);
+    ivee_histogram_record_single(&stats->call, end - start);
+
+    return (ivee->is_yielded ? IVEE_CALL_YIELDED : 0);
+}
+
+int ivee_run_call(struct ivee* ivee,
+                  struct ivee_arch_state* state,
+                  ivee_vector_state_t* vector_state,
+                  uint64_t deadline_ns,
+                  bool resume)
+{
+    if (resume && !ivee->is_yielded) {
+        return -ESRCH;
+    }
+
+    int res = begin_call(ivee, deadline_ns);
+    if (res == 0) {
+        res = run_call(ivee, state, vector_state, deadline_ns, resume);
+    }
+
+    drain_log(ivee);
+    end_call(ivee, deadline_ns);
+
+    ivee_stats_add(&ivee->stats->calls, 1);
+    if (res < 0) {
+        ivee_stats_add(&ivee->stats->failed_calls, 1);
+    }
+
+    return res;
+}
+
+static int call_locked(struct ivee* ivee,
+                       struct ivee_arch_state* state,
+                       ivee_vector_state_t* vector_state,
+                       uint64_t deadline_ns,
+                       bool resume)
+{
+    int res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    res = ivee_run_call(ivee, state, vector_state, deadline_ns, resume);
+
+    ivee_leave_exclusive(ivee);
+    return res;
+}
+
+int ivee_call(struct ivee* ivee, struct ivee_arch_state* state)
+{
+    if (!ivee || !state) {
+        return -EINVAL;
+    }
+
+    return call_locked(ivee, state, NULL, 0, false);
+}
+
+int ivee_call_timeout(struct ivee* ivee, struct ivee_arch_state* state, uint64_t deadline_ns)
+{
+    if (!ivee || !state) {
+        return -EINVAL;
+    }
+
+    return call_locked(ivee, state, NULL, deadline_ns, false);
+}
+
+int ivee_call_vector(struct ivee* ivee, struct ivee_arch_state* state, ivee_vector_state_t* vector_state)
+{
+    if (!ivee || !state || !vector_state) {
+        return -EINVAL;
+    }
+
+    return call_locked(ivee, state, vector_state, 0, false);
+}
+
+int ivee_resume(struct ivee* ivee, struct ivee_arch_state* state)
+{
+    if (!ivee || !state) {
+        return -EINVAL;
+    }
+
+    return call_locked(ivee, state, NULL, 0, true);
+}
+
+int ivee_register_hypercall(struct ivee* ivee, uint32_t nr, ivee_hypercall_t fn, void* ctx)
+{
+    int res = 0;
+
+    if (!ivee || nr >= IVEE_MAX_HYPERCALLS) {
+        return -EINVAL;
+    }
+
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    ivee->hypercalls[nr].fn = fn;
+    ivee->hypercalls[nr].ctx = (fn ? ctx : NULL);
+
+    ivee_leave_exclusive(ivee);
+    return 0;
+}
+
+int ivee_set_log_handler(struct ivee* ivee, ivee_log_handler_t fn, void* ctx)
+{
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    ivee->log_handler = fn;
+    ivee->log_ctx = (fn ? ctx : NULL);
+
+    ivee_leave_exclusive(ivee);
+    return 0;
+}
+
+int ivee_cancel(struct ivee* ivee)
+{
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ivee->run_lock);
+
+    if (ivee->is_running) {
+        /* Flag first: running thread clears immediate_exit after a kick and rechecks the flag */
+        atomic_store(&ivee->cancel_requested, true);
+        ivee_kvm_set_immediate_exit(ivee->vm, true);
+        res = ivee_kvm_kick_thread(ivee->run_thread);
+    } else {
+        res = -ESRCH;
+    }
+
+    pthread_mutex_unlock(&ivee->run_lock);
+    return res;
+}
+
+int ivee_call_async(struct ivee* ivee, struct ivee_arch_state* state, void* cookie)
+{
+    if (!ivee || !state) {
+        return -EINVAL;
+    }
+
+    struct ivee_async_worker* async = __atomic_load_n(&ivee->async, __ATOMIC_ACQUIRE);
+    if (!async) {
+        /* Don't hold on to exclusive use past creation, worker takes it for the call */
+        int res = ivee_enter_exclusive(ivee);
+        if (res != 0) {
+            return res;
+        }
+
+        async = ivee->async;
+        if (!async) {
+            async = ivee_create_async_worker(ivee);
+            __atomic_store_n(&ivee->async, async, __ATOMIC_RELEASE);
+        }
+
+        ivee_leave_exclusive(ivee);
+
+        if (!async) {
+            return -ENOMEM;
+        }
+    }
+
+    return ivee_async_submit(async, state, cookie);
+}
+
+int ivee_get_stats(struct ivee* ivee, ivee_stats_t* stats)
+{
+    if (!ivee || !stats) {
+        return -EINVAL;
+    }
+
+    ivee_stats_get(ivee->stats, stats);
+    return 0;
+}
+
+int ivee_symbolize(struct ivee* ivee, uint64_t gva, ivee_symbol_t* symbol)
+{
+    int res = 0;
+
+    if (!ivee || !symbol) {
+        return -EINVAL;
+    }
+
+    res = enter_shared(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    const struct ivee_image_symbol* sym = NULL;
+    if (ivee->image) {
+        sym = ivee_find_image_symbol(ivee->image, gva);
+    }
+
+    if (sym) {
+        symbol->name = sym->name;
+        symbol->addr = sym->addr;
+        symbol->size = sym->size;
+    } else {
+        res = -ENOENT;
+    }
+
+    leave_shared(ivee);
+    return res;
+}
+
+int ivee_write_perf_map(struct ivee* ivee, const char* path)
+{
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    char default_path[64];
+    if (!path) {
+        snprintf(default_path, sizeof(default_path), "/tmp/perf-%d.map", getpid());
+        path = default_path;
+    }
+
+    res = enter_shared(ivee);
+    if (res != 0) {
+        return res;
+    }
+
+    const struct ivee_image* image = ivee->image;
+    if (!image || image->nr_symbols == 0) {
+        goto out;
+    }
+
+    /* Several environments may share one map file, append rather than replace */
+    FILE* file = fopen(path, "ae");
+    if (!file) {
+        res = -errno;
+        goto out;
+    }
+
+    for (size_t i = 0; i < image->nr_symbols; ++i) {
+        const struct ivee_image_symbol* sym = image->symbols + i;
+        fprintf(file, "%" PRIx64 " %" PRIx64 " %s\n", sym->addr, sym->size, sym->name);
+    }
+
+    if (ferror(file)) {
+        res = -EIO;
+    }
+
+    if (fclose(file) != 0 && res == 0) {
+        res = -errno;
+    }
+
+out:
+    leave_shared(ivee);
+    return res;
 }
@@ -1,13 +1,296 @@
 #include <stdlib.h>
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/memfd.h>
 
 #include "platform.h"
 #include "memory.h"
+#include "placement.h"
 #include "kvm.h"
 #include "x86.h"
 
+static struct ivee_guest_memory_region* get_region(const struct ivee_avl_node* node)
+{
+    return (node ? IVEE_AVL_ENTRY(node, struct ivee_guest_memory_region, node) : NULL);
+}
+
+struct ivee_guest_memory_region* ivee_first_memory_region(const struct ivee_memory_map* map)
+{
+    return get_region(ivee_avl_first(&map->regions));
+}
+
+struct ivee_guest_memory_region* ivee_next_memory_region(const struct ivee_guest_memory_region* mr)
+{
+    return get_region(ivee_avl_next(&mr->node));
+}
+
+struct ivee_guest_memory_region* ivee_find_memory_region(const struct ivee_memory_map* map,
+                                                         gpa_t first_gfn,
+                                                         gpa_t last_gfn)
+{
+    /*
+     * Regions don't overlap, so the one starting closest below the end of the range
+     * is the only one that can overlap with it.
+     */
+    struct ivee_guest_memory_region* candidate = NULL;
+    struct ivee_avl_node* node = map->regions.root;
+    while (node) {
+        struct ivee_guest_memory_region* mr = get_region(node);
+        if (mr->first_gfn <= last_gfn) {
+            candidate = mr;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    if (candidate && candidate->last_gfn >= first_gfn) {
+        return candidate;
+    }
+
+    return NULL;
+}
+
+/* Link new region into memory map, region should not overlap with existing ones */
+static void insert_region(struct ivee_memory_map* map, struct ivee_guest_memory_region* mr)
+{
+    struct ivee_avl_node* parent = NULL;
+    struct ivee_avl_node** link = &map->regions.root;
+    while (*link) {
+        parent = *link;
+        link = (mr->first_gfn < get_region(parent)->first_gfn ? &parent->left : &parent->right);
+    }
+
+    ivee_avl_insert(&map->regions, &mr->node, parent, link);
+}
+
+/* Host page size for memory backing */
+static size_t get_backing_page_size(ivee_memory_backing_t backing)
+{
+    switch (backing) {
+    case IVEE_MEMORY_HUGETLB_1G:
+        return 1ul << 30;
+    case IVEE_MEMORY_HUGETLB_2M:
+    case IVEE_MEMORY_THP:
+        return X86_LARGE_PAGE_SIZE;
+    default:
+        return X86_PAGE_SIZE;
+    }
+}
+
+/* Create a memfd to back anonymous guest memory */
+static int alloc_memory_object(size_t length, ivee_memory_backing_t backing)
+{
+    unsigned int flags = MFD_CLOEXEC;
+    if (backing == IVEE_MEMORY_HUGETLB_2M) {
+        flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+    } else if (backing == IVEE_MEMORY_HUGETLB_1G) {
+        flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+    }
+
+    int fd = memfd_create("ivee-guest-memory", flags);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (ftruncate(fd, length) != 0) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+
+    return fd;
+}
+
+/* Map memory object at a new address aligned to page size of its backing */
+static void* map_aligned(size_t length, int prot, int flags, int fd, off_t offset, size_t align)
+{
+    if (align == X86_PAGE_SIZE) {
+        return mmap(NULL, length, prot, flags, fd, offset);
+    }
+
+    /* Reserve enough address space to find an aligned range in it, then trim the rest */
+    uint8_t* reserved = mmap(NULL, length + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)reserved + align - 1) & ~(align - 1));
+    void* ptr = mmap(aligned, length, prot, flags | MAP_FIXED, fd, offset);
+    if (ptr == MAP_FAILED) {
+        int err = errno;
+        munmap(reserved, length + align);
+        errno = err;
+        return MAP_FAILED;
+    }
+
+    if (aligned != reserved) {
+        munmap(reserved, aligned - reserved);
+    }
+
+    munmap(aligned + length, reserved + align - aligned);
+    return ptr;
+}
+
+/*
+ * Map memory object at an address aligned to backing page size, or replace mapping at a fixed address if one is given.
+ * Transparent huge pages are requested for the new mapping if that is our backing, and its pages
+ * are bound to NUMA node if one is given.
+ *
+ * Replacement mapping is set up elsewhere and moved over the old one once it is complete,
+ * so that the old mapping stays in place if anything fails.
+ * Sets errno on failure, like mmap.
+ */
+static void* map_memory_object(void* addr,
+                               size_t length,
+                               int prot,
+                               int flags,
+                               int fd,
+                               off_t offset,
+                               ivee_memory_backing_t backing,
+                               int numa_node)
+{
+    int err = 0;
+
+    void* ptr = map_aligned(length, prot, flags, fd, offset, get_backing_page_size(backing));
+    if (ptr == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    /*
+     * Transparent huge pages could be disabled, in which case we don't pretend to have them.
+     * Mapping we replace got its backing through that check already, there it is only a hint.
+     */
+    if (backing == IVEE_MEMORY_THP && madvise(ptr, length, MADV_HUGEPAGE) != 0 && !addr) {
+        err = errno;
+        goto error_out;
+    }
+
+    int res = ivee_bind_memory(ptr, length, numa_node);
+    if (res != 0) {
+        err = -res;
+        goto error_out;
+    }
+
+    if (addr && mremap(ptr, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, addr) == MAP_FAILED) {
+        err = errno;
+        goto error_out;
+    }
+
+    return (addr ? addr : ptr);
+
+error_out:
+    munmap(ptr, length);
+    errno = err;
+    return MAP_FAILED;
+}
+
+/* Check if transparent huge pages mode selected in sysfs file is one of the modes that disable them */
+static bool is_thp_mode_disabled(const char* path, const char* const* disabled_modes)
+{
+    char buf[128];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return true;
+    }
+
+    ssize_t nbytes = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nbytes <= 0) {
+        return true;
+    }
+
+    buf[nbytes] = '\0';
+    for (; *disabled_modes; ++disabled_modes) {
+        if (strstr(buf, *disabled_modes)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Guest writes land in private anonymous pages and the rest is shmem,
+ * THP are only useful if both kinds can get them.
+ */
+static bool is_thp_available(void)
+{
+    static const char* const anon_disabled[] = { "[never]", NULL };
+    static const char* const shmem_disabled[] = { "[never]", "[deny]", NULL };
+
+    return !is_thp_mode_disabled("/sys/kernel/mm/transparent_hugepage/enabled", anon_disabled) &&
+           !is_thp_mode_disabled("/sys/kernel/mm/transparent_hugepage/shmem_enabled", shmem_disabled);
+}
+
+/* Weaker backing to try when requested one is not available */
+static ivee_memory_backing_t get_fallback_backing(ivee_memory_backing_t backing)
+{
+    switch (backing) {
+    case IVEE_MEMORY_HUGETLB_1G:
+        return IVEE_MEMORY_HUGETLB_2M;
+    case IVEE_MEMORY_HUGETLB_2M:
+        return IVEE_MEMORY_THP;
+    default:
+        return IVEE_MEMORY_NORMAL;
+    }
+}
+
+/*
+ * Allocate and map memory object for an anonymous region, trying backings from preferred one down to normal pages.
+ * Fills region host mapping fields on success.
+ */
+static int map_anonymous_memory(struct ivee_guest_memory_region* mr,
+                                gpa_t gpa,
+                                ivee_memory_backing_t backing,
+                                int numa_node)
+{
+    for (;;) {
+        size_t page_size = get_backing_page_size(backing);
+        if ((backing != IVEE_MEMORY_NORMAL && mr->length < page_size) ||
+            (backing == IVEE_MEMORY_THP && !is_thp_available())) {
+            backing = get_fallback_backing(backing);
+            continue;
+        }
+
+        gpa_t map_first_gpa = gpa & ~(page_size - 1);
+        gpa_t map_end_gpa = (gpa + mr->length + page_size - 1) & ~(page_size - 1);
+        size_t map_length = map_end_gpa - map_first_gpa;
+
+        int fd = alloc_memory_object(map_length, backing);
+        if (fd >= 0) {
+            void* ptr = map_memory_object(NULL, map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0, backing, numa_node);
+            if (ptr != MAP_FAILED) {
+                mr->fd = fd;
+                mr->backing = backing;
+                mr->numa_node = numa_node;
+                mr->map_base = ptr;
+                mr->map_length = map_length;
+                mr->map_offset = gpa - map_first_gpa;
+                mr->hva = (uint8_t*)ptr + mr->map_offset;
+                return 0;
+            }
+
+            int res = -errno;
+            close(fd);
+            fd = res;
+        }
+
+        if (backing == IVEE_MEMORY_NORMAL) {
+            return fd;
+        }
+
+        backing = get_fallback_backing(backing);
+    }
+}
+
 struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* map,
                                                       gpa_t gpa,
                                                       size_t length,
@@ -34,55 +317,411 @@ struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* ma
     gpa_t first_gfn = gpa >> X86_PAGE_SHIFT;
     gpa_t last_gfn = (gpa + (length - 1)) >> X86_PAGE_SHIFT;
 
-    /* Walk current regions and check for overlaps */
-    struct ivee_guest_memory_region* mr;
-    LIST_FOREACH(mr, &map->regions, link) {
-        if (first_gfn <= mr->last_gfn && last_gfn >= mr->first_gfn) {
+    if (ivee_find_memory_region(map, first_gfn, last_gfn)) {
+        return NULL;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_zalloc(sizeof(*mr));
+    if (!mr) {
+        return NULL;
+    }
+
+    mr->first_gfn = first_gfn;
+    mr->last_gfn = last_gfn;
+    mr->prot = prot;
+    mr->length = length;
+    mr->host_ro = host_ro;
+
+    /*
+     * Every region keeps an fd of its backing memory object, so that it can later be mapped
+     * again as a copy-on-write view for cloned environments.
+     */
+    if (mmap_fd == -1) {
+        ivee_memory_backing_t backing = (host_ro ? IVEE_MEMORY_NORMAL : map->backing);
+        if (map_anonymous_memory(mr, first_gfn << X86_PAGE_SHIFT, backing, map->numa_node) != 0) {
+            ivee_free(mr);
+            return NULL;
+        }
+    } else {
+        mr->fd = fcntl(mmap_fd, F_DUPFD_CLOEXEC, 0);
+        if (mr->fd < 0) {
+            ivee_free(mr);
             return NULL;
         }
+
+        mr->hva = mmap(NULL, length, (host_ro ? PROT_READ : PROT_READ | PROT_WRITE), MAP_SHARED, mr->fd, 0);
+        if (mr->hva == MAP_FAILED) {
+            close(mr->fd);
+            ivee_free(mr);
+            return NULL;
+        }
+
+        mr->backing = IVEE_MEMORY_NORMAL;
+        mr->numa_node = -1;
+        mr->map_base = mr->hva;
+        mr->map_length = length;
+        mr->map_offset = 0;
     }
 
-    void* ptr = mmap(NULL,
-                     length,
-                     (host_ro ? PROT_READ : PROT_READ | PROT_WRITE),
-                     MAP_SHARED | (mmap_fd == -1 ? MAP_ANONYMOUS : 0),
-                     mmap_fd,
-                     0);
-    if (ptr == MAP_FAILED) {
+    insert_region(map, mr);
+    return mr;
+}
+
+struct ivee_guest_memory_region* ivee_map_file_memory(struct ivee_memory_map* map,
+                                                      gpa_t gpa,
+                                                      size_t length,
+                                                      int fd,
+                                                      off_t offset,
+                                                      enum ivee_memory_prot prot)
+{
+    if (!map || !length || fd < 0) {
+        return NULL;
+    }
+
+    if ((gpa | (uint64_t)offset) & (X86_PAGE_SIZE - 1)) {
+        return NULL;
+    }
+
+    if (IVEE_GPA_LAST - gpa < length - 1) {
+        return NULL;
+    }
+
+    length = (length + (X86_PAGE_SIZE - 1)) & ~(X86_PAGE_SIZE - 1);
+
+    gpa_t first_gfn = gpa >> X86_PAGE_SHIFT;
+    gpa_t last_gfn = (gpa + (length - 1)) >> X86_PAGE_SHIFT;
+
+    if (ivee_find_memory_region(map, first_gfn, last_gfn)) {
+        return NULL;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_zalloc(sizeof(*mr));
+    if (!mr) {
+        return NULL;
+    }
+
+    mr->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (mr->fd < 0) {
+        ivee_free(mr);
+        return NULL;
+    }
+
+    /* Guest writes to file pages stay private, which also makes the region sealed from the start */
+    bool is_writable = (prot & IVEE_WRITE) != 0;
+    mr->hva = mmap(NULL,
+                   length,
+                   (is_writable ? PROT_READ | PROT_WRITE : PROT_READ),
+                   (is_writable ? MAP_PRIVATE : MAP_SHARED),
+                   mr->fd,
+                   offset);
+    if (mr->hva == MAP_FAILED) {
+        close(mr->fd);
+        ivee_free(mr);
+        return NULL;
+    }
+
+    /* Page cache pages are shared with everyone, only private copies are ours to place */
+    mr->numa_node = (is_writable ? map->numa_node : -1);
+    if (ivee_bind_memory(mr->hva, length, mr->numa_node) != 0) {
+        munmap(mr->hva, length);
+        close(mr->fd);
+        ivee_free(mr);
+        return NULL;
+    }
+
+    mr->first_gfn = first_gfn;
+    mr->last_gfn = last_gfn;
+    mr->prot = prot;
+    mr->length = length;
+    mr->map_base = mr->hva;
+    mr->map_length = length;
+    mr->map_offset = 0;
+    mr->backing = IVEE_MEMORY_NORMAL;
+    mr->fd_offset = offset;
+    mr->host_ro = !is_writable;
+    mr->is_private = is_writable;
+
+    insert_region(map, mr);
+    return mr;
+}
+
+struct ivee_guest_memory_region* ivee_map_user_memory(struct ivee_memory_map* map,
+                                                      gpa_t gpa,
+                                                      void* hva,
+                                                      size_t length,
+                                                      enum ivee_memory_prot prot)
+{
+    if (!map || !hva || !length) {
+        return NULL;
+    }
+
+    if ((gpa | (uintptr_t)hva | length) & (X86_PAGE_SIZE - 1)) {
+        return NULL;
+    }
+
+    if (IVEE_GPA_LAST - gpa < length - 1) {
         return NULL;
     }
 
-    mr = ivee_alloc(sizeof(*mr));
+    gpa_t first_gfn = gpa >> X86_PAGE_SHIFT;
+    gpa_t last_gfn = (gpa + (length - 1)) >> X86_PAGE_SHIFT;
+
+    if (ivee_find_memory_region(map, first_gfn, last_gfn)) {
+        return NULL;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_zalloc(sizeof(*mr));
     if (!mr) {
-        munmap(ptr, length);
         return NULL;
     }
 
     mr->first_gfn = first_gfn;
     mr->last_gfn = last_gfn;
     mr->prot = prot;
-    mr->hva = ptr;
+    mr->hva = hva;
     mr->length = length;
+    mr->map_base = hva;
+    mr->map_length = length;
+    mr->map_offset = 0;
+    mr->backing = IVEE_MEMORY_NORMAL;
+    mr->numa_node = -1;
+    mr->fd = -1;
+    mr->is_shared = true;
+    mr->is_user_memory = true;
 
-    LIST_INSERT_HEAD(&map->regions, mr, link);
+    insert_region(map, mr);
     return mr;
 }
 
-void ivee_unmap_host_memory(struct ivee_guest_memory_region* mr)
+void ivee_unmap_host_memory(struct ivee_memory_map* map, struct ivee_guest_memory_region* mr)
 {
-    if (!mr || !mr->hva) {
+    if (!map || !mr || !mr->hva) {
         return;
     }
 
-    LIST_REMOVE(mr, link);
+    ivee_avl_remove(&map->regions, &mr->node);
+
+    if (mr->is_user_memory) {
+        ivee_free(mr);
+        return;
+    }
 
-    munmap(mr->hva, mr->length);
+    if (mr->pristine_hva) {
+        munmap((uint8_t*)mr->pristine_hva - mr->map_offset, mr->map_length);
+    }
+
+    munmap(mr->map_base, mr->map_length);
+    close(mr->fd);
     ivee_free(mr);
 }
 
+int ivee_seal_host_memory(struct ivee_guest_memory_region* mr)
+{
+    if (!mr) {
+        return -EINVAL;
+    }
+
+    /* Nobody can write to read-only host mappings, backing object is already frozen.
+     * Shared regions are never frozen. */
+    if (mr->host_ro || mr->is_private || mr->is_shared) {
+        return 0;
+    }
+
+    void* ptr = map_memory_object(mr->map_base, mr->map_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, mr->fd, mr->fd_offset, mr->backing, mr->numa_node);
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+
+    mr->is_private = true;
+    mr->is_locked = false;
+    return 0;
+}
+
+int ivee_seal_memory_map(struct ivee_memory_map* map)
+{
+    if (!map) {
+        return -EINVAL;
+    }
+
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, map) {
+        int res = ivee_seal_host_memory(mr);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+int ivee_lock_memory_map(struct ivee_memory_map* map)
+{
+    if (!map) {
+        return -EINVAL;
+    }
+
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, map) {
+        if (mr->is_locked || mr->is_user_memory) {
+            continue;
+        }
+
+        /* Pages past the end of mapped file can't be faulted in, mlock would fail on them */
+        struct stat st;
+        if (fstat(mr->fd, &st) != 0) {
+            return -errno;
+        }
+
+        size_t length = mr->map_length;
+        if (st.st_size <= mr->fd_offset) {
+            length = 0;
+        } else if ((uint64_t)(st.st_size - mr->fd_offset) < length) {
+            length = (st.st_size - mr->fd_offset + X86_PAGE_SIZE - 1) & ~(X86_PAGE_SIZE - 1);
+        }
+
+        /* mlock faults pages in, with write faults for writable private mappings */
+        if (length && mlock(mr->map_base, length) != 0) {
+            return -errno;
+        }
+
+        if (length && mr->pristine_hva && mlock((uint8_t*)mr->pristine_hva - mr->map_offset, length) != 0) {
+            return -errno;
+        }
+
+        mr->is_locked = true;
+    }
+
+    return 0;
+}
+
+int ivee_snapshot_host_memory(struct ivee_guest_memory_region* mr, bool rebase)
+{
+    int res = 0;
+
+    if (!mr || !mr->is_private) {
+        return -EINVAL;
+    }
+
+    if (rebase) {
+        int fd = alloc_memory_object(mr->map_length, mr->backing);
+        if (fd < 0) {
+            return fd;
+        }
+
+        /* Hugetlbfs objects can't be written to, copy through a mapping */
+        void* ptr = map_memory_object(NULL, mr->map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0,
+                                      IVEE_MEMORY_NORMAL, mr->numa_node);
+        if (ptr == MAP_FAILED) {
+            res = -errno;
+            close(fd);
+            return res;
+        }
+
+        memcpy(ptr, mr->map_base, mr->map_length);
+        munmap(ptr, mr->map_length);
+
+        ptr = map_memory_object(mr->map_base,
+                                mr->map_length,
+                                (mr->host_ro ? PROT_READ : PROT_READ | PROT_WRITE),
+                                MAP_PRIVATE,
+                                fd,
+                                0,
+                                mr->backing,
+                                mr->numa_node);
+        if (ptr == MAP_FAILED) {
+            res = -errno;
+            close(fd);
+            return res;
+        }
+
+        close(mr->fd);
+        mr->fd = fd;
+        mr->fd_offset = 0;
+
+        if (mr->pristine_hva) {
+            munmap((uint8_t*)mr->pristine_hva - mr->map_offset, mr->map_length);
+            mr->pristine_hva = NULL;
+        }
+    }
+
+    if (!mr->pristine_hva) {
+        void* ptr = mmap(NULL, mr->map_length, PROT_READ, MAP_SHARED, mr->fd, mr->fd_offset);
+        if (ptr == MAP_FAILED) {
+            return -errno;
+        }
+
+        mr->pristine_hva = (uint8_t*)ptr + mr->map_offset;
+        mr->is_locked = false;
+    }
+
+    return 0;
+}
+
+void ivee_restore_host_memory(struct ivee_guest_memory_region* mr, size_t offset, size_t length)
+{
+    memcpy((uint8_t*)mr->hva + offset, (const uint8_t*)mr->pristine_hva + offset, length);
+}
+
+struct ivee_guest_memory_region* ivee_clone_host_memory(struct ivee_memory_map* map,
+                                                        const struct ivee_guest_memory_region* src)
+{
+    if (!map || !src) {
+        return NULL;
+    }
+
+    if (ivee_find_memory_region(map, src->first_gfn, src->last_gfn)) {
+        return NULL;
+    }
+
+    int fd = fcntl(src->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    void* ptr = map_memory_object(NULL,
+                                  src->map_length,
+                                  (src->host_ro ? PROT_READ : PROT_READ | PROT_WRITE),
+                                  MAP_PRIVATE,
+                                  fd,
+                                  src->fd_offset,
+                                  src->backing,
+                                  map->numa_node);
+    if (ptr == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_zalloc(sizeof(*mr));
+    if (!mr) {
+        munmap(ptr, src->map_length);
+        close(fd);
+        return NULL;
+    }
+
+    mr->first_gfn = src->first_gfn;
+    mr->last_gfn = src->last_gfn;
+    mr->prot = src->prot;
+    mr->hva = (uint8_t*)ptr + src->map_offset;
+    mr->length = src->length;
+    mr->map_base = ptr;
+    mr->map_length = src->map_length;
+    mr->map_offset = src->map_offset;
+    mr->backing = src->backing;
+    mr->numa_node = map->numa_node;
+    mr->fd = fd;
+    mr->fd_offset = src->fd_offset;
+    mr->host_ro = src->host_ro;
+    mr->is_private = true;
+
+    insert_region(map, mr);
+    return mr;
+}
+
 int ivee_init_memory_map(struct ivee_memory_map* map)
 {
-    LIST_INIT(&map->regions);
+    map->regions.root = NULL;
+    map->backing = IVEE_MEMORY_NORMAL;
+    map->numa_node = -1;
     return 0;
 }
 
@@ -93,8 +732,7 @@ void ivee_free_memory_map(struct ivee_memory_map* map)
     }
 
     struct ivee_guest_memory_region* mr;
-    while (!LIST_EMPTY(&map->regions)) {
-        mr = LIST_FIRST(&map->regions);
-        ivee_unmap_host_memory(mr);
+    while ((mr = ivee_first_memory_region(map)) != NULL) {
+        ivee_unmap_host_memory(map, mr);
     }
 }
@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "placement.h"
+
+/* Parse sysfs cpu list such as "0-3,8,10-11" */
+static int parse_cpu_list(const char* list, cpu_set_t* cpus)
+{
+    CPU_ZERO(cpus);
+
+    const char* p = list;
+    while (*p && *p != '\n') {
+        char* end = NULL;
+        unsigned long first = strtoul(p, &end, 10);
+        if (end == p) {
+            return -EINVAL;
+        }
+
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtoul(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -EINVAL;
+            }
+
+            p = end;
+        }
+
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+int ivee_get_numa_node_cpus(int node, cpu_set_t* cpus)
+{
+    if (node < 0 || node >= IVEE_MAX_NUMA_NODES) {
+        return -EINVAL;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        return (errno == ENOENT ? -EINVAL : -errno);
+    }
+
+    /* Longest list is every other CPU of CPU_SETSIZE, 5 characters each */
+    char list[CPU_SETSIZE * 5 / 2 + 1];
+    char* line = fgets(list, sizeof(list), file);
+    fclose(file);
+
+    if (!line) {
+        return -EIO;
+    }
+
+    return parse_cpu_list(line, cpus);
+}
+
+int ivee_bind_memory(void* ptr, size_t length, int node)
+{
+    if (node < 0) {
+        return 0;
+    }
+
+    if (node >= IVEE_MAX_NUMA_NODES) {
+        return -EINVAL;
+    }
+
+    unsigned long nodemask[IVEE_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    nodemask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+
+    /* Kernel reads one bit less than maxnode */
+    if (syscall(SYS_mbind, ptr, length, MPOL_PREFERRED, nodemask, IVEE_MAX_NUMA_NODES + 1, 0) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int ivee_pin_thread(const cpu_set_t* cpus)
+{
+    /* Application can change affinity behind our back, ask the kernel rather than remember what we set */
+    cpu_set_t current;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(current), &current) == 0 && CPU_EQUAL(&current, cpus)) {
+        return 0;
+    }
+
+    return -pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+}
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+#include "libivee/libivee.h"
+#include "environment.h"
+#include "platform.h"
+#include "histogram.h"
+
+/**
+ * Environment parked in the pool
+ */
+struct ivee_pool_entry
+{
+    STAILQ_ENTRY(ivee_pool_entry) link;
+    ivee_t* ivee;
+};
+
+STAILQ_HEAD(ivee_pool_list, ivee_pool_entry);
+
+struct ivee_pool
+{
+    /* Loaded environment all pooled environments are cloned from */
+    ivee_t* tmpl;
+
+    /* Number of environments to keep ready */
+    size_t target;
+
+    /* Protects everything below up to stats */
+    pthread_mutex_t lock;
+
+    /* Signaled when refill thread has work to do */
+    pthread_cond_t refill_cond;
+
+    /* Environments ready to be acquired */
+    struct ivee_pool_list ready;
+    size_t nready;
+
+    /* Released environments waiting to be reset by refill thread */
+    struct ivee_pool_list retired;
+
+    /* Free list of entries */
+    struct ivee_pool_list free_entries;
+
+    /* Refill thread should exit */
+    bool shutdown;
+
+    /* Background refill thread */
+    pthread_t refill_thread;
+    bool has_refill_thread;
+
+    /* Stats */
+    _Atomic uint64_t acquired;
+    _Atomic uint64_t empty;
+    struct ivee_histogram acquire_latency;
+};
+
+static struct ivee_pool_entry* alloc_entry(struct ivee_pool* pool)
+{
+    struct ivee_pool_entry* entry = STAILQ_FIRST(&pool->free_entries);
+    if (entry) {
+        STAILQ_REMOVE_HEAD(&pool->free_entries, link);
+        return entry;
+    }
+
+    return ivee_zalloc(sizeof(*entry));
+}
+
+static void free_entries(struct ivee_pool_list* list)
+{
+    while (!STAILQ_EMPTY(list)) {
+        struct ivee_pool_entry* entry = STAILQ_FIRST(list);
+        STAILQ_REMOVE_HEAD(list, link);
+        ivee_destroy(entry->ivee);
+        ivee_free(entry);
+    }
+}
+
+/* Put a new environment into ready list, pool should be locked */
+static int push_ready(struct ivee_pool* pool, ivee_t* ivee)
+{
+    struct ivee_pool_entry* entry = alloc_entry(pool);
+    if (!entry) {
+        return -ENOMEM;
+    }
+
+    entry->ivee = ivee;
+    STAILQ_INSERT_TAIL(&pool->ready, entry, link);
+    ++pool->nready;
+
+    return 0;
+}
+
+/* Create new environments until pool reaches target size */
+static int refill(struct ivee_pool* pool)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown && pool->nready < pool->target) {
+        pthread_mutex_unlock(&pool->lock);
+
+        ivee_t* ivee = NULL;
+        res = ivee_clone(pool->tmpl, &ivee);
+        if (res == 0) {
+            res = ivee_snapshot(ivee);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (res == 0) {
+            res = push_ready(pool, ivee);
+        }
+
+        if (res != 0) {
+            ivee_destroy(ivee);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return res;
+}
+
+static void* refill_thread(void* arg)
+{
+    struct ivee_pool* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown) {
+        if (pool->nready >= pool->target && STAILQ_EMPTY(&pool->retired)) {
+            pthread_cond_wait(&pool->refill_cond, &pool->lock);
+            continue;
+        }
+
+        /* Reset released environments outside of the lock */
+        struct ivee_pool_list retired = STAILQ_HEAD_INITIALIZER(retired);
+        STAILQ_CONCAT(&retired, &pool->retired);
+        pthread_mutex_unlock(&pool->lock);
+
+        struct ivee_pool_entry* entry;
+        STAILQ_FOREACH(entry, &retired, link) {
+            if (ivee_recycle(entry->ivee) != 0) {
+                ivee_destroy(entry->ivee);
+                entry->ivee = NULL;
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!STAILQ_EMPTY(&retired)) {
+            entry = STAILQ_FIRST(&retired);
+            STAILQ_REMOVE_HEAD(&retired, link);
+
+            /* Environments cloned while pool was empty make it overflow once they are released */
+            if (entry->ivee && pool->nready < pool->target) {
+                STAILQ_INSERT_TAIL(&pool->ready, entry, link);
+                ++pool->nready;
+            } else {
+                ivee_destroy(entry->ivee);
+                entry->ivee = NULL;
+                STAILQ_INSERT_HEAD(&pool->free_entries, entry, link);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        int res = refill(pool);
+
+        pthread_mutex_lock(&pool->lock);
+
+        /* Don't spin on failures, try again when next environment is acquired or released */
+        if (res != 0 && !pool->shutdown && STAILQ_EMPTY(&pool->retired)) {
+            pthread_cond_wait(&pool->refill_cond, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int ivee_pool_create(const char* file, ivee_executable_format_t format, size_t size, struct ivee_pool** out_pool_ptr)
+{
+    int res = 0;
+
+    if (!file || !size || !out_pool_ptr) {
+        return -EINVAL;
+    }
+
+    struct ivee_pool* pool = ivee_zalloc(sizeof(*pool));
+    if (!pool) {
+        return -ENOMEM;
+    }
+
+    pool->target = size;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->refill_cond, NULL);
+    STAILQ_INIT(&pool->ready);
+    STAILQ_INIT(&pool->retired);
+    STAILQ_INIT(&pool->free_entries);
+
+    res = ivee_create(0, &pool->tmpl);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    res = ivee_load_executable(pool->tmpl, file, format);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    /* Initial fill happens synchronously so that first acquires don't find the pool empty */
+    res = refill(pool);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    res = -pthread_create(&pool->refill_thread, NULL, refill_thread, pool);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    pool->has_refill_thread = true;
+
+    *out_pool_ptr = pool;
+    return 0;
+
+error_out:
+    ivee_pool_destroy(pool);
+    return res;
+}
+
+void ivee_pool_destroy(struct ivee_pool* pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    if (pool->has_refill_thread) {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_signal(&pool->refill_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        pthread_join(pool->refill_thread, NULL);
+    }
+
+    free_entries(&pool->ready);
+    free_entries(&pool->retired);
+    free_entries(&pool->free_entries);
+
+    ivee_destroy(pool->tmpl);
+
+    pthread_cond_destroy(&pool->refill_cond);
+    pthread_mutex_destroy(&pool->lock);
+    ivee_free(pool);
+}
+
+int ivee_pool_acquire(struct ivee_pool* pool, ivee_t** out_ivee_ptr)
+{
+    int res = 0;
+
+    if (!pool || !out_ivee_ptr) {
+        return -EINVAL;
+    }
+
+    uint64_t start = ivee_monotonic_ns();
+    ivee_t* ivee = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    struct ivee_pool_entry* entry = STAILQ_FIRST(&pool->ready);
+    if (entry) {
+        STAILQ_REMOVE_HEAD(&pool->ready, link);
+        --pool->nready;
+        ivee = entry->ivee;
+        entry->ivee = NULL;
+        STAILQ_INSERT_HEAD(&pool->free_entries, entry, link);
+    }
+    pthread_cond_signal(&pool->refill_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Pool ran dry: pay for a clone on caller's thread rather than waiting for refill */
+    if (!ivee) {
+        atomic_fetch_add_explicit(&pool->empty, 1, memory_order_relaxed);
+
+        res = ivee_clone(pool->tmpl, &ivee);
+        if (res == 0) {
+            res = ivee_snapshot(ivee);
+        }
+
+        if (res != 0) {
+            ivee_destroy(ivee);
+            return res;
+        }
+    }
+
+    atomic_fetch_add_explicit(&pool->acquired, 1, memory_order_relaxed);
+    ivee_histogram_record(&pool->acquire_latency, ivee_monotonic_ns() - start);
+
+    *out_ivee_ptr = ivee;
+    return 0;
+}
+
+void ivee_pool_release(struct ivee_pool* pool, ivee_t* ivee)
+{
+    if (!pool || !ivee) {
+        return;
+    }
+
+    /* Refill thread recycles environment back to its clean snapshot and puts it into ready list */
+    pthread_mutex_lock(&pool->lock);
+    struct ivee_pool_entry* entry = alloc_entry(pool);
+    if (entry) {
+        entry->ivee = ivee;
+        STAILQ_INSERT_TAIL(&pool->retired, entry, link);
+        pthread_cond_signal(&pool->refill_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!entry) {
+        ivee_destroy(ivee);
+    }
+}
+
+int ivee_pool_get_stats(struct ivee_pool* pool, ivee_pool_stats_t* stats)
+{
+    if (!pool || !stats) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    stats->ready = pool->nready;
+    pthread_mutex_unlock(&pool->lock);
+
+    stats->acquired = atomic_load_explicit(&pool->acquired, memory_order_relaxed);
+    stats->empty = atomic_load_explicit(&pool->empty, memory_order_relaxed);
+    stats->acquire_p50_ns = ivee_histogram_percentile(&pool->acquire_latency, 50.0);
+    stats->acquire_p90_ns = ivee_histogram_percentile(&pool->acquire_latency, 90.0);
+    stats->acquire_p99_ns = ivee_histogram_percentile(&pool->acquire_latency, 99.0);
+    stats->acquire_p999_ns = ivee_histogram_percentile(&pool->acquire_latency, 99.9);
+    stats->acquire_max_ns = atomic_load_explicit(&pool->acquire_latency.max, memory_order_relaxed);
+
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "libivee/libivee.h"
+#include "libivee/ring.h"
+#include "platform.h"
+#include "memory.h"
+#include "kvm.h"
+#include "x86.h"
+#include "environment.h"
+
+_Static_assert(offsetof(struct ivee_ring_header, entries) == IVEE_RING_ENTRIES_OFFSET, "");
+_Static_assert(offsetof(struct ivee_ring_header, sq_offset) == IVEE_RING_SQ_OFFSET_OFFSET, "");
+_Static_assert(offsetof(struct ivee_ring_header, cq_offset) == IVEE_RING_CQ_OFFSET_OFFSET, "");
+_Static_assert(offsetof(struct ivee_ring_header, stop) == IVEE_RING_STOP_OFFSET, "");
+_Static_assert(offsetof(struct ivee_ring_header, sq_head) == IVEE_RING_SQ_HEAD_OFFSET, "");
+_Static_assert(offsetof(struct ivee_ring_header, sq_tail) == IVEE_RING_SQ_TAIL_OFFSET, "");
+_Static_assert(offsetof(struct ivee_ring_header, cq_head) == IVEE_RING_CQ_HEAD_OFFSET, "");
+_Static_assert(offsetof(struct ivee_ring_header, cq_tail) == IVEE_RING_CQ_TAIL_OFFSET, "");
+_Static_assert(sizeof(ivee_ring_sqe_t) == 64, "");
+_Static_assert(sizeof(ivee_ring_cqe_t) == 32, "");
+
+struct ivee_ring
+{
+    /* Environment running guest loop */
+    ivee_t* ivee;
+
+    /* Shared guest region holding the ring */
+    struct ivee_guest_memory_region* mr;
+
+    /* Host view of ring region */
+    struct ivee_ring_header* header;
+    ivee_ring_sqe_t* sq;
+    ivee_ring_cqe_t* cq;
+    uint32_t mask;
+
+    /* VCPU thread running guest loop */
+    pthread_t thread;
+
+    /* Guest loop call has returned, its result is valid */
+    atomic_bool has_exited;
+    int result;
+};
+
+/* Time guest loop gets to notice stop flag before it is cancelled */
+#define IVEE_RING_STOP_TIMEOUT_NS 100000000ull
+
+static void* ring_thread(void* arg)
+{
+    struct ivee_ring* ring = arg;
+
+    ivee_kvm_block_process_signals();
+
+    ivee_arch_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.rdi = ring->mr->first_gfn << X86_PAGE_SHIFT;
+
+    ring->result = ivee_run_call(ring->ivee, &state, NULL, 0, false);
+    atomic_store_explicit(&ring->has_exited, true, memory_order_release);
+
+    return NULL;
+}
+
+int ivee_ring_create(ivee_t* ivee, uint32_t entries, ivee_ring_t** out_ring)
+{
+    int res = 0;
+
+    if (!ivee || !out_ring) {
+        return -EINVAL;
+    }
+
+    /* Keep indices from wrapping past unreaped entries */
+    if (entries == 0 || (entries & (entries - 1)) != 0 || entries > (1u << 16)) {
+        return -EINVAL;
+    }
+
+    struct ivee_ring* ring = ivee_zalloc(sizeof(*ring));
+    if (!ring) {
+        return -ENOMEM;
+    }
+
+    /* Ring keeps environment to itself until it is destroyed */
+    res = ivee_enter_exclusive(ivee);
+    if (res != 0) {
+        ivee_free(ring);
+        return res;
+    }
+
+    size_t sq_offset = sizeof(struct ivee_ring_header);
+    size_t cq_offset = sq_offset + entries * sizeof(ivee_ring_sqe_t);
+    size_t length = cq_offset + entries * sizeof(ivee_ring_cqe_t);
+
+    res = ivee_map_shared_memory(ivee, length, IVEE_READ | IVEE_WRITE, &ring->mr);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    ring->ivee = ivee;
+    ring->header = ring->mr->hva;
+    ring->sq = (ivee_ring_sqe_t*)((uint8_t*)ring->mr->hva + sq_offset);
+    ring->cq = (ivee_ring_cqe_t*)((uint8_t*)ring->mr->hva + cq_offset);
+    ring->mask = entries - 1;
+
+    /* Fresh memory object is zero-filled, that takes care of indices */
+    ring->header->magic = IVEE_RING_MAGIC;
+    ring->header->entries = entries;
+    ring->header->sq_offset = sq_offset;
+    ring->header->cq_offset = cq_offset;
+
+    res = pthread_create(&ring->thread, NULL, ring_thread, ring);
+    if (res != 0) {
+        res = -res;
+        goto error_out;
+    }
+
+    *out_ring = ring;
+    return 0;
+
+error_out:
+    if (ring->mr) {
+        ivee_unmap_shared_memory(ivee, ring->mr);
+    }
+
+    ivee_leave_exclusive(ivee);
+    ivee_free(ring);
+    return res;
+}
+
+void ivee_ring_destroy(ivee_ring_t* ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    __atomic_store_n(&ring->header->stop, 1, __ATOMIC_RELEASE);
+
+    /*
+     * Guest loop could be stuck on an entry or never look at stop flag, cancel it once it had its chance.
+     * It could also be just entering the call, keep kicking until it leaves.
+     */
+    uint64_t deadline = ivee_monotonic_ns() + IVEE_RING_STOP_TIMEOUT_NS;
+    while (!atomic_load_explicit(&ring->has_exited, memory_order_acquire)) {
+        if (ivee_monotonic_ns() >= deadline) {
+            ivee_cancel(ring->ivee);
+        }
+
+        struct timespec delay = { .tv_nsec = 100000 };
+        nanosleep(&delay, NULL);
+    }
+
+    pthread_join(ring->thread, NULL);
+
+    ivee_unmap_shared_memory(ring->ivee, ring->mr);
+    ivee_leave_exclusive(ring->ivee);
+    ivee_free(ring);
+}
+
+int ivee_ring_submit(ivee_ring_t* ring, const ivee_ring_sqe_t* sqes, size_t count)
+{
+    if (!ring || (!sqes && count)) {
+        return -EINVAL;
+    }
+
+    if (atomic_load_explicit(&ring->has_exited, memory_order_acquire)) {
+        return -EPIPE;
+    }
+
+    struct ivee_ring_header* header = ring->header;
+    uint32_t tail = header->sq_tail;
+    uint32_t cq_head = __atomic_load_n(&header->cq_head, __ATOMIC_ACQUIRE);
+
+    /*
+     * Completion ring can't overflow as long as in-flight entries fit into it.
+     * Ring size comes from our own copy, guest can write anything to the header.
+     */
+    uint32_t entries = ring->mask + 1;
+    uint32_t in_flight = tail - cq_head;
+    size_t space = (in_flight < entries ? entries - in_flight : 0);
+    if (count > space) {
+        count = space;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        ring->sq[(tail + i) & ring->mask] = sqes[i];
+    }
+
+    __atomic_store_n(&header->sq_tail, tail + (uint32_t)count, __ATOMIC_RELEASE);
+    return (int)count;
+}
+
+int ivee_ring_reap(ivee_ring_t* ring, ivee_ring_cqe_t* cqes, size_t max)
+{
+    if (!ring || (!cqes && max)) {
+        return -EINVAL;
+    }
+
+    /* Check for exit before looking at the ring so that we don't miss completions posted just before it */
+    bool has_exited = atomic_load_explicit(&ring->has_exited, memory_order_acquire);
+
+    struct ivee_ring_header* header = ring->header;
+    uint32_t head = header->cq_head;
+    uint32_t tail = __atomic_load_n(&header->cq_tail, __ATOMIC_ACQUIRE);
+
+    size_t count = tail - head;
+    if (count == 0 && has_exited) {
+        return -EPIPE;
+    }
+
+    if (count > max) {
+        count = max;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        cqes[i] = ring->cq[(head + i) & ring->mask];
+    }
+
+    __atomic_store_n(&header->cq_head, head + (uint32_t)count, __ATOMIC_RELEASE);
+    return (int)count;
+}
+
+int ivee_ring_result(ivee_ring_t* ring)
+{
+    if (!ring) {
+        return -EINVAL;
+    }
+
+    if (!atomic_load_explicit(&ring->has_exited, memory_order_acquire)) {
+        return -EBUSY;
+    }
+
+    return ring->result;
+}
@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <linux/kvm.h>
+
+#include "libivee/libivee.h"
+#include "platform.h"
+#include "histogram.h"
+#include "stats.h"
+
+/**
+ * Process-wide statistics: live environments plus everything destroyed environments have accumulated
+ */
+static struct ivee_process_stats {
+    pthread_mutex_t lock;
+    TAILQ_HEAD(, ivee_stats_block) live;
+    struct ivee_stats_block retired;
+} g_stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .live = TAILQ_HEAD_INITIALIZER(g_stats.live),
+};
+
+/* Prometheus labels for exit reasons we expect to see, others are reported by number */
+static const char* const g_exit_reason_names[IVEE_STATS_EXIT_REASONS] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq_window_open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail_entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal_error",
+    [KVM_EXIT_SYSTEM_EVENT] = "system_event",
+};
+
+struct ivee_stats_block* ivee_create_stats(void)
+{
+    struct ivee_stats_block* stats = ivee_zalloc(sizeof(*stats));
+    if (!stats) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_stats.lock);
+    TAILQ_INSERT_TAIL(&g_stats.live, stats, link);
+    pthread_mutex_unlock(&g_stats.lock);
+
+    return stats;
+}
+
+static void add_counter(_Atomic uint64_t* dst, const _Atomic uint64_t* src)
+{
+    atomic_fetch_add_explicit(dst, atomic_load_explicit(src, memory_order_relaxed), memory_order_relaxed);
+}
+
+static void add_pio_exits(struct ivee_stats_block* dst, uint32_t port, uint64_t count)
+{
+    for (unsigned i = 0; i < IVEE_STATS_PIO_PORTS; ++i) {
+        uint32_t cur = atomic_load_explicit(&dst->pio_ports[i], memory_order_relaxed);
+        if (cur == 0) {
+            atomic_store_explicit(&dst->pio_ports[i], port, memory_order_relaxed);
+            cur = port;
+        }
+
+        if (cur == port) {
+            atomic_fetch_add_explicit(&dst->pio_exits[i], count, memory_order_relaxed);
+            return;
+        }
+    }
+
+    atomic_fetch_add_explicit(&dst->pio_other_exits, count, memory_order_relaxed);
+}
+
+/* Add statistics of src to dst, called with g_stats.lock held when dst is shared */
+static void merge_stats(struct ivee_stats_block* dst, const struct ivee_stats_block* src)
+{
+    add_counter(&dst->calls, &src->calls);
+    add_counter(&dst->failed_calls, &src->failed_calls);
+    add_counter(&dst->runs, &src->runs);
+    add_counter(&dst->run_errors, &src->run_errors);
+
+    for (unsigned i = 0; i < IVEE_STATS_EXIT_REASONS; ++i) {
+        add_counter(&dst->exits[i], &src->exits[i]);
+    }
+
+    for (unsigned i = 0; i < IVEE_STATS_PIO_PORTS; ++i) {
+        uint32_t port = atomic_load_explicit(&src->pio_ports[i], memory_order_relaxed);
+        if (port != 0) {
+            add_pio_exits(dst, port, atomic_load_explicit(&src->pio_exits[i], memory_order_relaxed));
+        }
+    }
+
+    add_counter(&dst->pio_other_exits, &src->pio_other_exits);
+
+    ivee_histogram_merge(&dst->call, &src->call);
+    ivee_histogram_merge(&dst->load, &src->load);
+    ivee_histogram_merge(&dst->guest, &src->guest);
+    ivee_histogram_merge(&dst->exit, &src->exit);
+    ivee_histogram_merge(&dst->store, &src->store);
+}
+
+void ivee_release_stats(struct ivee_stats_block* stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_stats.lock);
+    TAILQ_REMOVE(&g_stats.live, stats, link);
+    merge_stats(&g_stats.retired, stats);
+    pthread_mutex_unlock(&g_stats.lock);
+
+    ivee_free(stats);
+}
+
+void ivee_stats_record_exit(struct ivee_stats_block* stats, uint32_t kvm_exit_reason)
+{
+    if (kvm_exit_reason >= IVEE_STATS_EXIT_REASONS) {
+        kvm_exit_reason = IVEE_STATS_EXIT_REASONS - 1;
+    }
+
+    ivee_stats_add(&stats->exits[kvm_exit_reason], 1);
+}
+
+void ivee_stats_record_pio(struct ivee_stats_block* stats, uint16_t port)
+{
+    uint32_t key = (uint32_t)port + 1;
+
+    for (unsigned i = 0; i < IVEE_STATS_PIO_PORTS; ++i) {
+        uint32_t cur = atomic_load_explicit(&stats->pio_ports[i], memory_order_relaxed);
+        if (cur == 0) {
+            /* Publish count before port so that readers never see a claimed port with a stale count */
+            atomic_store_explicit(&stats->pio_exits[i], 1, memory_order_relaxed);
+            atomic_store_explicit(&stats->pio_ports[i], key, memory_order_release);
+            return;
+        }
+
+        if (cur == key) {
+            ivee_stats_add(&stats->pio_exits[i], 1);
+            return;
+        }
+    }
+
+    ivee_stats_add(&stats->pio_other_exits, 1);
+}
+
+static void get_latency_stats(const struct ivee_histogram* h, ivee_latency_stats_t* out)
+{
+    out->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    out->sum_ns = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    out->p50_ns = ivee_histogram_percentile(h, 50.0);
+    out->p90_ns = ivee_histogram_percentile(h, 90.0);
+    out->p99_ns = ivee_histogram_percentile(h, 99.0);
+    out->p999_ns = ivee_histogram_percentile(h, 99.9);
+    out->max_ns = atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void ivee_stats_get(const struct ivee_stats_block* stats, ivee_stats_t* out)
+{
+    memset(out, 0, sizeof(*out));
+
+    out->calls = atomic_load_explicit(&stats->calls, memory_order_relaxed);
+    out->failed_calls = atomic_load_explicit(&stats->failed_calls, memory_order_relaxed);
+    out->runs = atomic_load_explicit(&stats->runs, memory_order_relaxed);
+    out->run_errors = atomic_load_explicit(&stats->run_errors, memory_order_relaxed);
+
+    for (unsigned i = 0; i < IVEE_STATS_EXIT_REASONS; ++i) {
+        out->exits[i] = atomic_load_explicit(&stats->exits[i], memory_order_relaxed);
+    }
+
+    for (unsigned i = 0; i < IVEE_STATS_PIO_PORTS; ++i) {
+        uint32_t port = atomic_load_explicit(&stats->pio_ports[i], memory_order_acquire);
+        if (port != 0) {
+            out->pio_ports[i].port = port - 1;
+            out->pio_ports[i].exits = atomic_load_explicit(&stats->pio_exits[i], memory_order_relaxed);
+        }
+    }
+
+    out->pio_other_exits = atomic_load_explicit(&stats->pio_other_exits, memory_order_relaxed);
+
+    get_latency_stats(&stats->call, &out->call);
+    get_latency_stats(&stats->load, &out->load);
+    get_latency_stats(&stats->guest, &out->guest);
+    get_latency_stats(&stats->exit, &out->exit);
+    get_latency_stats(&stats->store, &out->store);
+}
+
+/* Sum of live and retired environment statistics */
+static struct ivee_stats_block* get_process_stats(void)
+{
+    struct ivee_stats_block* total = ivee_zalloc(sizeof(*total));
+    if (!total) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_stats.lock);
+
+    merge_stats(total, &g_stats.retired);
+
+    struct ivee_stats_block* stats;
+    TAILQ_FOREACH(stats, &g_stats.live, link) {
+        merge_stats(total, stats);
+    }
+
+    pthread_mutex_unlock(&g_stats.lock);
+    return total;
+}
+
+int ivee_get_process_stats(ivee_stats_t* out)
+{
+    if (!out) {
+        return -EINVAL;
+    }
+
+    struct ivee_stats_block* total = get_process_stats();
+    if (!total) {
+        return -ENOMEM;
+    }
+
+    ivee_stats_get(total, out);
+    ivee_free(total);
+    return 0;
+}
+
+/**
+ * snprintf-like text buffer: keeps counting length past the end of buffer
+ */
+struct text_buffer
+{
+    char* buf;
+    size_t size;
+    size_t length;
+};
+
+static void append(struct text_buffer* text, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    char* pos = (text->length < text->size ? text->buf + text->length : NULL);
+    size_t avail = (pos ? text->size - text->length : 0);
+    int nchars = vsnprintf(pos, avail, fmt, args);
+    if (nchars > 0) {
+        text->length += nchars;
+    }
+
+    va_end(args);
+}
+
+static void append_counter(struct text_buffer* text, const char* name, const char* help, uint64_t value)
+{
+    append(text, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n", name, help, name, name, value);
+}
+
+static void append_latency(struct text_buffer* text, const char* phase, const ivee_latency_stats_t* latency)
+{
+    static const char* const name = "ivee_call_phase_duration_seconds";
+    const struct {
+        const char* quantile;
+        uint64_t value;
+    } quantiles[] = {
+        { "0.5", latency->p50_ns },
+        { "0.9", latency->p90_ns },
+        { "0.99", latency->p99_ns },
+        { "0.999", latency->p999_ns },
+        { "1", latency->max_ns },
+    };
+
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(*quantiles); ++i) {
+        append(text, "%s{phase=\"%s\",quantile=\"%s\"} %.9f\n",
+               name, phase, quantiles[i].quantile, quantiles[i].value / 1e9);
+    }
+
+    append(text, "%s_sum{phase=\"%s\"} %.9f\n", name, phase, latency->sum_ns / 1e9);
+    append(text, "%s_count{phase=\"%s\"} %" PRIu64 "\n", name, phase, latency->count);
+}
+
+int ivee_format_process_stats(char* buf, size_t size)
+{
+    if (!buf && size) {
+        return -EINVAL;
+    }
+
+    ivee_stats_t stats;
+    int res = ivee_get_process_stats(&stats);
+    if (res != 0) {
+        return res;
+    }
+
+    struct text_buffer text = { .buf = buf, .size = size };
+
+    append_counter(&text, "ivee_calls_total", "Calls run by all environments.", stats.calls);
+    append_counter(&text, "ivee_failed_calls_total", "Calls that returned an error.", stats.failed_calls);
+    append_counter(&text, "ivee_kvm_runs_total", "KVM_RUN iterations.", stats.runs);
+    append_counter(&text, "ivee_kvm_run_errors_total", "KVM_RUN iterations that failed.", stats.run_errors);
+
+    append(&text, "# HELP ivee_exits_total VM exits by KVM exit reason.\n# TYPE ivee_exits_total counter\n");
+    for (unsigned i = 0; i < IVEE_STATS_EXIT_REASONS; ++i) {
+        if (stats.exits[i] == 0) {
+            continue;
+        }
+
+        if (g_exit_reason_names[i]) {
+            append(&text, "ivee_exits_total{reason=\"%s\"} %" PRIu64 "\n", g_exit_reason_names[i], stats.exits[i]);
+        } else {
+            append(&text, "ivee_exits_total{reason=\"%u\"} %" PRIu64 "\n", i, stats.exits[i]);
+        }
+    }
+
+    append(&text, "# HELP ivee_pio_exits_total Port IO exits by port.\n# TYPE ivee_pio_exits_total counter\n");
+    for (unsigned i = 0; i < IVEE_STATS_PIO_PORTS; ++i) {
+        if (stats.pio_ports[i].exits != 0) {
+            append(&text, "ivee_pio_exits_total{port=\"0x%x\"} %" PRIu64 "\n",
+                   stats.pio_ports[i].port, stats.pio_ports[i].exits);
+        }
+    }
+
+    if (stats.pio_other_exits != 0) {
+        append(&text, "ivee_pio_exits_total{port=\"other\"} %" PRIu64 "\n", stats.pio_other_exits);
+    }
+
+    append(&text, "# HELP ivee_call_phase_duration_seconds Time spent in each phase of a call.\n"
+                  "# TYPE ivee_call_phase_duration_seconds summary\n");
+    append_latency(&text, "call", &stats.call);
+    append_latency(&text, "state_load", &stats.load);
+    append_latency(&text, "guest", &stats.guest);
+    append_latency(&text, "exit", &stats.exit);
+    append_latency(&text, "state_store", &stats.store);
+
+    if (text.length > INT32_MAX) {
+        return -EOVERFLOW;
+    }
+
+    return (int)text.length;
+}
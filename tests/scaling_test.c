@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <CUnit/Basic.h>
+#include <CUnit/CUnit.h>
+
+#include <libivee/libivee.h>
+
+/*
+ * Multi-threaded test: each thread hammers ivee_call on its own environment,
+ * report how aggregate calls per second grow with the number of threads up to the number of physical cores.
+ *
+ * Scaling depends on the host too much to be checked everywhere: SMT, shared CI machines and nested KVM
+ * all skew it. Set IVEE_MIN_SCALING_EFFICIENCY to a minimal fraction of linear scaling to check it.
+ */
+
+#define MAX_THREADS         64
+#define RUN_TIME_NS         200000000ull
+
+struct worker {
+    pthread_t thread;
+    ivee_t* ivee;
+    pthread_barrier_t* barrier;
+    uint64_t calls;
+    int error;
+};
+
+static ivee_t* g_template;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void* worker_thread(void* arg)
+{
+    struct worker* w = arg;
+
+    pthread_barrier_wait(w->barrier);
+
+    uint64_t deadline = now_ns() + RUN_TIME_NS;
+    while (now_ns() < deadline) {
+        for (int i = 0; i < 64; ++i, ++w->calls) {
+            ivee_arch_state_t state = {
+                .rcx = w->calls,
+                .rdx = 1,
+            };
+
+            int res = ivee_call(w->ivee, &state);
+            if (res != 0 || state.rax != w->calls + 1) {
+                w->error = (res != 0 ? res : -1);
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Count online CPUs that are the first SMT sibling of their core, online CPU count if topology is unknown */
+static long count_physical_cores(void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long ncores = 0;
+
+    for (long cpu = 0; cpu < ncpus; ++cpu) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/topology/thread_siblings_list", cpu);
+
+        FILE* f = fopen(path, "r");
+        if (!f) {
+            return ncpus;
+        }
+
+        long first = -1;
+        int matched = fscanf(f, "%ld", &first);
+        fclose(f);
+
+        if (matched != 1) {
+            return ncpus;
+        }
+
+        if (first == cpu) {
+            ++ncores;
+        }
+    }
+
+    return (ncores > 0 ? ncores : ncpus);
+}
+
+/* Run nthreads workers on their own environments, returns aggregate calls per second */
+static double run_workers(size_t nthreads)
+{
+    struct worker workers[MAX_THREADS] = { 0 };
+    pthread_barrier_t barrier;
+    int res = 0;
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        workers[i].barrier = &barrier;
+
+        res = ivee_clone(g_template, &workers[i].ivee);
+        CU_ASSERT_TRUE_FATAL(res == 0);
+
+        res = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+        CU_ASSERT_TRUE_FATAL(res == 0);
+    }
+
+    uint64_t start = now_ns();
+    pthread_barrier_wait(&barrier);
+
+    uint64_t calls = 0;
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        CU_ASSERT_EQUAL(workers[i].error, 0);
+
+        calls += workers[i].calls;
+        ivee_destroy(workers[i].ivee);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+
+    return calls * 1e9 / elapsed;
+}
+
+static void scaling_test(void)
+{
+    long ncores = count_physical_cores();
+    if (ncores > MAX_THREADS) {
+        ncores = MAX_THREADS;
+    }
+
+    const char* min_efficiency = getenv("IVEE_MIN_SCALING_EFFICIENCY");
+
+    double single = run_workers(1);
+    printf("\n%4d threads: %12.0f calls/s\n", 1, single);
+    CU_ASSERT_TRUE(single > 0);
+
+    for (long nthreads = 2; nthreads <= ncores; nthreads *= 2) {
+        double rate = run_workers(nthreads);
+        double efficiency = rate / (single * nthreads);
+        printf("%4ld threads: %12.0f calls/s, %.2f of linear\n", nthreads, rate, efficiency);
+
+        CU_ASSERT_TRUE(rate > 0);
+        if (min_efficiency) {
+            CU_ASSERT_TRUE(efficiency >= atof(min_efficiency));
+        }
+    }
+}
+
+/* Oversubscribe cores and check that every call still returns correct results */
+static void max_threads_test(void)
+{
+    double rate = run_workers(MAX_THREADS);
+    printf("\n%4d threads: %12.0f calls/s\n", MAX_THREADS, rate);
+    CU_ASSERT_TRUE(rate > 0);
+}
+
+static int init_suite(void)
+{
+    int res = ivee_create(0, &g_template);
+    if (res != 0) {
+        return res;
+    }
+
+    return ivee_load_executable(g_template, "smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+}
+
+static int cleanup_suite(void)
+{
+    ivee_destroy(g_template);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (CUE_SUCCESS != CU_initialize_registry()) {
+        return CU_get_error();
+    }
+
+    CU_pSuite suite = CU_add_suite("scaling", init_suite, cleanup_suite);
+    if (NULL == suite) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    CU_add_test(suite, "scaling_test", scaling_test);
+    CU_add_test(suite, "max_threads_test", max_threads_test);
+
+    /* run tests */
+    CU_basic_set_mode(CU_BRM_VERBOSE);
+    CU_basic_run_tests();
+    int res = CU_get_error() || CU_get_number_of_tests_failed();
+
+    CU_cleanup_registry();
+    return res;
+}
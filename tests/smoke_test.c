@@ -1,8 +1,18 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
 
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
@@ -37,6 +47,1415 @@ static void smoke_test(const char* binary, ivee_executable_format_t format)
     ivee_destroy(ivee);
 }
 
+/*
+ * Clone a loaded template and call into both template and clone
+ */
+static void clone_smoke_test(const char* binary, ivee_executable_format_t format)
+{
+    int res = 0;
+    ivee_t* tmpl = NULL;
+    ivee_t* clone = NULL;
+
+    res = ivee_create(0, &tmpl);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(tmpl, binary, format);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_clone(tmpl, &clone);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_t* envs[] = { clone, tmpl };
+    for (size_t i = 0; i < sizeof(envs) / sizeof(*envs); ++i) {
+        ivee_arch_state_t state = {
+            .rax = 0,
+            .rcx = 0xDEADF00Dul,
+            .rdx = i,
+        };
+
+        res = ivee_call(envs[i], &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, 0xDEADF00Dul + i);
+    }
+
+    ivee_destroy(clone);
+    ivee_destroy(tmpl);
+}
+
+/*
+ * Acquire more environments from a pool than it holds and call into each
+ */
+static void pool_smoke_test(const char* binary, ivee_executable_format_t format)
+{
+    int res = 0;
+    ivee_pool_t* pool = NULL;
+    ivee_t* envs[3] = { NULL };
+
+    res = ivee_pool_create(binary, format, 2, &pool);
+    CU_ASSERT_TRUE(res == 0);
+
+    for (size_t i = 0; i < sizeof(envs) / sizeof(*envs); ++i) {
+        res = ivee_pool_acquire(pool, &envs[i]);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    for (size_t i = 0; i < sizeof(envs) / sizeof(*envs); ++i) {
+        ivee_arch_state_t state = {
+            .rax = 0,
+            .rcx = 0xDEADF00Dul,
+            .rdx = i,
+        };
+
+        res = ivee_call(envs[i], &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, 0xDEADF00Dul + i);
+
+        ivee_pool_release(pool, envs[i]);
+    }
+
+    ivee_pool_stats_t stats;
+    res = ivee_pool_get_stats(pool, &stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(stats.acquired, 3);
+    CU_ASSERT_TRUE(stats.empty <= 1);
+    CU_ASSERT_TRUE(stats.acquire_p50_ns <= stats.acquire_max_ns);
+
+    ivee_pool_destroy(pool);
+}
+
+/* Wait for pool refill thread to bring pool back to its size */
+static bool wait_pool_ready(ivee_pool_t* pool, uint64_t size)
+{
+    for (int i = 0; i < 5000; ++i) {
+        ivee_pool_stats_t stats;
+        if (ivee_pool_get_stats(pool, &stats) != 0) {
+            return false;
+        }
+
+        if (stats.ready == size) {
+            return true;
+        }
+
+        usleep(1000);
+    }
+
+    return false;
+}
+
+/*
+ * Environments come back from the pool without buffers mapped by their previous user
+ */
+static void pool_recycle_test(void)
+{
+    int res = 0;
+    ivee_pool_t* pool = NULL;
+    ivee_t* used[2] = { NULL };
+    uint64_t gva = 0;
+
+    void* buf = aligned_alloc(4096, 4096);
+    CU_ASSERT_TRUE_FATAL(buf != NULL);
+
+    res = ivee_pool_create("smoke_test_payload.elf64", IVEE_EXEC_ELF64, 2, &pool);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    for (int round = 0; round < 8; ++round) {
+        for (size_t i = 0; i < 2; ++i) {
+            res = ivee_pool_acquire(pool, &used[i]);
+            CU_ASSERT_TRUE_FATAL(res == 0);
+
+            res = ivee_map_buffer(used[i], buf, 4096, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gva);
+            CU_ASSERT_TRUE(res == 0);
+        }
+
+        /*
+         * Released environments are recycled only if pool is short of its size when refill thread gets to them,
+         * release them right after taking one more so that it does.
+         */
+        CU_ASSERT_TRUE_FATAL(wait_pool_ready(pool, 2));
+
+        ivee_t* ivee = NULL;
+        res = ivee_pool_acquire(pool, &ivee);
+        CU_ASSERT_TRUE_FATAL(res == 0);
+
+        ivee_pool_release(pool, used[0]);
+        ivee_pool_release(pool, used[1]);
+        ivee_pool_release(pool, ivee);
+
+        CU_ASSERT_TRUE_FATAL(wait_pool_ready(pool, 2));
+        for (size_t i = 0; i < 2; ++i) {
+            res = ivee_pool_acquire(pool, &used[i]);
+            CU_ASSERT_TRUE_FATAL(res == 0);
+
+            res = ivee_unmap_buffer(used[i], gva);
+            CU_ASSERT_EQUAL(res, -ENOENT);
+        }
+
+        ivee_pool_release(pool, used[0]);
+        ivee_pool_release(pool, used[1]);
+    }
+
+    ivee_pool_destroy(pool);
+    free(buf);
+}
+
+static uint64_t call_counter(ivee_t* ivee)
+{
+    ivee_arch_state_t state = { 0 };
+
+    int res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+
+    return state.rax;
+}
+
+/*
+ * Guest increments a counter in its data segment, check that reset brings it back to snapshot value
+ */
+static void reset_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "counter_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_reset(ivee);
+    CU_ASSERT_TRUE(res == -EINVAL);
+
+    res = ivee_snapshot(ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    CU_ASSERT_EQUAL(call_counter(ivee), 1);
+    CU_ASSERT_EQUAL(call_counter(ivee), 2);
+
+    res = ivee_reset(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 1);
+
+    /* Snapshot of modified memory */
+    res = ivee_snapshot(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 2);
+    CU_ASSERT_EQUAL(call_counter(ivee), 3);
+
+    res = ivee_reset(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 2);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * ELF segment with .bss: data is mapped from the file and .bss reads as zeroes
+ * in the loaded image, its clones and after reset
+ */
+static void elf64_bss_test(void)
+{
+    int res = 0;
+    ivee_t* tmpl = NULL;
+    ivee_t* clone = NULL;
+
+    res = ivee_create(0, &tmpl);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(tmpl, "bss_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_snapshot(tmpl);
+    CU_ASSERT_TRUE(res == 0);
+
+    CU_ASSERT_EQUAL(call_counter(tmpl), 42);
+    CU_ASSERT_EQUAL(call_counter(tmpl), 44);
+
+    res = ivee_clone(tmpl, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    CU_ASSERT_EQUAL(call_counter(clone), 42);
+
+    res = ivee_reset(tmpl);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(tmpl), 42);
+
+    ivee_destroy(clone);
+    ivee_destroy(tmpl);
+}
+
+static void* read_file(const char* path, size_t* size)
+{
+    FILE* f = fopen(path, "rb");
+    CU_ASSERT_TRUE_FATAL(f != NULL);
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    void* data = malloc(*size);
+    CU_ASSERT_TRUE_FATAL(data != NULL);
+    CU_ASSERT_EQUAL_FATAL(fread(data, 1, *size, f), *size);
+
+    fclose(f);
+    return data;
+}
+
+/*
+ * Load executables from memory and from an open file,
+ * neither buffer nor fd are needed once loading is done
+ */
+static void load_from_memory_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_t* clone = NULL;
+    size_t size = 0;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    void* data = read_file("bss_payload.elf64", &size);
+    res = ivee_load_executable_mem(ivee, data, size, IVEE_EXEC_ANY);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    memset(data, 0xCC, size);
+    free(data);
+
+    res = ivee_snapshot(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 42);
+    CU_ASSERT_EQUAL(call_counter(ivee), 44);
+
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    CU_ASSERT_EQUAL(call_counter(clone), 42);
+
+    res = ivee_reset(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 42);
+
+    ivee_destroy(clone);
+    ivee_destroy(ivee);
+
+    /* Not an ELF, guessing falls back to a flat binary */
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    data = read_file("smoke_test_payload.bin", &size);
+    res = ivee_load_executable_mem(ivee, data, size, IVEE_EXEC_ANY);
+    CU_ASSERT_TRUE(res == 0);
+    free(data);
+
+    ivee_arch_state_t state = { .rcx = 1, .rdx = 2 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 3);
+
+    ivee_destroy(ivee);
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    int fd = open("counter_payload.elf64", O_RDONLY);
+    CU_ASSERT_TRUE_FATAL(fd >= 0);
+    res = ivee_load_executable_fd(ivee, fd, IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+    close(fd);
+
+    CU_ASSERT_EQUAL(call_counter(ivee), 1);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Call counters and latencies show up in environment and process statistics
+ */
+static void stats_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_stats_t stats;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "counter_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    for (int i = 0; i < 3; ++i) {
+        call_counter(ivee);
+    }
+
+    res = ivee_get_stats(ivee, &stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(stats.calls, 3);
+    CU_ASSERT_EQUAL(stats.failed_calls, 0);
+    CU_ASSERT_EQUAL(stats.runs, 3);
+    CU_ASSERT_EQUAL(stats.pio_ports[0].port, 0x78);
+    CU_ASSERT_EQUAL(stats.pio_ports[0].exits, 3);
+    CU_ASSERT_EQUAL(stats.call.count, 3);
+    CU_ASSERT_EQUAL(stats.guest.count, 3);
+    CU_ASSERT_TRUE(stats.call.p50_ns <= stats.call.max_ns);
+    CU_ASSERT_TRUE(stats.guest.sum_ns <= stats.call.sum_ns);
+
+    ivee_destroy(ivee);
+
+    /* Destroyed environment is still accounted for */
+    res = ivee_get_process_stats(&stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_TRUE(stats.calls >= 3);
+
+    int length = ivee_format_process_stats(NULL, 0);
+    CU_ASSERT_TRUE_FATAL(length > 0);
+
+    char* text = malloc(length + 1);
+    CU_ASSERT_TRUE_FATAL(text != NULL);
+    CU_ASSERT_EQUAL(ivee_format_process_stats(text, length + 1), length);
+    CU_ASSERT_TRUE(strstr(text, "ivee_calls_total ") != NULL);
+    CU_ASSERT_TRUE(strstr(text, "ivee_pio_exits_total{port=\"0x78\"}") != NULL);
+    free(text);
+}
+
+/* Find symbol address in a perf map file */
+static uint64_t find_perf_map_symbol(const char* path, const char* name)
+{
+    FILE* file = fopen(path, "r");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+
+    uint64_t addr = 0;
+    uint64_t start, size;
+    char sym[256];
+    while (fscanf(file, "%" SCNx64 " %" SCNx64 " %255s", &start, &size, sym) == 3) {
+        if (strcmp(sym, name) == 0) {
+            addr = start;
+            break;
+        }
+    }
+
+    fclose(file);
+    return addr;
+}
+
+/*
+ * Guest symbols show up in perf map and resolve through ivee_symbolize, in clones as well
+ */
+static void symbolize_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_t* clone = NULL;
+    ivee_symbol_t sym;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "counter_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    char path[] = "/tmp/ivee-perf-XXXXXX";
+    int fd = mkstemp(path);
+    CU_ASSERT_TRUE_FATAL(fd >= 0);
+    close(fd);
+
+    res = ivee_write_perf_map(ivee, path);
+    CU_ASSERT_TRUE(res == 0);
+
+    uint64_t entry = find_perf_map_symbol(path, "entry");
+    uint64_t counter = find_perf_map_symbol(path, "counter");
+    unlink(path);
+    CU_ASSERT_TRUE_FATAL(entry != 0 && counter != 0);
+
+    /* Label without size covers code up to the end of its segment */
+    res = ivee_symbolize(ivee, entry + 3, &sym);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    CU_ASSERT_STRING_EQUAL(sym.name, "entry");
+    CU_ASSERT_EQUAL(sym.addr, entry);
+
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    ivee_destroy(ivee);
+
+    res = ivee_symbolize(clone, counter, &sym);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_STRING_EQUAL(sym.name, "counter");
+
+    res = ivee_symbolize(clone, 0x10, &sym);
+    CU_ASSERT_EQUAL(res, -ENOENT);
+
+    ivee_destroy(clone);
+
+    /* Flat binaries have no symbols */
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "smoke_test_payload.bin", IVEE_EXEC_BIN);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_symbolize(ivee, 0x400000, &sym);
+    CU_ASSERT_EQUAL(res, -ENOENT);
+
+    ivee_destroy(ivee);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Deadline stops a spinning guest, environment stays usable after that
+ */
+static void timeout_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "spin_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* Guest spins until deadline */
+    uint64_t start = monotonic_ns();
+    ivee_arch_state_t state = { .rcx = 0 };
+    res = ivee_call_timeout(ivee, &state, start + 50000000ull);
+    uint64_t elapsed = monotonic_ns() - start;
+    CU_ASSERT_EQUAL(res, -ETIMEDOUT);
+    CU_ASSERT_TRUE(elapsed >= 50000000ull && elapsed < 5000000000ull);
+
+    /* Environment is usable after timeout, deadlines that are not reached don't fire */
+    state.rcx = 5;
+    res = ivee_call_timeout(ivee, &state, monotonic_ns() + 1000000000ull);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 5);
+
+    state.rcx = 0;
+    res = ivee_call_timeout(ivee, &state, monotonic_ns() - 1);
+    CU_ASSERT_EQUAL(res, -ETIMEDOUT);
+
+    state.rcx = 6;
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 6);
+
+    ivee_destroy(ivee);
+}
+
+struct spin_call {
+    ivee_t* ivee;
+    int res;
+};
+
+static void* spin_call_thread(void* arg)
+{
+    struct spin_call* call = arg;
+    ivee_arch_state_t state = { .rcx = 0 };
+    call->res = ivee_call(call->ivee, &state);
+    return NULL;
+}
+
+/*
+ * Cancel a call spinning on another thread
+ */
+static void cancel_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "spin_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* Nothing to cancel yet */
+    res = ivee_cancel(ivee);
+    CU_ASSERT_EQUAL(res, -ESRCH);
+
+    struct spin_call call = { .ivee = ivee };
+    pthread_t thread;
+    res = pthread_create(&thread, NULL, spin_call_thread, &call);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* Retry until the call has started */
+    while ((res = ivee_cancel(ivee)) == -ESRCH) {
+        usleep(1000);
+    }
+
+    CU_ASSERT_TRUE(res == 0);
+
+    pthread_join(thread, NULL);
+    CU_ASSERT_EQUAL(call.res, -ECANCELED);
+
+    /* Cancellation does not carry over to the next call */
+    ivee_arch_state_t state = { .rcx = 7 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 7);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Guest calls host handlers without leaving the call, clones inherit registered handlers
+ */
+static int multiply_hypercall(void* ctx, ivee_arch_state_t* regs)
+{
+    (*(int*)ctx)++;
+    regs->rax = regs->rdi * regs->rsi;
+    return 0;
+}
+
+static int failing_hypercall(void* ctx, ivee_arch_state_t* regs)
+{
+    return -EPERM;
+}
+
+static void hypercall_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_t* clone = NULL;
+    int count = 0;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "hypercall_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_register_hypercall(ivee, IVEE_MAX_HYPERCALLS, multiply_hypercall, &count);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    res = ivee_register_hypercall(ivee, 1, multiply_hypercall, &count);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* Unregistered hypercalls return -ENOSYS to guest */
+    ivee_arch_state_t state = { .rcx = 6, .rdx = 7 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 42);
+    CU_ASSERT_EQUAL(state.rcx, (uint64_t)-ENOSYS);
+    CU_ASSERT_EQUAL(state.rdx, (uint64_t)-ENOSYS);
+    CU_ASSERT_EQUAL(count, 1);
+
+    /* Handler errors abort the call */
+    res = ivee_register_hypercall(ivee, 3, failing_hypercall, NULL);
+    CU_ASSERT_TRUE(res == 0);
+
+    state = (ivee_arch_state_t){ .rcx = 2, .rdx = 3 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_EQUAL(res, -EPERM);
+    CU_ASSERT_EQUAL(count, 2);
+
+    res = ivee_register_hypercall(ivee, 3, NULL, NULL);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    state = (ivee_arch_state_t){ .rcx = 3, .rdx = 5 };
+    res = ivee_call(clone, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 15);
+    CU_ASSERT_EQUAL(count, 3);
+
+    ivee_destroy(clone);
+    ivee_destroy(ivee);
+}
+
+/*
+ * Stream inputs into a guest that yields between them and keeps its state
+ */
+static void yield_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "yield_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* Nothing to resume before first yield */
+    ivee_arch_state_t state = { .rcx = 1 };
+    res = ivee_resume(ivee, &state);
+    CU_ASSERT_EQUAL(res, -ESRCH);
+
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_EQUAL(res, IVEE_CALL_YIELDED);
+    CU_ASSERT_EQUAL(state.rax, 1);
+
+    state.rcx = 2;
+    res = ivee_resume(ivee, &state);
+    CU_ASSERT_EQUAL(res, IVEE_CALL_YIELDED);
+    CU_ASSERT_EQUAL(state.rax, 3);
+
+    state.rcx = 0;
+    res = ivee_resume(ivee, &state);
+    CU_ASSERT_EQUAL(res, 0);
+    CU_ASSERT_EQUAL(state.rax, 3);
+
+    res = ivee_resume(ivee, &state);
+    CU_ASSERT_EQUAL(res, -ESRCH);
+
+    /* Calls start over from entry point even if previous one yielded */
+    state = (ivee_arch_state_t){ .rcx = 5 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_EQUAL(res, IVEE_CALL_YIELDED);
+
+    state = (ivee_arch_state_t){ .rcx = 7 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_EQUAL(res, IVEE_CALL_YIELDED);
+    CU_ASSERT_EQUAL(state.rax, 7);
+
+    /* Yielding is not a failure */
+    ivee_stats_t stats;
+    res = ivee_get_stats(ivee, &stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(stats.calls, 5);
+    CU_ASSERT_EQUAL(stats.failed_calls, 0);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Guest output written to log port is collected through coalesced ring and handed to log handler
+ */
+struct log_output {
+    uint8_t data[4096];
+    size_t size;
+};
+
+static void collect_log(void* ctx, const char* data, size_t size)
+{
+    struct log_output* log = ctx;
+    CU_ASSERT_TRUE_FATAL(size <= sizeof(log->data) - log->size);
+    memcpy(log->data + log->size, data, size);
+    log->size += size;
+}
+
+static void log_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_t* clone = NULL;
+    struct log_output log = { .size = 0 };
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "log_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* Dropped without handler */
+    ivee_arch_state_t state = { .rcx = 100 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_set_log_handler(ivee, collect_log, &log);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* More than coalesced ring holds */
+    state.rcx = 1000;
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(log.size, 1000);
+    for (size_t i = 0; i < log.size; ++i) {
+        CU_ASSERT_EQUAL_FATAL(log.data[i], (uint8_t)i);
+    }
+
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    log.size = 0;
+    state.rcx = 10;
+    res = ivee_call(clone, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(log.size, 10);
+
+    ivee_destroy(clone);
+    ivee_destroy(ivee);
+}
+
+/*
+ * Create environments on NUMA node 0 pinned to CPU 0 and run calls from a separate thread,
+ * pinning is sticky and would otherwise leak into other tests
+ */
+static void* placement_thread(void* arg)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_t* clone = NULL;
+
+    ivee_create_options_t options;
+    ivee_init_create_options(&options);
+    options.numa_node = 0;
+    options.cpus[0] = 1;
+
+    res = ivee_create_ex(&options, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    ivee_t* envs[] = { ivee, clone };
+    for (size_t i = 0; i < sizeof(envs) / sizeof(*envs); ++i) {
+        ivee_arch_state_t state = { .rcx = 0xDEADF00Dul, .rdx = i };
+        res = ivee_call(envs[i], &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, 0xDEADF00Dul + i);
+    }
+
+    cpu_set_t cpus;
+    res = sched_getaffinity(0, sizeof(cpus), &cpus);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(CPU_COUNT(&cpus), 1);
+    CU_ASSERT_TRUE(CPU_ISSET(0, &cpus));
+
+    ivee_destroy(clone);
+    ivee_destroy(ivee);
+    return NULL;
+}
+
+static void placement_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    ivee_create_options_t options;
+    ivee_init_create_options(&options);
+    /* IVEE_NUMA_NODE_ANY is the only valid negative node */
+    options.numa_node = -2;
+
+    res = ivee_create_ex(&options, &ivee);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    pthread_t thread;
+    res = pthread_create(&thread, NULL, placement_thread, NULL);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    pthread_join(thread, NULL);
+}
+
+/* Locked memory of this process in kB, from /proc/self/status */
+static long get_locked_memory(void)
+{
+    long locked = -1;
+    char line[256];
+
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmLck: %ld kB", &locked) == 1) {
+            break;
+        }
+    }
+
+    fclose(f);
+    return locked;
+}
+
+/*
+ * Low latency environments lock their memory through load, snapshot, reset and clone
+ */
+static void low_latency_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_t* clone = NULL;
+
+    long locked = get_locked_memory();
+    CU_ASSERT_TRUE_FATAL(locked >= 0);
+
+    ivee_create_options_t options;
+    ivee_init_create_options(&options);
+    options.flags = IVEE_CREATE_LOW_LATENCY;
+
+    res = ivee_create_ex(&options, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "counter_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    CU_ASSERT_TRUE(get_locked_memory() > locked);
+
+    res = ivee_snapshot(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 1);
+    CU_ASSERT_EQUAL(call_counter(ivee), 2);
+
+    res = ivee_reset(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 1);
+
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+    CU_ASSERT_EQUAL(call_counter(clone), 1);
+
+    ivee_destroy(clone);
+    ivee_destroy(ivee);
+    CU_ASSERT_EQUAL(get_locked_memory(), locked);
+
+    options.flags = ~0u;
+    res = ivee_create_ex(&options, &ivee);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+}
+
+/* Fill vector register bytes with dwords counting up from base */
+static void fill_vector(uint8_t* reg, size_t size, uint32_t base)
+{
+    for (size_t i = 0; i < size / sizeof(uint32_t); ++i) {
+        uint32_t value = base + i;
+        memcpy(reg + i * sizeof(value), &value, sizeof(value));
+    }
+}
+
+/* Check vector register bytes hold sums of dwords filled from two bases */
+static bool is_vector_sum(const uint8_t* reg, size_t size, uint32_t base_a, uint32_t base_b)
+{
+    for (size_t i = 0; i < size / sizeof(uint32_t); ++i) {
+        uint32_t value;
+        memcpy(&value, reg + i * sizeof(value), sizeof(value));
+        if (value != base_a + base_b + 2 * i) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Wait for a single asynchronous call completion */
+static bool wait_completion(int fd, ivee_completion_t* completion)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, 10000) != 1) {
+        return false;
+    }
+
+    return ivee_poll_completions(completion, 1) == 1;
+}
+
+/*
+ * Cancel an asynchronous call and make another one on the same environment
+ */
+static void async_cancel_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_completion_t completion;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "spin_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    int fd = ivee_completion_fd();
+    CU_ASSERT_TRUE_FATAL(fd >= 0);
+
+    ivee_arch_state_t state = { .rcx = 0 };
+    res = ivee_call_async(ivee, &state, NULL);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    while ((res = ivee_cancel(ivee)) == -ESRCH) {
+        usleep(1000);
+    }
+
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_TRUE_FATAL(wait_completion(fd, &completion));
+    CU_ASSERT_EQUAL(completion.result, -ECANCELED);
+
+    /* Kick that stopped the previous call must not stop this one */
+    state = (ivee_arch_state_t){ .rcx = 7 };
+    res = ivee_call_async(ivee, &state, NULL);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    bool completed = wait_completion(fd, &completion);
+    CU_ASSERT_TRUE(completed);
+    if (!completed) {
+        /* Don't hang in destroy waiting for it */
+        ivee_cancel(ivee);
+        wait_completion(fd, &completion);
+    } else {
+        CU_ASSERT_EQUAL(completion.result, 0);
+        CU_ASSERT_EQUAL(state.rax, 7);
+    }
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Call from a thread that blocks the kick signal and has one pending, like a deadline timer that fired late
+ */
+static void* blocked_kick_thread(void* arg)
+{
+    struct spin_call* call = arg;
+
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    /* Deadline in the past fires the timer right away, its kick stays pending after the call */
+    ivee_arch_state_t state = { .rcx = 7 };
+    call->res = ivee_call_timeout(call->ivee, &state, 1);
+    if (call->res != -ETIMEDOUT) {
+        call->res = -EINVAL;
+        return NULL;
+    }
+
+    state = (ivee_arch_state_t){ .rcx = 7 };
+    call->res = ivee_call(call->ivee, &state);
+    if (call->res == 0 && state.rax != 7) {
+        call->res = -EINVAL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Call from a thread that blocks the kick signal and has application's own one pending
+ */
+static void* blocked_signal_thread(void* arg)
+{
+    struct spin_call* call = arg;
+
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    pthread_kill(pthread_self(), SIGUSR1);
+
+    ivee_arch_state_t state = { .rcx = 7 };
+    call->res = ivee_call(call->ivee, &state);
+
+    /* Signal is not ours to consume */
+    sigset_t pending;
+    sigpending(&pending);
+    if (!sigismember(&pending, SIGUSR1)) {
+        call->res = -ENOENT;
+        return NULL;
+    }
+
+    struct timespec timeout = { 0 };
+    sigtimedwait(&sigset, NULL, &timeout);
+    return NULL;
+}
+
+static void blocked_kick_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "spin_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    struct spin_call call = { .ivee = ivee };
+    pthread_t thread;
+    res = pthread_create(&thread, NULL, blocked_kick_thread, &call);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    pthread_join(thread, NULL);
+    CU_ASSERT_EQUAL(call.res, 0);
+
+    /* Application signal keeps interrupting the call until application takes it */
+    res = pthread_create(&thread, NULL, blocked_signal_thread, &call);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    pthread_join(thread, NULL);
+    CU_ASSERT_EQUAL(call.res, -EINTR);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Pass vector registers through calls with every vector extension guest has
+ */
+static void vector_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    uint64_t features = ivee_list_vector_features();
+    CU_ASSERT_TRUE_FATAL(features & IVEE_VECTOR_SSE);
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    res = ivee_load_executable(ivee, "vector_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    static const struct {
+        uint64_t feature;
+        size_t size;
+    } modes[] = {
+        { IVEE_VECTOR_SSE, 16 },
+        { IVEE_VECTOR_AVX, 32 },
+        { IVEE_VECTOR_AVX512, 64 },
+    };
+
+    for (uint64_t mode = 0; mode < sizeof(modes) / sizeof(*modes); ++mode) {
+        if (!(features & modes[mode].feature)) {
+            continue;
+        }
+
+        ivee_vector_state_t vector_state;
+        memset(&vector_state, 0, sizeof(vector_state));
+        vector_state.mxcsr = IVEE_MXCSR_DEFAULT;
+        fill_vector(vector_state.zmm[0], 64, 1);
+        fill_vector(vector_state.zmm[1], 64, 1000);
+        fill_vector(vector_state.zmm[16], 64, 5);
+        fill_vector(vector_state.zmm[17], 64, 70);
+        vector_state.k[1] = 0x00ff;
+        vector_state.k[2] = 0xff00;
+
+        ivee_arch_state_t state = { .rcx = mode };
+        res = ivee_call_vector(ivee, &state, &vector_state);
+        if (res == -ENOTSUP && mode == 0) {
+            /* Some nested hypervisors fault on any guest vector instruction, nothing to check there */
+            ivee_destroy(ivee);
+            return;
+        }
+        CU_ASSERT_TRUE_FATAL(res == 0);
+
+        CU_ASSERT_TRUE(is_vector_sum(vector_state.zmm[0], modes[mode].size, 1, 1000));
+        CU_ASSERT_EQUAL(vector_state.mxcsr, IVEE_MXCSR_DEFAULT);
+
+        if (features & IVEE_VECTOR_AVX) {
+            /* CPUID.1:ECX.OSXSAVE */
+            CU_ASSERT_TRUE(state.rax & (1ull << 27));
+        }
+
+        if (modes[mode].feature != IVEE_VECTOR_SSE) {
+            /* x87, SSE and AVX state, AVX-512 state with it, nothing else */
+            CU_ASSERT_EQUAL(state.rdx & 0x7, 0x7);
+            CU_ASSERT_EQUAL(state.rdx & ~0xe7ull, 0);
+        }
+
+        if (modes[mode].feature == IVEE_VECTOR_AVX512) {
+            CU_ASSERT_TRUE(is_vector_sum(vector_state.zmm[16], 64, 5, 70));
+            CU_ASSERT_EQUAL(vector_state.k[1], 0xffff);
+        }
+    }
+
+    /* Plain calls leave vector registers alone */
+    ivee_arch_state_t state = { .rcx = 0 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Run calls on library VCPU threads and wait for completions on eventfd
+ */
+static void async_smoke_test(void)
+{
+    int res = 0;
+    ivee_t* tmpl = NULL;
+    ivee_t* envs[4] = { NULL };
+    ivee_arch_state_t states[4];
+
+    res = ivee_create(0, &tmpl);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(tmpl, "smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    int fd = ivee_completion_fd();
+    CU_ASSERT_TRUE(fd >= 0);
+
+    const size_t count = sizeof(envs) / sizeof(*envs);
+    for (size_t i = 0; i < count; ++i) {
+        res = ivee_clone(tmpl, &envs[i]);
+        CU_ASSERT_TRUE(res == 0);
+
+        states[i] = (ivee_arch_state_t) {
+            .rcx = 0xDEADF00Dul,
+            .rdx = i,
+        };
+
+        res = ivee_call_async(envs[i], &states[i], &states[i]);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    /* Environment with an undrained call should not accept another one */
+    res = ivee_call_async(envs[0], &states[0], NULL);
+    CU_ASSERT_TRUE(res == -EBUSY);
+
+    size_t completed = 0;
+    while (completed < count) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        res = poll(&pfd, 1, 10000);
+        CU_ASSERT_TRUE_FATAL(res == 1);
+
+        ivee_completion_t completions[4];
+        int n = ivee_poll_completions(completions, sizeof(completions) / sizeof(*completions));
+        for (int i = 0; i < n; ++i) {
+            ivee_arch_state_t* state = completions[i].cookie;
+            CU_ASSERT_EQUAL(completions[i].result, 0);
+            CU_ASSERT_EQUAL(state->rax, 0xDEADF00Dul + (state - states));
+        }
+
+        completed += n;
+    }
+
+    CU_ASSERT_EQUAL(ivee_poll_completions(NULL, 0), 0);
+
+    for (size_t i = 0; i < count; ++i) {
+        ivee_destroy(envs[i]);
+    }
+
+    ivee_destroy(tmpl);
+}
+
+/*
+ * Ask for huge pages and make sure whatever backing we got works
+ */
+static void memory_backing_test(void)
+{
+    int res = 0;
+    ivee_t* tmpl = NULL;
+    ivee_t* clone = NULL;
+    ivee_memory_backing_t backing;
+
+    res = ivee_create(0, &tmpl);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_set_memory_backing(tmpl, IVEE_MEMORY_HUGETLB_1G + 1);
+    CU_ASSERT_TRUE(res == -EINVAL);
+
+    res = ivee_set_memory_backing(tmpl, IVEE_MEMORY_HUGETLB_2M);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(tmpl, "counter_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_get_memory_backing(tmpl, &backing);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_TRUE(backing <= IVEE_MEMORY_HUGETLB_2M);
+
+    res = ivee_clone(tmpl, &clone);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    ivee_memory_backing_t clone_backing;
+    res = ivee_get_memory_backing(clone, &clone_backing);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(clone_backing, backing);
+
+    res = ivee_snapshot(clone);
+    CU_ASSERT_TRUE(res == 0);
+
+    for (int i = 0; i < 2; ++i) {
+        ivee_arch_state_t state = { 0 };
+        res = ivee_call(clone, &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, 1);
+
+        res = ivee_reset(clone);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    ivee_destroy(clone);
+    ivee_destroy(tmpl);
+}
+
+/*
+ * Let guest modify a host buffer in place, across snapshot resets
+ */
+static void buffer_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    /* Large enough for guest to map part of it with 2MiB pages */
+    const size_t length = 3 * 2 * 1024 * 1024 + 64 * 4096;
+    const size_t count = length / sizeof(uint64_t);
+
+    uint64_t* buf = aligned_alloc(4096, length);
+    CU_ASSERT_TRUE_FATAL(buf != NULL);
+
+    for (size_t i = 0; i < count; ++i) {
+        buf[i] = i;
+    }
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "buffer_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_snapshot(ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    uint64_t gva = 0;
+    res = ivee_map_buffer(ivee, (uint8_t*)buf + 1, length, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gva);
+    CU_ASSERT_TRUE(res == -EINVAL);
+
+    /* Guest page tables can't take reads away */
+    res = ivee_map_buffer(ivee, buf, length, IVEE_BUFFER_WRITE, &gva);
+    CU_ASSERT_TRUE(res == -EINVAL);
+
+    res = ivee_map_buffer(ivee, buf, length, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gva);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    for (int pass = 1; pass <= 3; ++pass) {
+        ivee_arch_state_t state = { .rdi = gva, .rsi = count };
+        res = ivee_call(ivee, &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, count * (count - 1) / 2 + count * pass);
+        CU_ASSERT_EQUAL(buf[count - 1], count - 1 + pass);
+
+        /* Buffer is not part of the snapshot and stays mapped */
+        res = ivee_reset(ivee);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    res = ivee_unmap_buffer(ivee, gva + 4096);
+    CU_ASSERT_TRUE(res == -ENOENT);
+
+    res = ivee_unmap_buffer(ivee, gva);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_destroy(ivee);
+    free(buf);
+}
+
+/*
+ * Map more buffers than a fixed memory slot table would take.
+ * Pages of one host allocation mapped in reverse order end up contiguous in guest memory.
+ */
+static void many_buffers_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    enum { NR_PAGES = 256, NR_BUFFERS = 256 };
+
+    uint64_t* pages = aligned_alloc(4096, NR_PAGES * 4096);
+    CU_ASSERT_TRUE_FATAL(pages != NULL);
+
+    void* buffers[NR_BUFFERS];
+    uint64_t buffer_gvas[NR_BUFFERS];
+    for (size_t i = 0; i < NR_BUFFERS; ++i) {
+        buffers[i] = aligned_alloc(4096, 4096);
+        CU_ASSERT_TRUE_FATAL(buffers[i] != NULL);
+    }
+
+    const size_t count = NR_PAGES * 4096 / sizeof(uint64_t);
+    for (size_t i = 0; i < count; ++i) {
+        pages[i] = i;
+    }
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "buffer_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    uint64_t page_gvas[NR_PAGES];
+    for (size_t i = NR_PAGES; i-- > 0; ) {
+        res = ivee_map_buffer(ivee, (uint8_t*)pages + i * 4096, 4096, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &page_gvas[i]);
+        CU_ASSERT_TRUE_FATAL(res == 0);
+    }
+
+    for (size_t i = 0; i < NR_BUFFERS; ++i) {
+        res = ivee_map_buffer(ivee, buffers[i], 4096, IVEE_BUFFER_READ, &buffer_gvas[i]);
+        CU_ASSERT_TRUE_FATAL(res == 0);
+    }
+
+    for (size_t i = 1; i < NR_PAGES; ++i) {
+        CU_ASSERT_EQUAL(page_gvas[i], page_gvas[0] + i * 4096);
+    }
+
+    ivee_arch_state_t state = { .rdi = page_gvas[0], .rsi = count };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, count * (count + 1) / 2);
+
+    /* Unmap every other buffer, the rest should stay mapped */
+    for (size_t i = 0; i < NR_PAGES; i += 2) {
+        res = ivee_unmap_buffer(ivee, page_gvas[i]);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    state = (ivee_arch_state_t) { .rdi = page_gvas[1], .rsi = 4096 / sizeof(uint64_t) };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(pages[4096 / sizeof(uint64_t)], 4096 / sizeof(uint64_t) + 2);
+
+    ivee_destroy(ivee);
+
+    for (size_t i = 0; i < NR_BUFFERS; ++i) {
+        free(buffers[i]);
+    }
+
+    free(pages);
+}
+
+/*
+ * Push calls through a ring served by a resident guest loop
+ */
+static void ring_smoke_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_ring_t* ring = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "ring_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_ring_create(ivee, 16, &ring);
+    CU_ASSERT_TRUE_FATAL(res == 0);
+
+    /* Environment belongs to the ring until it is destroyed */
+    ivee_arch_state_t state = { 0 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == -EBUSY);
+
+    const uint64_t count = 10000;
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    while (completed < count) {
+        ivee_ring_sqe_t sqes[8];
+        size_t nsqes = 0;
+        for (; nsqes < 8 && submitted + nsqes < count; ++nsqes) {
+            sqes[nsqes] = (ivee_ring_sqe_t) {
+                .user_data = submitted + nsqes,
+                .args = { submitted + nsqes, 0xDEADF00Dul },
+            };
+        }
+
+        res = ivee_ring_submit(ring, sqes, nsqes);
+        CU_ASSERT_TRUE_FATAL(res >= 0);
+        submitted += res;
+
+        ivee_ring_cqe_t cqes[8];
+        res = ivee_ring_reap(ring, cqes, 8);
+        CU_ASSERT_TRUE_FATAL(res >= 0);
+        for (int i = 0; i < res; ++i) {
+            CU_ASSERT_EQUAL(cqes[i].user_data, completed + i);
+            CU_ASSERT_EQUAL(cqes[i].result[0], completed + i + 0xDEADF00Dul);
+        }
+
+        completed += res;
+    }
+
+    ivee_ring_destroy(ring);
+    ivee_destroy(ivee);
+}
+
 static void raw_binary_smoke_test(void)
 {
     smoke_test("smoke_test_payload.bin", IVEE_EXEC_BIN);
@@ -47,6 +1466,21 @@ static void elf64_smoke_test(void)
     smoke_test("smoke_test_payload.elf64", IVEE_EXEC_ELF64);
 }
 
+static void raw_binary_clone_smoke_test(void)
+{
+    clone_smoke_test("smoke_test_payload.bin", IVEE_EXEC_BIN);
+}
+
+static void elf64_clone_smoke_test(void)
+{
+    clone_smoke_test("smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+}
+
+static void elf64_pool_smoke_test(void)
+{
+    pool_smoke_test("smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+}
+
 int main(int argc, char** argv)
 {
     if (CUE_SUCCESS != CU_initialize_registry()) {
@@ -61,6 +1495,30 @@ int main(int argc, char** argv)
 
     CU_add_test(suite, "raw_binary_smoke_test", raw_binary_smoke_test);
     CU_add_test(suite, "elf64_smoke_test", elf64_smoke_test);
+    CU_add_test(suite, "raw_binary_clone_smoke_test", raw_binary_clone_smoke_test);
+    CU_add_test(suite, "elf64_clone_smoke_test", elf64_clone_smoke_test);
+    CU_add_test(suite, "elf64_pool_smoke_test", elf64_pool_smoke_test);
+    CU_add_test(suite, "pool_recycle_test", pool_recycle_test);
+    CU_add_test(suite, "reset_test", reset_test);
+    CU_add_test(suite, "elf64_bss_test", elf64_bss_test);
+    CU_add_test(suite, "load_from_memory_test", load_from_memory_test);
+    CU_add_test(suite, "stats_test", stats_test);
+    CU_add_test(suite, "symbolize_test", symbolize_test);
+    CU_add_test(suite, "timeout_test", timeout_test);
+    CU_add_test(suite, "cancel_test", cancel_test);
+    CU_add_test(suite, "async_cancel_test", async_cancel_test);
+    CU_add_test(suite, "blocked_kick_test", blocked_kick_test);
+    CU_add_test(suite, "hypercall_test", hypercall_test);
+    CU_add_test(suite, "log_test", log_test);
+    CU_add_test(suite, "placement_test", placement_test);
+    CU_add_test(suite, "low_latency_test", low_latency_test);
+    CU_add_test(suite, "vector_test", vector_test);
+    CU_add_test(suite, "yield_test", yield_test);
+    CU_add_test(suite, "async_smoke_test", async_smoke_test);
+    CU_add_test(suite, "memory_backing_test", memory_backing_test);
+    CU_add_test(suite, "buffer_test", buffer_test);
+    CU_add_test(suite, "many_buffers_test", many_buffers_test);
+    CU_add_test(suite, "ring_smoke_test", ring_smoke_test);
 
     /* run tests */
     CU_basic_set_mode(CU_BRM_VERBOSE);